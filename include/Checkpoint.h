@@ -0,0 +1,89 @@
+// Saving and restoring the state of the event builder between file sets, so
+// that after a crash it can pick up where it left off (see -r).
+//
+// A checkpoint is a flat binary file in the machine's own byte order.  It
+// is only meant to be read back by the same build of the event builder on
+// the same machine, so there is a version number but no attempt at
+// portability.  It is written to a temporary name and renamed into place,
+// so there is always one complete checkpoint, old or new.
+//
+// Needs stdint.h, string.h, string, vector and USBstreamUtils.h.
+
+static const uint32_t CHECKPOINT_MAGIC = 0x45424350; // "EBCP"
+static const uint32_t CHECKPOINT_VERSION = 6;
+
+class CheckpointWriter {
+
+public:
+
+  // Appends a plain value
+  template<typename T> void put(const T & x)
+  {
+    buf.insert(buf.end(), (const char *)&x, (const char *)&x + sizeof x);
+  }
+
+  void put(const std::string & s);
+  void put(const std::vector<decoded_packet> & packets);
+
+  // Appends bytes that are already in checkpoint format
+  void put_raw(const char * const data, const size_t len);
+
+  // Writes everything put so far to 'name', replacing what was there.
+  // Returns false, having logged why, if it couldn't.
+  bool commit(const std::string & name);
+
+  // Everything put so far, for sending elsewhere instead (see
+  // RemoteStream.h)
+  const std::vector<char> & data() const { return buf; }
+
+private:
+
+  std::vector<char> buf;
+};
+
+class CheckpointReader {
+
+public:
+
+  CheckpointReader() { pos = 0; bad = false; }
+
+  // Reads in the whole checkpoint.  Returns false if it can't be read.
+  bool load(const std::string & name);
+
+  // Reads from 'data' instead, taking its contents and leaving it empty
+  void take(std::vector<char> & data)
+  {
+    buf.clear();
+    buf.swap(data);
+    pos = 0;
+    bad = false;
+  }
+
+  // Reads a plain value.  Once anything has failed to be read, sets
+  // everything to zero and good() returns false.
+  template<typename T> void get(T & x)
+  {
+    if(bad || pos + sizeof x > buf.size()){
+      bad = true;
+      memset(&x, 0, sizeof x);
+      return;
+    }
+    memcpy(&x, &buf[pos], sizeof x);
+    pos += sizeof x;
+  }
+
+  void get(std::string & s);
+  void get(std::vector<decoded_packet> & packets);
+
+  // True if everything read so far was really there
+  bool good() const { return !bad; }
+
+  // True if we've read exactly the whole checkpoint
+  bool done() const { return !bad && pos == buf.size(); }
+
+private:
+
+  std::vector<char> buf;
+  size_t pos;
+  bool bad;
+};
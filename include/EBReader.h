@@ -0,0 +1,244 @@
+// Reader for the EBuilder output format described in README.txt, for use
+// by anything downstream.  Everything is in this header; there is nothing
+// to link against.
+//
+// The file is mapped into memory and read in place.  Events, module packets
+// and hits are handed out as small views that point into the mapping, so
+// nothing is copied unless you ask for it with read_hits(), which fills
+// flat arrays (one per field) for code that wants to loop over many hits.
+//
+// Typical use:
+//
+//   EBFile f;
+//   if(!f.open("run_00000")) { puts(f.error()); ... }
+//   EBEvent ev;
+//   while(f.next(ev))
+//     for(EBPacket p = ev.first(); p.valid(); p = p.next())
+//       for(unsigned int i = 0; i < p.nhits(); i++)
+//         use(ev.time_sec(), p.module(), p.time16ns(), p.hit(i).channel, ...);
+//   if(f.error()) ...
+//
+// Needs stdint.h, string.h, fcntl.h, unistd.h, sys/mman.h, sys/stat.h,
+// arpa/inet.h and vector.
+
+// Read big endian numbers from possibly unaligned places
+static inline uint16_t eb_get16(const uint8_t * const p)
+{
+  uint16_t x;
+  memcpy(&x, p, sizeof x);
+  return ntohs(x);
+}
+
+static inline uint32_t eb_get32(const uint8_t * const p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof x);
+  return ntohl(x);
+}
+
+struct EBHit {
+  uint8_t channel;
+  int16_t charge;
+};
+
+// A module packet.  Only made by EBEvent, which has already checked it.
+class EBPacket {
+
+public:
+
+  EBPacket(const uint8_t * const p_, const uint8_t * const end_)
+  {
+    p = p_;
+    end = end_;
+  }
+
+  // False once we've gone past the last packet of the event
+  bool valid() const { return p < end; }
+
+  uint8_t nhits() const { return p[1]; }
+  uint16_t module() const { return eb_get16(p + 2); }
+  uint32_t time16ns() const { return eb_get32(p + 4); }
+
+  EBHit hit(const unsigned int i) const
+  {
+    const uint8_t * const h = p + 8 + 4*i;
+    EBHit hit;
+    hit.channel = h[1];
+    hit.charge = (int16_t)eb_get16(h + 2);
+    return hit;
+  }
+
+  EBPacket next() const { return EBPacket(p + 8 + 4*nhits(), end); }
+
+  // The raw bytes of this packet in the file
+  const uint8_t * bytes() const { return p; }
+  uint32_t size() const { return 8 + 4*nhits(); }
+
+private:
+
+  const uint8_t * p, * end;
+};
+
+class EBEvent {
+
+public:
+
+  EBEvent() { p = NULL; len = 0; }
+
+  uint16_t npackets() const { return eb_get16(p + 2); }
+  uint32_t time_sec() const { return eb_get32(p + 4); }
+
+  EBPacket first() const { return EBPacket(p + 8, p + len); }
+
+  // The raw bytes of this event in the file
+  const uint8_t * bytes() const { return p; }
+  uint32_t size() const { return len; }
+
+private:
+
+  friend class EBFile;
+  const uint8_t * p;
+  uint32_t len;
+};
+
+// Hits from many events, one array per field.  Entry i of each array
+// describes the same hit.
+struct EBHitArrays {
+  void clear()
+  {
+    event.clear(); time_sec.clear(); module.clear(); time16ns.clear();
+    channel.clear(); charge.clear();
+  }
+
+  std::vector<uint32_t> event;  // Which event, counting from zero in the file
+  std::vector<uint32_t> time_sec;
+  std::vector<uint16_t> module;
+  std::vector<uint32_t> time16ns;
+  std::vector<uint8_t>  channel;
+  std::vector<int16_t>  charge;
+};
+
+class EBFile {
+
+public:
+
+  EBFile() { base = NULL; size = 0; pos = 0; nevents = 0; stopped = false;
+             err = NULL; }
+
+  ~EBFile() { close(); }
+
+  // Maps the file in.  Returns false, and sets error(), on failure.
+  bool open(const char * const name)
+  {
+    close();
+
+    const int fd = ::open(name, O_RDONLY);
+    if(fd < 0) return fail("could not open file");
+
+    struct stat st;
+    if(fstat(fd, &st) < 0){ ::close(fd); return fail("could not stat file"); }
+    size = st.st_size;
+
+    if(size > 0){
+      void * const m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(m == MAP_FAILED){ ::close(fd); return fail("could not map file"); }
+      base = (const uint8_t *)m;
+      madvise(m, size, MADV_SEQUENTIAL);
+    }
+
+    ::close(fd);
+    return true;
+  }
+
+  void close()
+  {
+    if(base) munmap((void *)base, size);
+    base = NULL;
+    size = pos = 0;
+    nevents = 0;
+    stopped = false;
+    err = NULL;
+  }
+
+  // Gets the next event.  Returns false at the end-of-run marker, at the
+  // end of the file, or if the file is malformed, in which case error()
+  // says what was wrong.
+  bool next(EBEvent & ev)
+  {
+    if(err || stopped || pos == size) return false;
+
+    const uint8_t * const p = base + pos;
+    const uint64_t left = size - pos;
+
+    if(left >= 4 && eb_get32(p) == 0x53544F50){ // "STOP"
+      stopped = true;
+      pos += 4;
+      return false;
+    }
+
+    if(left < 8) return fail("file ends in the middle of an event header");
+    if(eb_get16(p) != 0x4556) return fail("bad event magic number");
+
+    // Check all the magic numbers and find where the event ends
+    const uint16_t npackets = eb_get16(p + 2);
+    uint64_t off = 8;
+    for(unsigned int i = 0; i < npackets; i++){
+      if(off + 8 > left) return fail("file ends in the middle of a packet");
+      if(p[off] != 'M') return fail("bad module packet magic number");
+
+      const unsigned int nhits = p[off + 1];
+      off += 8;
+      if(off + 4*nhits > left) return fail("file ends in the middle of a hit");
+      for(unsigned int h = 0; h < nhits; h++)
+        if(p[off + 4*h] != 'H') return fail("bad hit magic number");
+      off += 4*nhits;
+    }
+
+    ev.p = p;
+    ev.len = off;
+    pos += off;
+    nevents++;
+    return true;
+  }
+
+  // Appends the hits of up to 'maxevents' more events to 'out'.  Returns
+  // the number of events read.
+  unsigned int read_hits(EBHitArrays & out, const unsigned int maxevents)
+  {
+    EBEvent ev;
+    unsigned int n = 0;
+    while(n < maxevents && next(ev)){
+      for(EBPacket pk = ev.first(); pk.valid(); pk = pk.next()){
+        const unsigned int nhits = pk.nhits();
+        for(unsigned int i = 0; i < nhits; i++){
+          const EBHit hit = pk.hit(i);
+          out.event.push_back(nevents - 1);
+          out.time_sec.push_back(ev.time_sec());
+          out.module.push_back(pk.module());
+          out.time16ns.push_back(pk.time16ns());
+          out.channel.push_back(hit.channel);
+          out.charge.push_back(hit.charge);
+        }
+      }
+      n++;
+    }
+    return n;
+  }
+
+  // Whether we've reached the end-of-run marker.  If we got to the end of
+  // the file without that, it may still be being written.
+  bool complete() const { return stopped; }
+
+  // What went wrong, or NULL if nothing did
+  const char * error() const { return err; }
+
+private:
+
+  bool fail(const char * const why) { err = why; return false; }
+
+  const uint8_t * base;
+  uint64_t size, pos;
+  uint32_t nevents;
+  bool stopped;
+  const char * err;
+};
@@ -0,0 +1,105 @@
+// libebuilder: the decoding, merging and event forming of the event builder,
+// to run inside the DAQ itself.  Rather than writing each USB stream to a
+// file for EventBuilder to find, read back, decode and move out of the way,
+// the DAQ pushes what it reads from each USB straight in, and gets the
+// built events back, in the output format (see README.txt) without the
+// end-of-run marker.
+//
+//   EBuilder eb;
+//   for each USB:    j = eb.add_usb(serial);
+//   for each board:  eb.add_module(serial, board, pmtboard_u, pipedelay);
+//   eb.set_threshold(73, kDoubleLayer);
+//
+//   // Optionally, the baseline data of every USB first
+//   eb.push_baseline(j, data, n); ...
+//   eb.end_baselines();
+//
+//   // Then, as the data comes in
+//   eb.push(j, data, n);
+//   eb.build();
+//   eb.pull(events); // Unless set_sink() was used
+//
+//   // At the end of the run
+//   eb.finish();
+//   eb.pull(events);
+//
+// Everything belongs to the EBuilder, so there can be several in one
+// process, for instance one per partition, but each must only be used by
+// one thread at a time.  Everything is done in the calling thread.  Like
+// the event builder, it logs with log_msg(), which exits on LOG_CRIT, so
+// bad setup arguments and baseline data are logged as errors and refused
+// instead.
+//
+// Needs stdint.h, stddef.h, arpa/inet.h, fstream, deque, map, string,
+// vector, USBstreamUtils.h, USBstream.h and EventMerger.h.
+
+class EBuilder {
+
+public:
+
+  // What to do with built events instead of keeping them for pull(): gets
+  // 'n' bytes of one or more whole events and 'context' as given to
+  // set_sink().  The bytes are only good until it returns.
+  typedef void (*EventSink)(void * context, const char * events,
+                            const size_t n);
+
+  EBuilder();
+  ~EBuilder();
+
+  // Setting up, before anything is pushed.  add_usb() returns the index of
+  // the USB with this serial number, for push().  Boards are given as in
+  // the configuration file (see README.txt), with their USB's serial number,
+  // the module number to write in the output and the timing offset.
+  // add_module() returns false if the board number is out of range.
+  unsigned int add_usb(const int serial);
+  bool add_module(const int serial, const int board, const uint16_t module,
+                  const int offset);
+  void set_threshold(const int threshold, const TriggerMode mode);
+  void set_sink(EventSink sink, void * context);
+
+  // Decodes 'n' bytes of baseline data from USB j.  After every USB's
+  // baseline data, end_baselines() works out the baselines and makes ready
+  // for the run.  Without them, nothing is subtracted from the charges.
+  // end_baselines() returns false if any USB's baseline data had a module
+  // or channel number out of range, leaving that USB without baselines.
+  void push_baseline(const unsigned int j, const char * const data,
+                     const size_t n);
+  bool end_baselines();
+
+  // Decodes 'n' bytes of data from USB j, just as read from it.  They can be
+  // cut anywhere, and are not copied or kept after this returns, except
+  // for what comes before the USB's first Unix time stamp.
+  void push(const unsigned int j, const char * const data, const size_t n);
+
+  // Forms events out of everything that has been pushed for every USB, up
+  // to the latest Unix time stamp, and gives them to the sink or keeps them
+  // for pull().  Returns the number of events.
+  unsigned int build();
+
+  // Forms events out of everything left, for the end of the run, as build()
+  // does but without waiting for the next Unix time stamp, or for the next
+  // data to finish the last event.  Returns the number of events.
+  unsigned int finish();
+
+  // Moves the events built so far to the end of 'events', in order
+  void pull(std::vector<char> & events);
+
+private:
+
+  static unsigned int build_events(void * eb,
+                                   const std::vector<decoded_packet> & packets,
+                                   const std::vector<int> & usbs);
+  void deliver();
+
+  std::vector<USBstream *> streams;
+  std::map<std::pair<int, int>, uint16_t> modules; // By USB serial and board
+  int64_t firstcount; // See USBstream::SetFirstCount()
+
+  std::vector< std::vector<decoded_packet> > decoded; // Not yet merged
+  EventMerger merger;
+  std::vector<uint16_t> packetmodules; // For SerializeEvent()
+  std::vector<char> built;
+
+  EventSink sink;
+  void * sinkcontext;
+};
@@ -0,0 +1,71 @@
+// Merges the time-ordered streams of decoded packets from each USB into
+// events.  Packets that might still be part of an event continued by the
+// next data are held over until the next call.
+//
+// Needs vector and USBstreamUtils.h.
+
+class RunSummary;
+
+// True if 'next' starts a new event after 'prev', which is when there is a
+// gap of more than 3 clock ticks between them.  The merged stream can be cut
+// anywhere this is true without changing which events are built.
+inline bool StartsNewEvent(const decoded_packet & prev,
+                           const decoded_packet & next)
+{
+  return LessThan(prev, next, 3);
+}
+
+// Returns 'i', or if an event is going on there, where the next one starts
+size_t NextEventStart(const std::vector<decoded_packet> & packets, size_t i);
+
+// Forms the events in packets 'begin' to 'end', which are moved on to where
+// events start, and serializes them onto 'buf', skipping packets without
+// any of the bits in 'mask' set in their tags.  'modules' gives the output
+// module number of each packet.  The end of each event in 'buf' goes on
+// 'eventends', and each event is counted in 'summary', if given.  Returns
+// the number of events.
+unsigned int SerializeEvents(const std::vector<decoded_packet> & packets,
+                             const size_t begin, const size_t end,
+                             const uint16_t * const modules,
+                             const uint8_t mask, std::vector<char> & buf,
+                             std::vector<size_t> * const eventends = NULL,
+                             RunSummary * const summary = NULL);
+
+class EventMerger {
+
+public:
+
+  // What to do with the events: gets the merged packets of one or more
+  // whole events, in time order, and for each packet the index of the USB
+  // stream it came from, and 'context' as given to SuperBuildEvents().
+  // Returns the number of events.
+  typedef unsigned int (*EventHandler)(
+    void * context,
+    const std::vector<decoded_packet> & in_packets,
+    const std::vector<int> & OutIndex);
+
+  // Streams marked in 'absent', if given, are merged while they have
+  // packets, but not waited for when they run out (see -g).
+  unsigned int SuperBuildEvents(
+    std::vector< std::vector<decoded_packet> > & CurrentData,
+    const unsigned int numUSB, EventHandler BuildEvents,
+    void * context = NULL, const bool * const absent = NULL);
+
+  // Throws out the packets at the start of 'packets' that come before the
+  // last one merged, so could only be built out of order, for a stream
+  // coming back after being absent.  Returns how many.
+  unsigned int DropLate(std::vector<decoded_packet> & packets) const;
+
+  // Gives the events held over to 'BuildEvents' as SuperBuildEvents() does,
+  // for when no more data will come.  Returns the number of events.
+  unsigned int FlushEvents(EventHandler BuildEvents, void * context = NULL);
+
+  // Carries events from last timestamp
+  std::vector<decoded_packet> ExtraData;
+  std::vector<int> ExtraIndex;
+
+private:
+
+  std::vector<decoded_packet> MinData; // Merged packets so far
+  std::vector<int> MinIndex; // USB index of each of MinData
+};
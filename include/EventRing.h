@@ -0,0 +1,151 @@
+// A ring buffer of built events in POSIX shared memory, so that online
+// consumers on the same machine can see events as soon as they are built
+// instead of waiting for the output file to be closed.
+//
+// There is one writer, the event builder, and any number of readers.  The
+// writer never waits for readers.  A reader that falls more than a ring's
+// worth behind loses the events it didn't get to, and is told how many.
+//
+// Each event is stored as a 16 byte record header followed by the event
+// in exactly the output file format (see README.txt), padded to a
+// multiple of 16 bytes.  Records never wrap around the end of the ring, so
+// a reader can use an event in place without copying it.  To make that
+// safe, the reader checks *after* using an event that the writer hasn't
+// started to overwrite it in the meantime.
+//
+// Needs sys/mman.h, fcntl.h, unistd.h and stdint.h.
+
+static const uint32_t EVENTRING_MAGIC = 0x45565247; // "EVRG"
+
+struct EventRingHeader {
+  uint32_t magic;
+  uint32_t headersize; // Offset of the data area from the start
+  uint64_t size;       // Size of the data area. A power of two.
+
+  // Positions in the data area count bytes ever written, and are taken
+  // modulo 'size' to find the place in memory.  Only read and written with
+  // __atomic builtins.  Everything from 'begin' to 'end' is intact.
+  uint64_t begin;
+  uint64_t end;
+};
+
+struct EventRingRecord {
+  uint32_t reclen; // Length of this record including this header and padding
+  uint32_t evlen;  // Length of the event, or EVENTRING_PAD if none
+  uint64_t seq;    // Sequence number of this event, counting from zero
+};
+
+// 'evlen' of a record that only fills up space at the end of the ring
+static const uint32_t EVENTRING_PAD = 0xffffffff;
+
+class EventRingWriter {
+
+public:
+
+  EventRingWriter() { header = NULL; data = NULL; seq = 0; }
+
+  // Creates or replaces the shared memory object 'name' with a ring of
+  // 'size' bytes, rounded up to a power of two.
+  bool open(const char * const name, const uint64_t size);
+
+  // Publishes one serialized event.  Never blocks.
+  void publish(const char * const ev, const uint32_t len);
+
+private:
+
+  void reclaim(const uint64_t upto);
+
+  EventRingHeader * header;
+  char * data;
+  uint64_t seq;
+};
+
+class EventRingReader {
+
+public:
+
+  EventRingReader() { header = NULL; data = NULL; pos = 0; lastpos = 0;
+                      nextseq = 0; lost = 0; started = false; }
+
+  ~EventRingReader()
+  {
+    if(header) munmap(header, header->headersize + header->size);
+  }
+
+  // Attaches to the ring with the given name.  Reading starts with the
+  // oldest event in the ring.  Returns false if there's no such ring.
+  bool attach(const char * const name)
+  {
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return false;
+
+    EventRingHeader h;
+    if(pread(fd, &h, sizeof h, 0) != sizeof h || h.magic != EVENTRING_MAGIC){
+      close(fd);
+      return false;
+    }
+
+    void * const m = mmap(NULL, h.headersize + h.size, PROT_READ,
+                          MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) return false;
+
+    header = (EventRingHeader *)m;
+    data = (const char *)m + h.headersize;
+    pos = lastpos = __atomic_load_n(&header->begin, __ATOMIC_ACQUIRE);
+    return true;
+  }
+
+  // Returns a pointer to the next event, and puts its length in 'len', or
+  // returns NULL if there are no new events yet.  Call intact() when
+  // done with the event to find out if it can be believed.
+  const char * next(uint32_t & len)
+  {
+    while(true){
+      if(pos == __atomic_load_n(&header->end, __ATOMIC_ACQUIRE)) return NULL;
+
+      const EventRingRecord * const rec =
+        (const EventRingRecord *)(data + (pos & (header->size - 1)));
+      const EventRingRecord r = *rec;
+
+      // If the writer has been here since, start over from the oldest
+      // event that is still around.
+      if(!intact_at(pos)){
+        pos = __atomic_load_n(&header->begin, __ATOMIC_ACQUIRE);
+        continue;
+      }
+
+      lastpos = pos;
+      pos += r.reclen;
+
+      if(r.evlen == EVENTRING_PAD) continue;
+
+      if(started && r.seq > nextseq) lost += r.seq - nextseq;
+      nextseq = r.seq + 1;
+      started = true;
+
+      len = r.evlen;
+      return (const char *)(rec + 1);
+    }
+  }
+
+  // Returns true if the event last returned by next() has not been touched
+  // by the writer since.  If false, throw away whatever you got from it.
+  bool intact() const { return intact_at(lastpos); }
+
+  // The number of events that were overwritten before we could read them
+  uint64_t nlost() const { return lost; }
+
+private:
+
+  bool intact_at(const uint64_t p) const
+  {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&header->begin, __ATOMIC_RELAXED) <= p;
+  }
+
+  EventRingHeader * header;
+  const char * data;
+  uint64_t pos, lastpos, nextseq, lost;
+  bool started;
+};
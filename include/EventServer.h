@@ -0,0 +1,54 @@
+// Serves built events to clients on the same machine over a Unix-domain
+// socket, as they are built.
+//
+// A client connects and sends one line saying what it wants, made of any
+// of these space-separated settings:
+//
+//   modules=200,201,...  Only events with a hit in one of these modules
+//                        (pmtboard_u numbering).  Default: all modules.
+//   from=<unix time>     Only events with at least this Unix time stamp
+//   to=<unix time>       Only events with at most this Unix time stamp
+//   policy=drop          If the client falls behind, throw away the oldest
+//                        events waiting for it (the default).
+//   policy=block:<N>     If the client falls behind, hold up the event
+//                        builder for up to N ms before throwing away the
+//                        oldest events waiting for it.
+//
+// An empty line means all events with the default policy.  After that the
+// client just reads events in the output file format (see README.txt).
+// There is no end-of-run marker; the server closes the connection at the
+// end of the run.
+//
+// Needs pthread.h, stdint.h, deque and vector.
+
+struct EventBlock;
+struct EventClient;
+
+class EventServer {
+
+public:
+
+  EventServer();
+
+  // Starts listening on a socket at 'path', replacing anything there.
+  bool open(const char * const path);
+
+  // Queues a serialized event for all interested clients
+  void publish(const char * const ev, const uint32_t len);
+
+  // Sends what is still queued, disconnects everyone and stops listening
+  void close();
+
+private:
+
+  static void * accept_loop(void * server);
+  void reap_dead_clients();
+
+  std::string sockpath;
+  int listenfd;
+  pthread_t acceptor;
+
+  // Protects 'clients'
+  pthread_mutex_t clientlock;
+  std::vector<EventClient *> clients;
+};
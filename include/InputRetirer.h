@@ -0,0 +1,88 @@
+// Gets input files out of the way once they have been read, in a thread of
+// its own, so that slow directory operations on the input disk don't hold
+// up event building.  What happens to them depends on the mode:
+//
+//   kRetireRename    Renamed into decoded/ with ".done" appended (the
+//                    original behavior)
+//   kRetireArchive   Hard linked into an archive directory and removed
+//                    from the input directory.  The archive must be on the
+//                    same file system.
+//   kRetireCompress  Compressed with gzip into decoded/, with ".done.gz"
+//                    appended, and removed from the input directory
+//   kRetireDelete    Deleted once the output file their events went into
+//                    has been closed and its MD5 sum recorded, in the
+//                    format of md5sum, in a file of sums
+//
+// If archiving, compressing or recording a sum fails, the files are renamed
+// into decoded/ instead, so they are never read twice.
+//
+// All file names are full paths of files in the input directory.
+//
+// Needs pthread.h, deque, map, string and vector.
+
+enum RetireMode { kRetireRename, kRetireArchive, kRetireCompress,
+                  kRetireDelete };
+
+class InputRetirer {
+
+public:
+
+  InputRetirer();
+
+  // Starts retiring files from 'inputdir'.  'where' is the archive
+  // directory for kRetireArchive, or the file of sums for kRetireDelete.
+  // Returns false, having logged why, if it can't.
+  bool start(const std::string & inputdir, const RetireMode mode,
+             const std::string & where);
+
+  // Queues these files to be retired
+  void retire(const std::vector<std::string> & names);
+
+  // Says that the output file 'name' is finished.  In kRetireDelete mode,
+  // files queued before this are deleted once its sum is recorded.
+  void output_done(const std::string & name);
+
+  // All the files still to be retired
+  std::vector<std::string> pending_names();
+
+  // While 'yes', files are queued but not retired, so that compressing and
+  // archiving them don't take time from an event builder that has fallen
+  // behind.  finish() retires them anyway.
+  void defer(const bool yes);
+
+  // Waits for everything queued to be done, and stops the thread
+  void finish();
+
+private:
+
+  struct job {
+    bool output; // An output file for output_done(), not an input file
+    std::string name;
+  };
+
+  static void * run(void * retirer);
+  void retire_one(const std::string & name, RetireMode how);
+  bool record_sum(const std::string & output);
+  void done_with(const std::string & name);
+
+  RetireMode mode;
+  std::string where;
+  int indir, donedir, archivedir; // Open directories
+  int sumsfd;
+
+  pthread_t thread;
+  bool running;
+
+  // Protects everything below
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  std::deque<job> queue;
+  // Every file in 'queue' or 'held': the full path by the name alone
+  std::map<std::string, std::string> waiting;
+  bool stopping;
+  bool deferring;
+
+  // kRetireDelete only: files waiting for their output file.  Only used by
+  // the thread.
+  std::vector<std::string> held;
+};
@@ -0,0 +1,83 @@
+// Where the time goes between the DAQ finishing an input file and the
+// events from it being written, for -L.  Each set of input files is timed
+// at each stage on its way through the event builder, as is the age of
+// each event, by its Unix time stamp, when it is written.  The times are
+// collected in histograms and logged for each output file of the first
+// output.
+//
+// Times are in microseconds of wall clock time, so that they can be
+// compared with file modification times and Unix time stamps.  They are
+// not kept in checkpoints; after -r, the first output file's report only
+// covers what was built after resuming.
+//
+// Needs stdint.h and string.
+
+// Now, in microseconds since 1970
+int64_t wall_us();
+
+// A histogram of times, after HdrHistogram: counts in buckets whose width
+// is a fixed fraction, 1/SUB_BUCKETS, of their value, in a fixed array, so
+// that adding is just a few shifts and an increment.  Good to about 3%
+// from a microsecond to about 12 days; anything longer counts as that.
+class LatencyHistogram {
+
+public:
+
+  LatencyHistogram() { clear(); }
+
+  void clear();
+
+  // Counts a time.  Negative ones count as zero.
+  void add(const int64_t us);
+
+  // Adds the counts in 'other'
+  void add(const LatencyHistogram & other);
+
+  uint64_t count() const { return total; }
+  int64_t max() const { return largest; }
+
+  // The time that this 'fraction' of the times were no longer than, to
+  // the histogram's precision
+  int64_t percentile(const double fraction) const;
+
+private:
+
+  static const int SUB_BITS = 5;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int MAX_BITS = 40; // Of the longest time counted
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1)*SUB_BUCKETS;
+
+  static int bucket(const uint64_t us);
+  static int64_t bucket_top(const int b);
+
+  uint64_t counts[BUCKETS];
+  uint64_t total;
+  int64_t largest;
+};
+
+class LatencyTrace {
+
+public:
+
+  enum Stage {
+    kFileWait,   // From an input file last being written to finding it
+    kDecodeWait, // From finding it to starting to decode it
+    kDecode,     // Decoding it
+    kMergeWait,  // From a file set being decoded to building events from it
+    kBuild,      // Merging it and forming and writing its events
+    kTotal,      // From its oldest file last being written to all that
+    kEventAge,   // Wall clock at writing an event less its Unix time stamp
+    kStages
+  };
+
+  void add(const Stage stage, const int64_t us) { stages[stage].add(us); }
+  void clear();
+
+  // Logs the median, 99th percentile and largest time of each stage, for
+  // output file 'name'
+  void report(const std::string & name) const;
+
+private:
+
+  LatencyHistogram stages[kStages];
+};
@@ -0,0 +1,74 @@
+// An output file that is written under a temporary name, ${name}.part, and
+// renamed to its real name when it is closed, so that anything watching the
+// output directory only ever sees finished files.
+//
+// Space is allocated with fallocate() a segment at a time, so the file
+// isn't fragmented and the disk can't fill up under us halfway through an
+// event, and each segment is written through a memory mapping.  Writeback
+// of each segment is started as soon as it is full, so dirty pages don't
+// pile up until the kernel has to stop everything to write them.  The file
+// is cut back to what was actually written when it is closed.
+//
+// If the file system can't allocate space ahead like this, plain write()
+// is used instead.
+//
+// Needs stdint.h, string.h, algorithm and string.
+
+class OutputFile {
+
+public:
+
+  OutputFile();
+  ~OutputFile();
+
+  // Starts a new, empty file.  Returns false, having logged why, if it
+  // can't.
+  bool open(const std::string & name);
+
+  // Opens a file that we were partway through writing, under either its
+  // temporary or its real name, throwing away anything after 'offset'.
+  // Returns false, having logged why, if it can't.
+  bool reopen(const std::string & name, const int64_t offset);
+
+  bool is_open() const { return fd >= 0; }
+
+  // Appends 'len' bytes.  Returns false if they couldn't be written.
+  bool write(const void * data, size_t len)
+  {
+    while(len > 0){
+      if(written == mapbase + maplen && !next_segment()) return false;
+      if(map == NULL) return write_slow(data, len);
+      const size_t n = std::min((int64_t)len, mapbase + maplen - written);
+      memcpy(map + (written - mapbase), data, n);
+      data = (const char *)data + n;
+      written += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // Number of bytes written so far
+  int64_t size() const { return written; }
+
+  // Waits until everything written so far is on disk
+  bool sync();
+
+  // Cuts the file to size, syncs it and gives it its real name
+  bool close();
+
+private:
+
+  bool write_slow(const void * data, size_t len);
+  bool next_segment();
+  bool unmap();
+
+  std::string name, tmpname;
+  int fd;
+  int64_t written;
+
+  // The segment that is mapped in, or NULL if there isn't one yet or we
+  // are using write()
+  char * map;
+  int64_t mapbase, maplen;
+  bool use_write;
+};
@@ -0,0 +1,59 @@
+// A first-in first-out queue of decoded packets kept in a temporary file,
+// for when there are too many to keep in memory.  Packets are stored in the
+// compact form of EncodePacket().  Only a buffer's worth of them is in
+// memory at a time, at each end.
+//
+// The file is made in 'dir' the first time something needs to be written
+// out, and is unlinked right away, so that it goes away when we do.
+//
+// Needs stdint.h, string, vector and USBstreamUtils.h.
+
+class CheckpointWriter;
+
+class PacketSpool {
+
+public:
+
+  PacketSpool();
+  ~PacketSpool();
+
+  void SetDir(const std::string & d) { dir = d; }
+
+  void push_back(const decoded_packet & packet);
+
+  // Only if !empty()
+  const decoded_packet & front();
+  void pop_front();
+
+  // Moves the first packet into 'packet' and removes it.  Only if !empty().
+  void take_front(decoded_packet & packet);
+
+  // The last packet pushed.  Only if !empty().
+  const decoded_packet & back() const { return last; }
+
+  bool empty() const { return count == 0; }
+  uint64_t size() const { return count; }
+
+  void clear();
+
+  // Appends all the packets in the spool, in checkpoint format
+  void save(CheckpointWriter & out);
+
+private:
+
+  void write_out();
+  void read_in();
+
+  std::string dir;
+  int fd; // -1 until we need a file
+
+  // The packets are, in order: the undecoded part of 'rbuf', what is in the
+  // file between 'roff' and 'woff', and what is in 'wbuf'.
+  std::vector<char> rbuf, wbuf;
+  unsigned int rpos;
+  uint64_t roff, woff;
+
+  uint64_t count;
+  decoded_packet head, last;
+  unsigned int headlen; // Encoded size of 'head', or 0 if not decoded yet
+};
@@ -0,0 +1,157 @@
+// Decoding USB streams on the DAQ hosts where their files are written and
+// sending the decoded packets to the event builder over TCP.  A decoder
+// agent, EBDecoder, runs for each USB stream and connects to the event
+// builder, which listens for them with -R <port> instead of reading input
+// files itself.
+//
+// Everything sent is a message: a header of REMOTE_MAGIC, the type and the
+// length of the rest, followed by the rest, all in the machine's own byte
+// order as in checkpoints (see Checkpoint.h).  The agents and the event
+// builder must therefore run on machines of the same byte order; the magic
+// number catches it if they don't.
+//
+//   kRemoteHello  agent to builder, on connecting: USB serial number, and
+//                 the sequence numbers of the first batch it still has and
+//                 of the next it will make.
+//   kRemoteSetup  builder to agent: whether to start the run afresh, the
+//                 sequence number to carry on from, and what the stream
+//                 needs to decode: low latency mode, each output's
+//                 threshold and trigger mode, and the module time offsets.
+//   kRemoteBatch  agent to builder: a batch's sequence number, whether it
+//                 ends an input file, and its decoded packets, exactly as
+//                 the event builder would have got them decoding the file
+//                 itself.
+//   kRemoteAck    builder to agent: every batch before this sequence number
+//                 is in a checkpoint, so the agent can forget them, and
+//                 retire the files they came from.
+//
+// An agent holds on to every batch it has sent until it is acknowledged,
+// and sends them again if it has to reconnect, so nothing is lost if the
+// connection drops or the event builder is restarted with -r.  If the agent
+// itself is restarted in the middle of a run, the run must be restarted.
+//
+// The event builder stops reading from an agent while more than a set
+// amount of its data is waiting to be built, and starts again once half of
+// that is left.  The agent then blocks sending, and stops decoding, so
+// neither what the event builder has waiting nor what the agent holds
+// grows without limit when the event builder falls behind.
+//
+// Packets from before the first Unix time stamp are put in order around a
+// clock count shared by all the streams (see USBstream::SetFirstCount()),
+// which is the first such count seen.  No agent can know it until the
+// others have decoded something, so each keys them by its own, and the
+// event builder keys them again by its shared one as it takes them.
+//
+// Needs stdint.h, pthread.h, deque, string, vector, USBstreamUtils.h and
+// Checkpoint.h.
+
+static const uint32_t REMOTE_MAGIC = 0x45424452; // "EBDR"
+
+enum RemoteMessage { kRemoteHello = 1, kRemoteSetup = 2, kRemoteBatch = 3,
+                     kRemoteAck = 4 };
+
+// Sends a message with what has been put in 'payload'.  Returns false if
+// the connection has failed.
+bool send_message(const int fd, const uint32_t type,
+                  const CheckpointWriter & payload);
+
+// Waits for the next message.  Returns false if the connection has failed
+// or what came was not a message.
+bool recv_message(const int fd, uint32_t & type, CheckpointReader & payload);
+
+// Takes the decoded data from remote agents for the event builder (see -R),
+// in a thread of its own.
+class RemoteReceiver {
+
+public:
+
+  RemoteReceiver();
+
+  // Starts listening for agents on TCP 'port'.  Stream j is the USB with
+  // serial number serials[j], whose agent is sent setups[j] after the
+  // sequence numbers in its kRemoteSetup.  Reading from an agent stops
+  // while more than 'maxbytes' of its batches are waiting to be taken.
+  // Returns false, having logged why, if it can't.
+  bool start(const int port, const std::vector<int> & serials,
+             const std::vector<CheckpointWriter> & setups,
+             const uint64_t maxbytes);
+
+  // Takes the next batch received for stream j, if there is one, and
+  // whether it ends an input file.  The caller deletes the batch.
+  bool take(const unsigned int j, std::vector<decoded_packet> * & batch,
+            bool & endfile);
+
+  // Waits for up to 'us' microseconds for another batch to come in
+  void wait(const unsigned int us);
+
+  // Says that everything taken so far is in a checkpoint
+  void ack();
+
+  // Save or restore how many batches of each stream have been taken, for
+  // checkpoints.  Only between file sets.  load() returns false if they
+  // don't fit the streams given to start(), and must be called before it.
+  void save(CheckpointWriter & out);
+  bool load(CheckpointReader & in, const unsigned int nstreams);
+
+  // Disconnects the agents and stops listening
+  void stop();
+
+private:
+
+  struct batch {
+    std::vector<decoded_packet> * packets;
+    bool endfile;
+    uint32_t bytes; // As sent
+  };
+
+  struct connection {
+    int fd;
+    int stream; // -1 until we hear which it is
+    std::vector<char> buf; // What has been read that isn't a whole message
+  };
+
+  struct stream {
+    stream()
+    {
+      serial = 0;
+      fd = -1;
+      received = taken = acked = acksent = 0;
+      queuedbytes = 0;
+      paused = false;
+    }
+
+    int serial;
+    CheckpointWriter setup;
+    int fd; // Of the agent's connection, or -1
+    uint64_t received; // Batches received, and of those, taken so far
+    uint64_t taken;
+    uint64_t acked;    // Batches acknowledged, and of those, sent to the
+    uint64_t acksent;  // agent so far
+    std::deque<batch> queue; // Received but not yet taken
+    uint64_t queuedbytes; // Of the batches in 'queue', as sent
+    bool paused; // Not reading from the agent until 'queue' goes down
+  };
+
+  static void * run(void * receiver);
+  void accept_agent();
+  bool read_messages(connection & c);
+  bool handle(connection & c, const uint32_t type, CheckpointReader & in,
+              const uint32_t bytes);
+  bool hello(connection & c, CheckpointReader & in);
+  void send_acks();
+  void hang_up(connection & c);
+
+  int listenfd;
+  pthread_t thread;
+  bool running;
+  uint64_t highbytes; // See start()
+
+  // Only touched by the thread
+  std::vector<connection> connections;
+
+  // Protects everything below
+  pthread_mutex_t lock;
+  pthread_cond_t arrived; // Signalled when a batch comes in
+  std::vector<stream> streams;
+  bool stopping;
+};
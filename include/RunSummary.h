@@ -0,0 +1,84 @@
+// Monitoring summary of what went into one output file: hit counts and
+// charge spectra for each channel, and how the sync pulses have been doing
+// for each module, so that online monitoring doesn't need to read the
+// output again.  See -M.
+//
+// Each slice thread fills its own summary as it forms events, and these
+// are added into the output's summary each time a file set has been built.
+// When starting new files by size or time, a slice's events are counted in
+// the file that its first event went into.
+//
+// Modules are given in the output numbering.
+//
+// Needs stdint.h, string, vector and USBstreamUtils.h.
+
+class CheckpointWriter;
+class CheckpointReader;
+
+class RunSummary {
+
+public:
+
+  // Bins in each channel's charge histogram, and their width in ADC counts.
+  // Negative charges go in the first bin and anything too big in the last.
+  static const int CHARGE_BINS = 64;
+  static const int CHARGE_BIN_WIDTH = 16;
+
+  // Sets up for these modules, all counts zero
+  void init(const std::vector<uint16_t> & modules);
+
+  // Sets all counts to zero
+  void clear();
+
+  // Counts one event, made of those of the 'npackets' packets at 'packets'
+  // that have any of the bits in 'mask' set in their tags.  'modules' gives
+  // the output module number for each.
+  void add_event(const decoded_packet * const packets,
+                 const unsigned int npackets,
+                 const uint16_t * const modules, const uint8_t mask);
+
+  // Counts a sync pulse missed by 'module', seen by a clock count of
+  // 'count' being too large.  'first' is true for the first packet with
+  // a count that large since the module last had a normal one.
+  void add_late_count(const uint16_t module, const uint32_t count,
+                      const bool first);
+
+  // Counts a set of input files built without the file of 'module''s USB,
+  // which was too late (see -g)
+  void add_missing_set(const uint16_t module);
+
+  // Adds the counts in 'other', which must be for the same modules
+  void add(const RunSummary & other);
+
+  // Writes the summary for the output file 'outname', as text, to 'name'.
+  // Returns false, having logged why, if it can't.
+  bool write(const std::string & name, const std::string & outname) const;
+
+  // Save or restore the counts, for checkpoints.  load() returns false if
+  // they don't fit the modules given to init().
+  void save(CheckpointWriter & out) const;
+  bool load(CheckpointReader & in);
+
+private:
+
+  int slot(const uint16_t module) const
+  {
+    return module < slots.size()? slots[module]: -1;
+  }
+
+  std::vector<uint16_t> modules; // Module number of each slot
+  std::vector<int> slots;        // Slot of each module number, or -1
+
+  uint64_t events;
+  uint32_t firsttime, lasttime; // Unix time stamps, 0 if none yet
+
+  // For each slot
+  std::vector<uint64_t> packets;
+  std::vector<uint32_t> missedsyncs;
+  std::vector<uint32_t> maxcount; // Largest too-large clock count
+  std::vector<uint32_t> missingsets;
+
+  // For each slot and channel, and for charge, each bin
+  std::vector<uint64_t> hits;
+  std::vector<uint32_t> charge;
+};
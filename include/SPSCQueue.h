@@ -0,0 +1,49 @@
+// A bounded, lock-free queue for handing items from exactly one producer
+// thread to exactly one consumer thread.  N must be a power of two.
+//
+// Neither side ever blocks.  push() returns false if the queue is full and
+// pop() returns false if it is empty; what to do then is up to the caller.
+template<typename T, unsigned int N> class SPSCQueue {
+
+public:
+
+  SPSCQueue() { head = 0; tail = 0; }
+
+  // Only to be called by the producer
+  bool push(const T & item)
+  {
+    const unsigned int t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    if(t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == N) return false;
+
+    items[t & (N-1)] = item;
+    __atomic_store_n(&tail, t+1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Only to be called by the consumer
+  bool pop(T & item)
+  {
+    const unsigned int h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    if(h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) return false;
+
+    item = items[h & (N-1)];
+    __atomic_store_n(&head, h+1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Only meaningful to the consumer: the producer may push at any time
+  bool empty() const
+  {
+    return __atomic_load_n(&head, __ATOMIC_RELAXED) ==
+           __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+  }
+
+private:
+
+  T items[N];
+
+  // Each index is only written by one side.  Keep them on separate cache
+  // lines so that the producer and consumer don't fight over them.
+  unsigned int head __attribute__((aligned(64)));
+  unsigned int tail __attribute__((aligned(64)));
+};
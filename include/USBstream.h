@@ -1,14 +1,37 @@
+// Needs USBstreamUtils.h first, for MAX_OUTPUTS.
+
 //Forward declarations for classes that come from USBstreamUtils.h and will be included where they are needed
 struct decoded_packet;
+class CheckpointWriter;
+class CheckpointReader;
+class PacketSpool;
+class WorkPool;
 
 class USBstream {
 
 public:
 
   USBstream();
+  ~USBstream();
 
   void SetUSB(int usb) { myusb=usb; }
-  void SetThresh(int thresh, int threshtype);
+
+  // If set, LoadFile() will open files that the DAQ is still writing
+  // (with ".wr" appended to the name) and decodefile() will follow them.
+  void SetFollow(const bool f) { follow = f; }
+
+  // Sets the software threshold and trigger mode for output stream
+  // 'output', which must be less than MAX_OUTPUTS.  Each decoded packet is
+  // tagged with the outputs it passes for, and dropped if it passes for
+  // none of those that have been set.
+  void SetThresh(int thresh, int threshtype, const unsigned int output = 0);
+
+  // Streams whose packets are built into events together must agree on
+  // where the clock counts of packets without a Unix time stamp start from,
+  // so they share this, which starts out as NO_COUNT.  By default all
+  // streams in the process share one.
+  static const int64_t NO_COUNT = INT64_MIN;
+  void SetFirstCount(int64_t * const shared) { firstcount = shared; }
 
   // Set per-module timing offset on this USB stream.  As per Camillo:
   //
@@ -23,18 +46,63 @@ public:
 
   void SetBaseline(const int base[64 /* maxModules */][64 /* numChannels */]);
 
+  // Keep at most about this many bytes of decoded packets in memory, and
+  // put the oldest of any more in a temporary file in 'dir'.  Zero, the
+  // default, means no limit.
+  void SetMemoryBudget(const uint64_t bytes, const std::string & dir);
+
+  // Lets decodefile() cut big files into pieces and decode them at once,
+  // as jobs for 'pool' from 'client'.  Without this, and when following a
+  // file, files are decoded in one piece.
+  void SetWorkPool(WorkPool * const p, const unsigned int client)
+  {
+    pool = p;
+    poolclient = client;
+  }
+
+  // Sets the size of those pieces, PIECE_BYTES unless set.  Files of at
+  // least two pieces are decoded in pieces, so smaller pieces spread the
+  // decoding of more files over the WorkPool's threads.
+  void SetPieceBytes(const unsigned int bytes) { piecebytes = bytes; }
+  static const unsigned int PIECE_BYTES = 1 << 20;
+
   int GetUSB() const { return myusb; }
   const char* GetFileName() { return myfilename.c_str(); }
   uint32_t GetUnixTime() const { return unix_time; }
 
   bool GetDecodedDataUpToNextUnixTimeStamp(std::vector<decoded_packet> & vec);
+  void GetDecodedDataUpToLatestUnixTimeStamp(std::vector<decoded_packet> & vec);
   void GetBaselineData(std::vector<decoded_packet> *vec);
+
+  // Appends all the decoded data to 'vec', and forgets any packet cut off
+  // at the end of the last file, for when the next file won't carry on
+  // from it (see -g)
+  void GetAllDecodedData(std::vector<decoded_packet> & vec);
+
+  // Keys the packets from before the first Unix time stamp at the start of
+  // 'packets', which were decoded elsewhere around some other first clock
+  // count, around this stream's shared one instead, and puts them back in
+  // order.  For packets from decoder agents (see RemoteStream.h).
+  void RekeyUntimed(std::vector<decoded_packet> & packets);
+
   int LoadFile(const std::string & nextfile);
-  void decodefile();
+  bool decodefile();
+
+  // Decodes 'n' bytes of this stream's data, as the DAQ read them from the
+  // USB, instead of a file.  They can be cut anywhere.  Take what has been
+  // decoded with GetDecodedDataUpToLatestUnixTimeStamp().  See EBuilder.h.
+  void DecodeBuffer(const char * const data, const unsigned int n);
+
+  // Save or restore what carries over from one file to the next, and the
+  // baselines, for checkpoints.  Only between files.  LoadState() returns
+  // false if the checkpoint doesn't fit this stream.
+  void SaveState(CheckpointWriter & out) const;
+  bool LoadState(CheckpointReader & in);
 
 private:
 
-  int16_t mythresh;
+  unsigned int numoutputs; // Output streams that SetThresh() has been told of
+  int16_t mythresh[MAX_OUTPUTS];
   int myusb;
   int baseline[64 /* maxModules */][64 /* numChannels */];
   int offset[64 /* maxModules */];
@@ -43,37 +111,122 @@ private:
   uint32_t unix_time;
   std::string myfilename;
   std::fstream *myFile;
-  bool BothLayerThresh;
-  bool UseThresh;
+  bool follow;    // Whether we may follow files that are still being written
+  bool following; // Whether we are following one right now
+  int unpacker;   // If the file is compressed, the decompressor's process ID
+  int unpackfd;   // and what it writes to, otherwise 0 and -1
+  TriggerMode threshmode[MAX_OUTPUTS];
 
+  // Decoded packets not yet sent on are those in 'spool', followed by those
+  // in sortedpackets from 'nextpacket' on.
   std::vector<decoded_packet> sortedpackets;
-  std::vector<decoded_packet>::iterator sortedpacketsptr;
+  unsigned int nextpacket; // First packet in sortedpackets not yet sent on
+  PacketSpool * spool;     // Older packets, if there wasn't room for them
+  uint64_t membudget;      // See SetMemoryBudget()
+  uint64_t rambytes;       // Roughly how much memory sortedpackets is using
+  WorkPool * pool;         // See SetWorkPool()
+  unsigned int poolclient;
+  unsigned int piecebytes; // See SetPieceBytes()
+
+  bool pending();
+  const decoded_packet & pending_front();
+  void pending_pop();
+  void pending_take(std::vector<decoded_packet> & vec);
+  void spill();
+  void unspill();
+  void forget_sent();
   std::deque<uint16_t> raw16bitdata;
 
+  // What DecodeBuffer() has been given since the baselines, until the first
+  // Unix time stamp, to be decoded again once it is found
+  std::vector<char> untimed;
+
+  // For timing the decoding stages in isolation
+  friend class USBstreamBench;
+
   // These functions are for the decoding
+  unsigned int filesize();
+  void close_file();
+  bool start_unpacker();
+  bool stop_unpacker();
+  void decode_compressed();
+  bool add_byte(const char byte, uint32_t & w, char & expected) const;
+  bool decodebytes(const char * const data, const unsigned int n);
   bool raw24bit_to_raw16bit(uint32_t d);
-  void raw16bit_to_packets();
   bool handle_unix_time_words(const uint32_t wordin);
-  bool ThresholdCut(const bool * const allhits, const bool * const threshits);
+  void raw16bit_to_packets();
+
+  // Makes a module packet, all but its time key, from its 'len' + 1 words
+  // at 'words'.  The trigger modes, baselines and offsets don't change
+  // during a run, so rather than look at them for every word,
+  // choose_decoder() picks the instantiation of make_packet() that fits
+  // them whenever they are set: whether any output cuts in each mode, and
+  // whether there is anything to subtract.
+  template<bool SingleCut, bool DoubleCut, bool Adjust>
+  void make_packet(const uint16_t * const words, const unsigned int len,
+                   decoded_packet & packet) const;
+  void choose_decoder();
+  void (USBstream::*packetmaker)(const uint16_t * const words,
+                                 const unsigned int len,
+                                 decoded_packet & packet) const;
+  uint8_t alltags;   // A tag for each output
+  uint8_t singlecut; // The tags of the outputs in kSingleLayer mode
+  uint8_t doublecut; // and in kDoubleLayer mode
+
+  // Whether the hits in a module packet pass the cut of a kSingleLayer
+  // output, or if 'Both', a kDoubleLayer one
+  template<bool Both> bool ThresholdCut(const bool * const allhits,
+                                        const bool * const threshits) const;
+  int64_t timekey(const decoded_packet & packet);
+  bool setkey(decoded_packet & packet, const unsigned int len);
+  void insertsorted(decoded_packet & packet);
+
+  // For decoding a file in pieces at once, see decode_in_pieces()
+  struct piece;
+  struct framed_packet;
+  struct packet_job;
+  void decode_in_pieces(const unsigned int size);
+  bool frame_packets(const std::vector<piece> & pieces,
+                     std::vector<uint16_t> & words,
+                     std::vector<framed_packet> & framed);
+  static bool decode_piece(void * arg);
+  static bool make_packets(void * arg);
 
   // These variables are for the decoding
+  unsigned int bytesdecoded; // How far into the file we've got
+  uint32_t word; // holds 24-bit word being built, must be unsigned
+  char expcounter; // expecting this counter next
   bool got_unix_time_hi;
   uint16_t unix_time_hi;
   uint16_t unix_time_lo;
+  bool have_phase;
+  int64_t phase; // Estimated clock count at the last sync pulse before 1970,
+                 // as of the latest packet
+
+  // The first clock count seen, by any of the streams built together, on a
+  // packet from before the first Unix time stamp.  NO_COUNT until then.
+  // __atomic only.  See SetFirstCount().
+  int64_t * firstcount;
+  static int64_t sharedfirstcount; // The default
 };
 
+// Appends the bytes of 'x' to 'buf'
+template<typename T> void append_bytes(std::vector<char> & buf, const T & x)
+{
+  buf.insert(buf.end(), (const char *)&x, (const char *)&x + sizeof x);
+}
+
 struct OVHitData {
-  bool writeout(const int fd)
+  // Appends this hit, in the output format, to 'buf'
+  void serialize(std::vector<char> & buf) const
   {
     const uint8_t magic = 'H';
-    if(1 != write(fd, &magic, 1)) return false;
+    append_bytes(buf, magic);
 
-    if(1 != write(fd, &channel, 1)) return false;
+    append_bytes(buf, channel);
 
     const uint16_t ncharge = htons(charge);
-    if(sizeof ncharge != write(fd, &ncharge, sizeof ncharge)) return false;
-
-    return true;
+    append_bytes(buf, ncharge);
   }
 
   uint8_t channel;
@@ -81,18 +234,17 @@ struct OVHitData {
 };
 
 struct OVEventHeader {
-  bool writeout(const int fd)
+  // Appends this header, in the output format, to 'buf'
+  void serialize(std::vector<char> & buf) const
   {
     const uint16_t magic = htons(0x4556); // "EV"
-    if(sizeof magic != write(fd, &magic, sizeof magic)) return false;
+    append_bytes(buf, magic);
 
     const uint16_t nnov = htons(n_ov_data_packets);
-    if(sizeof nnov != write(fd, &nnov, sizeof nnov)) return false;
+    append_bytes(buf, nnov);
 
     const uint32_t ntime_sec = htonl(time_sec);
-    if(sizeof ntime_sec != write(fd, &ntime_sec, sizeof ntime_sec)) return false;
-
-    return true;
+    append_bytes(buf, ntime_sec);
   }
 
   uint16_t n_ov_data_packets;
@@ -100,20 +252,19 @@ struct OVEventHeader {
 };
 
 struct OVDataPacketHeader {
-  bool writeout(const int fd)
+  // Appends this header, in the output format, to 'buf'
+  void serialize(std::vector<char> & buf) const
   {
     const uint8_t magic = 0x4D; // "M"
-    if(1 != write(fd, &magic, 1)) return false;
+    append_bytes(buf, magic);
 
-    if(1 != write(fd, &nHits, 1)) return false;
+    append_bytes(buf, nHits);
 
     const uint16_t nmodule = htons(module);
-    if(sizeof(nmodule) != write(fd, &nmodule, sizeof nmodule)) return false;
+    append_bytes(buf, nmodule);
 
     const uint32_t ntime16ns = htonl(time16ns);
-    if(sizeof(ntime16ns) != write(fd, &ntime16ns, sizeof ntime16ns)) return false;
-
-    return true;
+    append_bytes(buf, ntime16ns);
   }
 
   uint8_t nHits;
@@ -5,6 +5,20 @@ struct decoded_hit {
   int16_t charge;
 };
 
+// The 62.5MHz clock counter is reset by a sync pulse every 2^29 counts
+static const int SYNC_PULSE_CLK_COUNT_PERIOD_LOG2=29; // trigger system emits
+                                                      // sync pulse at 62.5MHz
+static const int64_t CLK_HZ = 62500000;
+
+// Most output streams one event builder can write at once, each with its
+// own trigger mode and threshold.  One bit each in decoded_packet::tags.
+static const unsigned int MAX_OUTPUTS = 8;
+
+// How each output stream cuts packets: not at all, on a channel over
+// threshold next to one that was hit, or on two adjacent channels both over
+// threshold.  See USBstream::SetThresh().
+enum TriggerMode {kNone, kSingleLayer, kDoubleLayer};
+
 // A module packet after decoding.
 struct decoded_packet {
   decoded_packet()
@@ -13,22 +27,116 @@ struct decoded_packet {
     module = 0;
     timeunix = 0;
     time16ns = 0;
+    key = 0;
+    tags = 0xff;
   }
 
   bool isadc; // ADC hits (true) or something else (false)
   uint16_t module;
   uint32_t timeunix;
   uint32_t time16ns;
+
+  // Time in 16ns ticks counting from an arbitrary point, with the sync pulse
+  // periods reconstructed, so that packets can be put in order by comparing
+  // this alone.  See USBstream::timekey().
+  int64_t key;
+
+  // Bit i is set if output stream i wants this packet, i.e. if it passes
+  // that output's software threshold.  See USBstream::SetThresh().
+  uint8_t tags;
+
   std::vector<decoded_hit> hits;
+
+  // Exchanges the contents of two packets without copying the hits.  This
+  // is how packets are moved around after they are decoded, so that the
+  // hits are never copied.
+  void swap(decoded_packet & other)
+  {
+    const bool     isadc_    = isadc;    isadc    = other.isadc;
+    const uint16_t module_   = module;   module   = other.module;
+    const uint32_t timeunix_ = timeunix; timeunix = other.timeunix;
+    const uint32_t time16ns_ = time16ns; time16ns = other.time16ns;
+    const int64_t  key_      = key;      key      = other.key;
+    const uint8_t  tags_     = tags;     tags     = other.tags;
+    other.isadc    = isadc_;
+    other.module   = module_;
+    other.timeunix = timeunix_;
+    other.time16ns = time16ns_;
+    other.key      = key_;
+    other.tags     = tags_;
+    hits.swap(other.hits);
+  }
 };
 
+// Makes room for one more packet at the end of 'vec', moving the packets
+// already there if it has to grow instead of copying them as the vector
+// itself would.
+void GrowPackets(std::vector<decoded_packet> & vec);
+
+// Moves 'packet' onto the end of 'vec', leaving 'packet' empty
+inline void MovePacket(std::vector<decoded_packet> & vec,
+                       decoded_packet & packet)
+{
+  if(vec.size() == vec.capacity()) GrowPackets(vec);
+  vec.resize(vec.size() + 1);
+  vec.back().swap(packet);
+}
+
+// Moves all the packets in 'from' onto the end of 'to', leaving 'from' empty
+void MovePackets(std::vector<decoded_packet> & to,
+                 std::vector<decoded_packet> & from);
+
+// Removes packets 'first' up to 'last' from 'vec', moving the rest down
+void ErasePackets(std::vector<decoded_packet> & vec, const unsigned int first,
+                  const unsigned int last);
+
 // Send message to screen and syslog. If the message is at level
 // LOG_CRIT or worse, exit with status 1. (LOG_CRIT is the most severe
 // level that should be used since more severe levels, by convention,
 // indicate system-wide problems.)
+//
+// After start_log(), messages are passed to a background thread to be
+// sent, and each call site is limited to a few messages per second, with
+// a count of the rest logged instead.  Fatal messages are still sent, after
+// everything before them, before this returns.
 void log_msg(const int priority, const char * const format, ...);
 
+// Connects to syslog and starts the background logging thread
 void start_log();
 
-bool LessThan(const decoded_packet & lhs,
-              const decoded_packet & rhs, const int ClockSlew);
+// Puts "[name] " in front of every message this thread logs from now on,
+// or nothing if 'name' is NULL.  'name' must last as long as it is used.
+void set_log_name(const char * const name);
+
+// Appends those of the 'npackets' packets at 'packets' that have any of the
+// bits in 'mask' set in their tags, as one event in the output format, to
+// 'buf'.  'modules' gives the output module number for each.  There must be
+// at least one such packet.
+void SerializeEvent(const decoded_packet * const packets,
+                    const unsigned int npackets,
+                    const uint16_t * const modules, std::vector<char> & buf,
+                    const uint8_t mask = 0xff);
+
+// Appends 'packet' to 'buf' in a compact form for checkpoints and
+// temporary files, in the machine's own byte order.
+void EncodePacket(const decoded_packet & packet, std::vector<char> & buf);
+
+// Decodes a packet written by EncodePacket() from the 'len' bytes at 'p'.
+// Returns the number of bytes it took up, or 0 if 'len' is too short.
+unsigned int DecodePacket(const char * const p, const unsigned int len,
+                          decoded_packet & packet);
+
+// Sets 'baseptr' to the average charge of each channel of each module in
+// the ADC packets of 'BaselineData', for USBstream::SetBaseline().  Returns
+// false, having logged why, if any has a module or channel number out of
+// range, leaving 'baseptr' as it was.
+bool CalculatePedestal(int baseptr[64 /* maxModules */][64 /* numChannels */],
+                       const std::vector<decoded_packet> & BaselineData);
+
+/* Returns true if the packet 'lhs' is earlier in time than 'rhs' by more
+   than 'ClockSlew' ticks */
+inline bool LessThan(const decoded_packet & lhs,
+                     const decoded_packet & rhs, const int ClockSlew)
+{
+  return lhs.key + ClockSlew < rhs.key;
+}
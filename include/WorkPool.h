@@ -0,0 +1,68 @@
+// A fixed set of worker threads for the CPU-heavy work of event building,
+// decoding input files and forming events, shared by everything in the
+// process that has such work to do.  In a daemon, that is several
+// partitions (see -D), each building its own events.
+//
+// Each partition, or other user, is a client with its own queue of jobs.
+// Workers take jobs from the clients in turn, so a busy client can't shut
+// out the others, but can have every worker when the others are idle.
+//
+// A client waiting for its jobs to finish runs any of them that haven't
+// started yet itself, so nothing is held up when all the workers are busy
+// with other clients' work.
+//
+// Needs pthread.h, deque and vector.
+
+class WorkPool {
+
+public:
+
+  // Runs a job.  Returns true to be run again later, for instance to look
+  // at a file that is still being written, or false if finished.
+  typedef bool (*Job)(void * arg);
+
+  WorkPool();
+
+  // Starts 'nthreads' workers.  Returns false, having logged why, if it
+  // can't.
+  bool start(const unsigned int nthreads);
+
+  // Adds a client and returns its number
+  unsigned int add_client();
+
+  // Queues 'job' to be run with 'arg' for 'client'.  '*pending' is counted
+  // up now and down when the job has finished, with __atomic builtins.  If
+  // the job returns true, it is run again no sooner than 'again_us'
+  // microseconds later.
+  void submit(const unsigned int client, Job job, void * arg, int * pending,
+              const unsigned int again_us = 0);
+
+  // Waits until '*pending' is zero.  Meanwhile, runs any of 'client's jobs
+  // that count towards it.
+  void wait(const unsigned int client, int * pending);
+
+private:
+
+  struct entry {
+    unsigned int client;
+    Job job;
+    void * arg;
+    int * pending;
+    unsigned int again_us;
+    uint64_t not_before; // Microseconds, on the monotonic clock
+  };
+
+  static void * run(void * pool);
+  bool take(const unsigned int client, const int * const pending,
+            entry & e, uint64_t & wake);
+  void finish(entry & e, const bool again);
+  void sleep(const uint64_t wake);
+
+  std::vector<pthread_t> threads;
+
+  // Protects everything below
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // Signalled whenever a job is queued or finishes
+  std::vector< std::deque<entry> > queues; // Of each client
+  unsigned int nextclient; // Whose job to look for first
+};
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Checkpoint.h"
+
+void CheckpointWriter::put(const std::string & s)
+{
+  put((uint32_t)s.size());
+  buf.insert(buf.end(), s.begin(), s.end());
+}
+
+void CheckpointWriter::put(const std::vector<decoded_packet> & packets)
+{
+  put((uint32_t)packets.size());
+  for(unsigned int i = 0; i < packets.size(); i++)
+    EncodePacket(packets[i], buf);
+}
+
+void CheckpointWriter::put_raw(const char * const data, const size_t len)
+{
+  buf.insert(buf.end(), data, data + len);
+}
+
+bool CheckpointWriter::commit(const std::string & name)
+{
+  const std::string tmpname = name + ".tmp";
+
+  errno = 0;
+  const int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    log_msg(LOG_ERR, "Could not open checkpoint %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Make sure it's all on disk before it replaces the last good one
+  if((ssize_t)buf.size() != write(fd, &buf[0], buf.size()) || fsync(fd) < 0){
+    log_msg(LOG_ERR, "Could not write checkpoint %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+    close(fd);
+    unlink(tmpname.c_str());
+    return false;
+  }
+  close(fd);
+
+  if(rename(tmpname.c_str(), name.c_str()) < 0){
+    log_msg(LOG_ERR, "Could not rename checkpoint %s to %s: %s\n",
+            tmpname.c_str(), name.c_str(), strerror(errno));
+    unlink(tmpname.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool CheckpointReader::load(const std::string & name)
+{
+  errno = 0;
+  const int fd = open(name.c_str(), O_RDONLY);
+  if(fd < 0){
+    log_msg(LOG_ERR, "Could not open checkpoint %s: %s\n",
+            name.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0){
+    log_msg(LOG_ERR, "Could not stat checkpoint %s: %s\n",
+            name.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  buf.resize(st.st_size);
+  if(st.st_size > 0 && st.st_size != read(fd, &buf[0], st.st_size)){
+    log_msg(LOG_ERR, "Could not read checkpoint %s\n", name.c_str());
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  pos = 0;
+  bad = false;
+  return true;
+}
+
+void CheckpointReader::get(std::string & s)
+{
+  uint32_t n;
+  get(n);
+  if(bad || pos + n > buf.size()){
+    bad = true;
+    s.clear();
+    return;
+  }
+  s.assign(&buf[pos], n);
+  pos += n;
+}
+
+void CheckpointReader::get(std::vector<decoded_packet> & packets)
+{
+  uint32_t n;
+  get(n);
+  packets.clear();
+  for(uint32_t i = 0; i < n && !bad; i++){
+    decoded_packet p;
+    const unsigned int len = DecodePacket(&buf[0] + pos, buf.size() - pos, p);
+    if(len == 0) bad = true;
+    pos += len;
+    packets.push_back(p);
+  }
+}
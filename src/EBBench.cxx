@@ -0,0 +1,483 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h> // For htons, htonl
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <fstream>
+#include <deque>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "EventMerger.h"
+
+using std::vector;
+
+// Times each stage of event building on its own, on fixed synthetic input,
+// so that when the speed of the whole changes we can tell which stage did
+// it.  Prints one line of JSON per benchmark, like
+//
+//   {"bench":"decode","unit":"64kB read","ops":1234,"ns_per_op":...,
+//    "bytes_per_s":...,"allocs_per_op":...}
+//
+// where an "op" is whatever 'unit' says, bytes_per_s counts input bytes
+// (output bytes for serialization) and is 0 where that doesn't mean
+// anything, and allocs_per_op counts calls to operator new.  Save the
+// output from two commits and compare them line by line.
+
+static double MinTime = 1; // Seconds to run each benchmark for
+static vector<std::string> Only; // Benchmarks to run, or empty for all
+
+//------------------------------------------------------------------------------
+// Allocation counting
+
+static uint64_t nallocs = 0;
+
+void * operator new(size_t n)
+{
+  nallocs++;
+  void * p = malloc(n? n: 1);
+  if(p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void * p) throw()
+{
+  free(p);
+}
+
+void operator delete(void * p, size_t n) throw()
+{
+  (void)n;
+  free(p);
+}
+
+//------------------------------------------------------------------------------
+// Timing
+
+class Stopwatch {
+
+public:
+
+  Stopwatch() { ns = 0; allocs = 0; }
+
+  void start()
+  {
+    allocs0 = nallocs;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+  }
+
+  void stop()
+  {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns += (int64_t)(t1.tv_sec - t0.tv_sec)*1000000000 + (t1.tv_nsec - t0.tv_nsec);
+    allocs += nallocs - allocs0;
+  }
+
+  bool done() const { return ns*1e-9 >= MinTime; }
+
+  uint64_t ns, allocs;
+
+private:
+
+  struct timespec t0;
+  uint64_t allocs0;
+};
+
+static void report(const char * const name, const char * const unit,
+                   const Stopwatch & w, const uint64_t ops, const uint64_t bytes)
+{
+  printf("{\"bench\":\"%s\",\"unit\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,"
+         "\"bytes_per_s\":%.0f,\"allocs_per_op\":%.3f}\n", name, unit,
+         (unsigned long)ops, (double)w.ns/ops, bytes/(w.ns*1e-9),
+         (double)w.allocs/ops);
+  fflush(stdout);
+}
+
+static bool wanted(const char * const name)
+{
+  if(Only.empty()) return true;
+  for(unsigned int i = 0; i < Only.size(); i++)
+    if(Only[i] == name) return true;
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Synthetic input.  Always the same, so that results can be compared.
+
+static uint32_t seed;
+
+static uint32_t rnd(const uint32_t n)
+{
+  seed = seed*1664525 + 1013904223;
+  return (seed >> 8) % n;
+}
+
+static const uint32_t T0 = 1506152664; // Unix time of the synthetic data
+static const int NMODULES = 8;
+static const unsigned int NPACKETS = 40000;
+
+// Appends the 16-bit words of one ADC module packet with 'nhits' hits
+static void make_packet_words(vector<uint16_t> & out, const int module,
+                              const uint32_t time16ns, const unsigned int nhits)
+{
+  const unsigned int start = out.size();
+  out.push_back(0xffff);
+  out.push_back((1 << 15) | (module << 8) | (4 + 2*nhits));
+  out.push_back(time16ns >> 16);
+  out.push_back(time16ns & 0xffff);
+  for(unsigned int h = 0; h < nhits; h++){
+    out.push_back(rnd(600)); // ADC
+    out.push_back(rnd(64));  // channel
+  }
+
+  uint16_t parity = 0;
+  for(unsigned int i = start + 1; i < out.size(); i++) parity ^= out[i];
+  out.push_back(parity);
+}
+
+// Appends a 24-bit word in the input file format
+static void put24(vector<char> & out, const uint32_t w)
+{
+  out.push_back((0 << 6) | ((w >> 18) & 0x3f));
+  out.push_back((1 << 6) | ((w >> 12) & 0x3f));
+  out.push_back((2 << 6) | ((w >>  6) & 0x3f));
+  out.push_back((3 << 6) | ( w        & 0x3f));
+}
+
+// Packets in time order, except that every so often two are swapped, as
+// happens in real data.  Times are spread over several seconds, and the
+// clock counter resets at a sync pulse partway through.
+static vector<decoded_packet> make_packets(const unsigned int n)
+{
+  vector<decoded_packet> packets(n);
+  uint64_t t = 0; // 16ns ticks since T0
+  for(unsigned int i = 0; i < n; i++){
+    t += rnd(30000);
+    packets[i].isadc = true;
+    packets[i].module = rnd(NMODULES);
+    packets[i].timeunix = T0 + t/62500000;
+    packets[i].time16ns = (t + 123456789) % (1 << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2);
+    packets[i].key = t;
+    const unsigned int nhits = 1 + rnd(6);
+    for(unsigned int h = 0; h < nhits; h++){
+      decoded_hit hit;
+      hit.channel = rnd(64);
+      hit.charge = rnd(600);
+      packets[i].hits.push_back(hit);
+    }
+  }
+  for(unsigned int i = 0; i+1 < n; i += 37)
+    std::swap(packets[i], packets[i+1]);
+  return packets;
+}
+
+// An input file's worth of bytes holding 'packets', with a Unix time stamp
+// whenever the second changes
+static vector<char> make_file(const vector<decoded_packet> & packets)
+{
+  vector<char> file;
+  vector<uint16_t> words;
+  uint32_t sec = 0;
+  for(unsigned int i = 0; i < packets.size(); i++){
+    if(packets[i].timeunix != sec){
+      sec = packets[i].timeunix;
+      put24(file, (0xc8 << 16) | (sec >> 16));
+      put24(file, (0xc9 << 16) | (sec & 0xffff));
+    }
+    words.clear();
+    make_packet_words(words, packets[i].module, packets[i].time16ns,
+                      packets[i].hits.size());
+    for(unsigned int w = 0; w < words.size(); w++)
+      put24(file, (0xc0 << 16) | words[w]);
+  }
+  return file;
+}
+
+//------------------------------------------------------------------------------
+// Benchmarks of USBstream's insides
+
+class USBstreamBench {
+
+public:
+
+  USBstreamBench()
+  {
+    int base[64][64];
+    memset(base, 0, sizeof base);
+    s.SetBaseline(base);
+    for(int m = 0; m < 64; m++) s.SetOffset(m, 0);
+    s.SetThresh(0, 0);
+  }
+
+  // Reset between runs, outside of the timing
+  void reset()
+  {
+    s.sortedpackets.clear();
+    s.nextpacket = 0;
+    s.raw16bitdata.clear();
+    s.word = 0;
+    s.expcounter = 0;
+    s.got_unix_time_hi = false;
+    s.unix_time_hi = s.unix_time_lo = 0;
+    s.have_phase = false;
+    *s.firstcount = USBstream::NO_COUNT;
+  }
+
+  // The byte loop of decodefile(), and everything it calls, in reads of
+  // the same size decodefile() uses
+  void decode()
+  {
+    seed = 1;
+    const vector<char> file = make_file(make_packets(NPACKETS));
+    const unsigned int BUFSIZE = 0x10000;
+
+    // Already know the time, so that we don't need to rewind
+    s.unix_time = T0;
+
+    Stopwatch w;
+    uint64_t ops = 0, bytes = 0;
+    do{
+      reset();
+      w.start();
+      for(unsigned int off = 0; off < file.size(); off += BUFSIZE){
+        const unsigned int n = std::min(BUFSIZE, (unsigned int)file.size() - off);
+        if(s.decodebytes(&file[off], n))
+          log_msg(LOG_CRIT, "Rewind requested while benchmarking\n");
+        ops++;
+        bytes += n;
+      }
+      w.stop();
+    }while(!w.done());
+
+    report("decode", "64kB read", w, ops, bytes);
+  }
+
+  // Turning 16-bit words into packets, including putting them in order
+  void raw16bit_to_packets()
+  {
+    seed = 2;
+    const vector<decoded_packet> packets = make_packets(NPACKETS);
+    vector<uint16_t> words;
+    vector<unsigned int> ends;
+    for(unsigned int i = 0; i < packets.size(); i++){
+      make_packet_words(words, packets[i].module, packets[i].time16ns,
+                        packets[i].hits.size());
+      ends.push_back(words.size());
+    }
+
+    Stopwatch w;
+    uint64_t ops = 0, bytes = 0;
+    do{
+      reset();
+      w.start();
+      unsigned int word = 0;
+      for(unsigned int i = 0; i < ends.size(); i++){
+        // As if the time stamps had been decoded, so that these are timed
+        s.unix_time_hi = packets[i].timeunix >> 16;
+        s.unix_time_lo = packets[i].timeunix & 0xffff;
+        for( ; word < ends[i]; word++) s.raw16bitdata.push_back(words[word]);
+        s.raw16bit_to_packets();
+      }
+      w.stop();
+      ops += ends.size();
+      bytes += words.size()*sizeof(uint16_t);
+    }while(!w.done());
+
+    report("raw16bit_to_packets", "packet", w, ops, bytes);
+  }
+
+  template<bool Both> void threshold_cut(const char * const name)
+  {
+    seed = 3;
+    const unsigned int NPATTERNS = 256;
+    static bool allhits[NPATTERNS][64], threshits[NPATTERNS][64];
+    memset(allhits, 0, sizeof allhits);
+    memset(threshits, 0, sizeof threshits);
+    for(unsigned int p = 0; p < NPATTERNS; p++){
+      const unsigned int nhits = 1 + rnd(6);
+      for(unsigned int h = 0; h < nhits; h++){
+        const int channel = rnd(64);
+        allhits[p][channel] = true;
+        threshits[p][channel] = rnd(2);
+      }
+    }
+
+    Stopwatch w;
+    uint64_t ops = 0;
+    unsigned int npassed = 0;
+    do{
+      w.start();
+      for(unsigned int r = 0; r < 256; r++)
+        for(unsigned int p = 0; p < NPATTERNS; p++)
+          npassed += s.ThresholdCut<Both>(allhits[p], threshits[p]);
+      w.stop();
+      ops += 256*NPATTERNS;
+    }while(!w.done());
+
+    // Use the result so that the loop can't be optimized away
+    if(npassed == 0) fprintf(stderr, "No packets passed %s\n", name);
+
+    report(name, "packet", w, ops, 0);
+  }
+
+  // Putting packets in time order as they are decoded
+  void insertsorted()
+  {
+    seed = 4;
+    const vector<decoded_packet> packets = make_packets(NPACKETS);
+
+    Stopwatch w;
+    uint64_t ops = 0;
+    do{
+      reset();
+      vector<decoded_packet> in = packets; // insertsorted() empties them
+      w.start();
+      for(unsigned int i = 0; i < in.size(); i++)
+        s.insertsorted(in[i]);
+      w.stop();
+      ops += packets.size();
+    }while(!w.done());
+
+    report("insertsorted", "packet", w, ops, 0);
+  }
+
+private:
+
+  USBstream s;
+};
+
+//------------------------------------------------------------------------------
+// Benchmarks of what happens after decoding
+
+static uint64_t nbuilt = 0;
+
+static unsigned int count_events(void * context,
+                                 const vector<decoded_packet> & in_packets,
+                                 const vector<int> & OutIndex)
+{
+  (void)context;
+  (void)OutIndex;
+  unsigned int n = 1;
+  for(unsigned int i = 1; i < in_packets.size(); i++)
+    if(StartsNewEvent(in_packets[i-1], in_packets[i])) n++;
+  nbuilt += n;
+  return n;
+}
+
+// Merging three streams.  Every stream sees some of the same events.
+static void merge()
+{
+  seed = 5;
+  const unsigned int NUSB = 3;
+  const vector<decoded_packet> events = make_packets(NPACKETS);
+  vector< vector<decoded_packet> > data(NUSB);
+  unsigned int npackets = 0;
+  for(unsigned int i = 0; i < events.size(); i++)
+    for(unsigned int u = 0; u < NUSB; u++)
+      if(rnd(2) || u == i%NUSB){
+        data[u].push_back(events[i]);
+        npackets++;
+      }
+
+  Stopwatch w;
+  uint64_t ops = 0;
+  do{
+    EventMerger merger;
+    vector< vector<decoded_packet> > CurrentData = data;
+    w.start();
+    merger.SuperBuildEvents(CurrentData, NUSB, count_events);
+    w.stop();
+    ops += npackets;
+  }while(!w.done());
+
+  if(nbuilt == 0) fprintf(stderr, "No events built\n");
+
+  report("merge", "packet", w, ops, 0);
+}
+
+// Putting events into the output format
+static void serialize()
+{
+  seed = 6;
+  const vector<decoded_packet> packets = make_packets(NPACKETS);
+  vector< vector<decoded_packet> > events;
+  for(unsigned int i = 0; i < packets.size(); ){
+    const unsigned int n = std::min(1 + rnd(6), (unsigned int)packets.size() - i);
+    events.push_back(vector<decoded_packet>(packets.begin() + i,
+                                            packets.begin() + i + n));
+    i += n;
+  }
+
+  uint16_t modules[6];
+  for(unsigned int i = 0; i < 6; i++) modules[i] = 200 + i;
+
+  vector<char> buf;
+  Stopwatch w;
+  uint64_t ops = 0, bytes = 0;
+  do{
+    w.start();
+    for(unsigned int i = 0; i < events.size(); i++){
+      buf.clear();
+      SerializeEvent(&events[i][0], events[i].size(), modules, buf);
+      bytes += buf.size();
+    }
+    w.stop();
+    ops += events.size();
+  }while(!w.done());
+
+  report("serialize", "event", w, ops, bytes);
+}
+
+//------------------------------------------------------------------------------
+
+static void parse_options(int argc, char **argv)
+{
+  char c;
+  while((c = getopt(argc, argv, "t:h")) != -1) {
+    switch (c) {
+      case 't': MinTime = atof(optarg); break;
+      case 'h':
+      default:
+        printf(
+          "Usage: %s [-t <seconds>] [benchmark names]\n"
+          "\n"
+          "Times each stage of event building on synthetic data.\n"
+          "\n"
+          "  -t : Run each benchmark for at least this long. default: 1\n"
+          "\n"
+          "Benchmarks: decode raw16bit_to_packets threshold_cut_or\n"
+          "            threshold_cut_and insertsorted merge serialize\n",
+          argv[0]);
+        exit(127);
+    }
+  }
+  for(int index = optind; index < argc; index++)
+    Only.push_back(argv[index]);
+}
+
+int main(int argc, char **argv)
+{
+  parse_options(argc, argv);
+
+  USBstreamBench usb;
+  if(wanted("decode"))              usb.decode();
+  if(wanted("raw16bit_to_packets")) usb.raw16bit_to_packets();
+  if(wanted("threshold_cut_or"))
+    usb.threshold_cut<false>("threshold_cut_or");
+  if(wanted("threshold_cut_and"))
+    usb.threshold_cut<true>("threshold_cut_and");
+  if(wanted("insertsorted"))        usb.insertsorted();
+  if(wanted("merge"))               merge();
+  if(wanted("serialize"))           serialize();
+
+  return 0;
+}
@@ -0,0 +1,409 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <string>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "Checkpoint.h"
+#include "InputRetirer.h"
+#include "RemoteStream.h"
+
+using std::string;
+using std::vector;
+
+// Decoder agent for the distributed event builder.  Decodes the files of
+// one USB stream on the machine the DAQ writes them to, and sends the
+// decoded packets to the event builder (see -R there, and RemoteStream.h).
+// Runs until killed, carrying on with each run the event builder starts.
+
+// In low latency mode, how long to wait between looking for more data in
+// the file the DAQ is writing, in milliseconds.  As in the event builder.
+static const int FOLLOW_POLL_MS = 100;
+
+// How long to wait between looking for new files or trying to connect
+static const int RETRY_MS = 1000;
+
+// Set in parse_options()
+static string InputDir;
+static int USB = -1;
+static string Host;
+static string Port;
+static RetireMode Retire = kRetireRename;
+static string RetireWhere;
+
+// Made afresh for each run, once the event builder has said how to decode
+static USBstream * Stream = NULL;
+static bool Follow = false;
+static int64_t FirstCount; // Our own, see RemoteStream.h
+
+// Gets input files out of the way once the event builder has them safe
+static InputRetirer Retirer;
+
+// A batch sent to the event builder but not yet acknowledged, as sent
+struct held_batch {
+  uint64_t seq;
+  CheckpointWriter message;
+};
+static std::deque<held_batch> Held;
+static uint64_t NextSeq = 0; // Of the next batch we make
+
+// A file we have finished decoding, and the last batch with its data
+struct decoded_file {
+  string name;
+  uint64_t last;
+};
+static std::deque<decoded_file> Decoded;
+
+// The file being decoded, or empty if none
+static string Current;
+
+// Waits for up to 'ms' milliseconds for something to come from the event
+// builder, and deals with any acknowledgements.  Returns false if the
+// connection has failed.
+static bool read_acks(const int fd, const int ms)
+{
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLIN;
+  int wait = ms;
+  while(poll(&p, 1, wait) > 0){
+    wait = 0;
+
+    uint32_t type;
+    CheckpointReader in;
+    if(!recv_message(fd, type, in) || type != kRemoteAck) return false;
+
+    uint64_t acked;
+    in.get(acked);
+    while(!Held.empty() && Held.front().seq < acked) Held.pop_front();
+
+    vector<string> done;
+    while(!Decoded.empty() && Decoded.front().last < acked){
+      done.push_back(Decoded.front().name);
+      Decoded.pop_front();
+    }
+    Retirer.retire(done);
+  }
+  return true;
+}
+
+// Sends a batch, keeping it until it is acknowledged.  Returns false if the
+// connection has failed, in which case it will be sent after reconnecting.
+static bool send_batch(const int fd, const vector<decoded_packet> & packets,
+                       const bool endfile)
+{
+  held_batch b;
+  b.seq = NextSeq++;
+  b.message.put(b.seq);
+  b.message.put((uint8_t)endfile);
+  b.message.put(packets);
+  Held.push_back(b);
+  return send_message(fd, kRemoteBatch, Held.back().message);
+}
+
+// Returns the name of the next file of our USB stream to decode, without
+// the "_<usb>" or the directory, or an empty string if there isn't one.
+static string next_file()
+{
+  // Ask which are being retired before looking, since Retirer may finish
+  // with one in between
+  vector<string> skip = Retirer.pending_names();
+  for(unsigned int i = 0; i < Decoded.size(); i++)
+    skip.push_back(Decoded[i].name);
+  for(unsigned int i = 0; i < skip.size(); i++)
+    skip[i] = skip[i].substr(skip[i].rfind('/') + 1);
+
+  DIR * dp = opendir(InputDir.c_str());
+  if(dp == NULL) return "";
+
+  char suffix[32];
+  snprintf(suffix, sizeof suffix, "_%d", USB);
+
+  vector<string> files;
+  struct dirent * dirp;
+  while((dirp = readdir(dp)) != NULL){
+    string name = dirp->d_name;
+    if(Follow && name.size() > 3 && name.substr(name.size() - 3) == ".wr")
+      name.resize(name.size() - 3);
+    if(name.find('.') != string::npos) continue;
+    if(name.find("baseline") != string::npos) continue;
+    if(name.size() <= strlen(suffix) ||
+       name.substr(name.size() - strlen(suffix)) != suffix) continue;
+    if(find(skip.begin(), skip.end(), name) != skip.end()) continue;
+    files.push_back(name);
+  }
+  closedir(dp);
+
+  if(files.empty()) return "";
+  sort(files.begin(), files.end());
+  return files[0].substr(0, files[0].size() - strlen(suffix));
+}
+
+// Decodes the baseline file, waiting for it to appear, and sets the
+// stream's baselines from it
+static void load_baselines()
+{
+  while(Stream->LoadFile(InputDir + "/baseline") < 1){
+    log_msg(LOG_INFO, "Waiting for the baseline file for USB %d\n", USB);
+    usleep(RETRY_MS*1000);
+  }
+
+  log_msg(LOG_INFO, "Processing baselines...\n");
+  Stream->decodefile();
+
+  vector<decoded_packet> BaselineData;
+  Stream->GetBaselineData(&BaselineData);
+  int baselines[64][64] = { { } };
+  if(!CalculatePedestal(baselines, BaselineData))
+    log_msg(LOG_CRIT, "Bad baseline data from USB %d\n", USB);
+  Stream->SetBaseline(baselines);
+}
+
+// Starts decoding for a new run, with what the event builder has said in
+// 'setup'.  Anything left over from the last run is forgotten, and the
+// files it hasn't taken are decoded again.
+static bool start_run(CheckpointReader & setup)
+{
+  uint8_t follow;
+  uint32_t noutputs, noffsets;
+  setup.get(follow);
+  setup.get(noutputs);
+  if(noutputs == 0 || noutputs > MAX_OUTPUTS) return false;
+
+  delete Stream;
+  Stream = new USBstream;
+  Stream->SetUSB(USB);
+  FirstCount = USBstream::NO_COUNT;
+  Stream->SetFirstCount(&FirstCount);
+  Follow = follow;
+  Stream->SetFollow(Follow);
+
+  for(unsigned int o = 0; o < noutputs; o++){
+    int thresh, mode;
+    setup.get(thresh);
+    setup.get(mode);
+    Stream->SetThresh(thresh, mode, o);
+  }
+
+  setup.get(noffsets);
+  for(unsigned int i = 0; i < noffsets && setup.good(); i++){
+    int module, offset;
+    setup.get(module);
+    setup.get(offset);
+    Stream->SetOffset(module, offset);
+  }
+  if(!setup.done()) return false;
+
+  Held.clear();
+  Decoded.clear();
+  Current = "";
+  NextSeq = 0;
+
+  load_baselines();
+  return true;
+}
+
+// Connects to the event builder, waiting until it is there
+static int connect_builder()
+{
+  while(true){
+    struct addrinfo hints, * addrs;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    const int err = getaddrinfo(Host.c_str(), Port.c_str(), &hints, &addrs);
+    if(err){
+      log_msg(LOG_ERR, "Could not look up %s: %s\n", Host.c_str(),
+              gai_strerror(err));
+    }
+    else{
+      for(struct addrinfo * a = addrs; a != NULL; a = a->ai_next){
+        const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(fd < 0) continue;
+        if(connect(fd, a->ai_addr, a->ai_addrlen) == 0){
+          freeaddrinfo(addrs);
+          const int on = 1;
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+          return fd;
+        }
+        close(fd);
+      }
+      freeaddrinfo(addrs);
+      log_msg(LOG_INFO, "Waiting for the event builder at %s:%s\n",
+              Host.c_str(), Port.c_str());
+    }
+    usleep(RETRY_MS*1000);
+  }
+}
+
+// Says who we are, and does what the event builder says: starts a new run,
+// or sends again what it hasn't got.  Returns false if the connection has
+// failed or the event builder didn't make sense.
+static bool greet(const int fd)
+{
+  CheckpointWriter hello;
+  hello.put(USB);
+  hello.put(Held.empty()? NextSeq: Held.front().seq);
+  hello.put(NextSeq);
+  if(!send_message(fd, kRemoteHello, hello)) return false;
+
+  uint32_t type;
+  CheckpointReader setup;
+  if(!recv_message(fd, type, setup) || type != kRemoteSetup) return false;
+
+  uint8_t fresh;
+  uint64_t from;
+  setup.get(fresh);
+  setup.get(from);
+
+  if(fresh || Stream == NULL){
+    if(!start_run(setup)){
+      log_msg(LOG_ERR, "Got a bad setup from the event builder\n");
+      return false;
+    }
+    log_msg(LOG_NOTICE, "Starting a new run\n");
+    return true;
+  }
+
+  while(!Held.empty() && Held.front().seq < from) Held.pop_front();
+  for(unsigned int i = 0; i < Held.size(); i++)
+    if(!send_message(fd, kRemoteBatch, Held[i].message)) return false;
+  log_msg(LOG_NOTICE, "Carrying on from batch %lu\n", (unsigned long)from);
+  return true;
+}
+
+// Decodes and sends files until the connection fails
+static void serve(const int fd)
+{
+  while(true){
+    if(Current == ""){
+      const string next = next_file();
+      if(next == ""){
+        if(!read_acks(fd, RETRY_MS)) return;
+        continue;
+      }
+      if(Stream->LoadFile(InputDir + "/" + next) < 1){
+        if(!read_acks(fd, RETRY_MS)) return;
+        continue;
+      }
+      Current = next;
+    }
+
+    // As the event builder does it itself, see decode() there
+    vector<decoded_packet> batch;
+    if(Stream->decodefile()){
+      Stream->GetDecodedDataUpToLatestUnixTimeStamp(batch);
+      if(!send_batch(fd, batch, false) || !read_acks(fd, FOLLOW_POLL_MS))
+        return;
+      continue;
+    }
+
+    if(Follow) Stream->GetDecodedDataUpToLatestUnixTimeStamp(batch);
+    else       Stream->GetDecodedDataUpToNextUnixTimeStamp(batch);
+
+    decoded_file f;
+    f.name = Stream->GetFileName();
+    f.last = NextSeq;
+    Decoded.push_back(f);
+    Current = "";
+
+    if(!send_batch(fd, batch, true) || !read_acks(fd, 0)) return;
+  }
+}
+
+static void parse_options(int argc, char **argv)
+{
+  string retire = "rename";
+  if(argc <= 1) goto fail;
+
+  char c;
+  while((c = getopt(argc, argv, "i:u:R:d:h")) != -1) {
+    switch (c) {
+      case 'i': InputDir = optarg; break;
+      case 'u': USB = atoi(optarg); break;
+      case 'R': Host = optarg; break;
+      case 'd': retire = optarg; break;
+      case 'h':
+      default:  goto fail;
+    }
+  }
+  if(InputDir == "" || USB < 0 || Host == ""){
+    printf("You must use the -i, -u and -R options\n");
+    goto fail;
+  }
+  if(optind < argc){
+    printf("Unknown options given\n");
+    goto fail;
+  }
+  if(Host.rfind(':') == string::npos){
+    printf("Give the event builder as <host>:<port>\n");
+    goto fail;
+  }
+  Port = Host.substr(Host.rfind(':') + 1);
+  Host = Host.substr(0, Host.rfind(':'));
+
+  if(retire == "rename") Retire = kRetireRename;
+  else if(retire == "compress") Retire = kRetireCompress;
+  else if(retire.compare(0, 8, "archive:") == 0 && retire.size() > 8){
+    Retire = kRetireArchive;
+    RetireWhere = retire.substr(8);
+  }
+  else{
+    printf("Invalid -d option %s\n", retire.c_str());
+    goto fail;
+  }
+  return;
+
+  fail:
+  printf(
+    "Usage: %s -i <input data directory> -u <USB serial number>\n"
+    "          -R <event builder host>:<port> [-d <what>]\n"
+    "\n"
+    "Decodes the files of one USB stream and sends the decoded data to an\n"
+    "event builder run with -R <port>.\n"
+    "\n"
+    "  -d : What to do with input files once the event builder has them:\n"
+    "       rename:        [default] move them to decoded/ as *.done\n"
+    "       archive:<dir>: hard link them into <dir>, on the same file\n"
+    "                      system, and remove them\n"
+    "       compress:      gzip them into decoded/ as *.done.gz\n",
+    argv[0]);
+  exit(127);
+}
+
+int main(int argc, char **argv)
+{
+  parse_options(argc, argv);
+  start_log();
+  if(!Retirer.start(InputDir, Retire, RetireWhere))
+    log_msg(LOG_CRIT, "Could not set up retiring of input files\n");
+
+  while(true){
+    const int fd = connect_builder();
+    if(greet(fd)) serve(fd);
+    close(fd);
+    log_msg(LOG_WARNING, "Lost the event builder, reconnecting\n");
+    usleep(RETRY_MS*1000);
+  }
+  return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h> // For htonl
+
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "EBReader.h"
+#include "EventRing.h"
+#include "EventServer.h"
+
+using std::string;
+using std::vector;
+
+// Re-emits the events in EBuilder output files, at the pace they were
+// originally taken or some multiple of it, for load testing whatever reads
+// the EBuilder's output.
+
+static double Speed = 1; // 0 means as fast as possible
+static int Repeat = 1;
+static string OutName; // file to write to, or "-" for stdout
+static string ShmName;
+static string SocketPath;
+static vector<string> InFiles;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Don't wait out gaps longer than this many seconds.  They are much more
+// likely to be bad time stamps than real gaps in the data.
+static const int MAX_GAP = 60;
+
+// Seconds of data-taking time between two events, as best we can tell.
+// The 16ns counter is much better than the Unix time stamp, but resets at
+// each sync pulse, so fall back on Unix time when we can't trust it.
+static double time_between(const EBEvent & a, const EBEvent & b)
+{
+  const int64_t dunix = (int64_t)b.time_sec() - a.time_sec();
+  const int64_t d16ns = (int64_t)b.first().time16ns() - a.first().time16ns();
+
+  if(dunix >= -1 && dunix <= 1 && d16ns >= 0 && d16ns < (1 << 29))
+    return d16ns * 16e-9;
+
+  return (dunix > 0 && dunix <= MAX_GAP)? dunix: 0;
+}
+
+static void parse_options(int argc, char **argv)
+{
+  char c;
+  while((c = getopt(argc, argv, "x:n:o:s:u:h")) != -1) {
+    switch (c) {
+      case 'x': Speed = atof(optarg); break;
+      case 'n': Repeat = atoi(optarg); break;
+      case 'o': OutName = optarg; break;
+      case 's': ShmName = optarg; break;
+      case 'u': SocketPath = optarg; break;
+      case 'h':
+      default:  goto fail;
+    }
+  }
+  for(int index = optind; index < argc; index++)
+    InFiles.push_back(argv[index]);
+
+  if(InFiles.empty()){
+    printf("No input files given\n");
+    goto fail;
+  }
+  if(OutName == "" && ShmName == "" && SocketPath == ""){
+    printf("You must use at least one of -o, -s and -u\n");
+    goto fail;
+  }
+  if(OutName == "-" && (ShmName != "" || SocketPath != "")){
+    printf("Can't use -o - with -s or -u, since they log to standard output\n");
+    goto fail;
+  }
+  if(Speed < 0 || Repeat < 1){
+    printf("Speed must be non-negative and repeat count positive\n");
+    goto fail;
+  }
+  return;
+
+  fail:
+  printf(
+    "Usage: %s [-x <speed>] [-n <repeat>] [-o <output file>]\n"
+    "         [-s <shared memory name>] [-u <socket path>] <input files>\n"
+    "\n"
+    "Re-emits the events in EBuilder output files.\n"
+    "\n"
+    "  -x : Multiple of the original data rate to play back at\n"
+    "       default: 1.  0 means as fast as possible\n"
+    "  -n : Play the files this many times\n"
+    "  -o : Write events to this file, or - for standard output\n"
+    "  -s : Publish events to shared memory, as EventBuilder -s\n"
+    "  -u : Serve events on a Unix-domain socket, as EventBuilder -u\n",
+    argv[0]);
+  exit(127);
+}
+
+int main(int argc, char **argv)
+{
+  parse_options(argc, argv);
+
+  int outfd = -1;
+  if(OutName == "-")
+    outfd = 1;
+  else if(OutName != "" &&
+          (outfd = open(OutName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0){
+    fprintf(stderr, "Could not open %s: %s\n", OutName.c_str(), strerror(errno));
+    return 1;
+  }
+
+  EventRingWriter ring;
+  if(ShmName != "" && !ring.open(ShmName.c_str(), 64 << 20)) return 1;
+
+  EventServer server;
+  if(SocketPath != "" && !server.open(SocketPath.c_str())) return 1;
+
+  uint64_t nevents = 0, nbytes = 0;
+  const double start = now();
+  double datatime = 0; // seconds of data time since we started
+
+  for(int rep = 0; rep < Repeat; rep++){
+    for(unsigned int f = 0; f < InFiles.size(); f++){
+      EBFile file;
+      if(!file.open(InFiles[f].c_str())){
+        fprintf(stderr, "%s: %s\n", InFiles[f].c_str(), file.error());
+        return 1;
+      }
+
+      EBEvent ev, last;
+      bool first = true;
+      while(file.next(ev)){
+        if(!first) datatime += time_between(last, ev);
+        first = false;
+        last = ev;
+
+        if(Speed > 0){
+          const double wait = start + datatime/Speed - now();
+          if(wait > 0.001) usleep(wait*1e6);
+        }
+
+        if(outfd >= 0 &&
+           (ssize_t)ev.size() != write(outfd, ev.bytes(), ev.size())){
+          fprintf(stderr, "Write error: %s\n", strerror(errno));
+          return 1;
+        }
+        ring.publish((const char *)ev.bytes(), ev.size());
+        server.publish((const char *)ev.bytes(), ev.size());
+
+        nevents++;
+        nbytes += ev.size();
+      }
+
+      if(file.error())
+        fprintf(stderr, "%s: %s after %lu events\n", InFiles[f].c_str(),
+                file.error(), (unsigned long)nevents);
+    }
+  }
+
+  if(outfd >= 0){
+    const uint32_t nend = htonl(0x53544F50); // "STOP"
+    if(sizeof nend != write(outfd, &nend, sizeof nend))
+      fprintf(stderr, "Write error: %s\n", strerror(errno));
+    if(outfd != 1) close(outfd);
+  }
+
+  server.close();
+
+  const double elapsed = now() - start;
+  fprintf(stderr, "%lu events, %lu bytes in %.3f s: %.0f events/s, %.1f MB/s\n",
+          (unsigned long)nevents, (unsigned long)nbytes, elapsed,
+          nevents/elapsed, nbytes/elapsed/1e6);
+  return 0;
+}
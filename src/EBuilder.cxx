@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <syslog.h>
+#include <arpa/inet.h> // For htons, htonl
+
+#include <fstream>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "EventMerger.h"
+#include "EBuilder.h"
+
+using std::vector;
+
+EBuilder::EBuilder()
+{
+  firstcount = USBstream::NO_COUNT;
+  sink = NULL;
+  sinkcontext = NULL;
+}
+
+EBuilder::~EBuilder()
+{
+  for(unsigned int j = 0; j < streams.size(); j++) delete streams[j];
+}
+
+unsigned int EBuilder::add_usb(const int serial)
+{
+  USBstream * const s = new USBstream;
+  s->SetUSB(serial);
+  s->SetThresh(73, kDoubleLayer); // As EventBuilder does by default
+  s->SetFirstCount(&firstcount);
+  streams.push_back(s);
+  decoded.resize(streams.size());
+  return streams.size() - 1;
+}
+
+bool EBuilder::add_module(const int serial, const int board,
+                          const uint16_t module, const int offset)
+{
+  if(board < 0 || board >= 64 /* maxModules */){
+    log_msg(LOG_ERR, "Board %d on USB %d out of range\n", board, serial);
+    return false;
+  }
+
+  for(unsigned int j = 0; j < streams.size(); j++)
+    if(streams[j]->GetUSB() == serial) streams[j]->SetOffset(board, offset);
+  modules[std::pair<int, int>(serial, board)] = module;
+  return true;
+}
+
+void EBuilder::set_threshold(const int threshold, const TriggerMode mode)
+{
+  for(unsigned int j = 0; j < streams.size(); j++)
+    streams[j]->SetThresh(threshold, (int)mode);
+}
+
+void EBuilder::set_sink(EventSink sink_, void * context)
+{
+  sink = sink_;
+  sinkcontext = context;
+}
+
+void EBuilder::push_baseline(const unsigned int j, const char * const data,
+                             const size_t n)
+{
+  streams[j]->DecodeBuffer(data, n);
+}
+
+bool EBuilder::end_baselines()
+{
+  bool ok = true;
+  for(unsigned int j = 0; j < streams.size(); j++){
+    vector<decoded_packet> BaselineData;
+    streams[j]->GetBaselineData(&BaselineData);
+    int baselines[64 /* maxModules */][64 /* numChannels */] = { { } };
+    if(CalculatePedestal(baselines, BaselineData))
+      streams[j]->SetBaseline(baselines);
+    else
+      ok = false;
+  }
+  return ok;
+}
+
+void EBuilder::push(const unsigned int j, const char * const data,
+                    const size_t n)
+{
+  streams[j]->DecodeBuffer(data, n);
+
+  // Packets from before the latest Unix time stamp are in order for good
+  streams[j]->GetDecodedDataUpToLatestUnixTimeStamp(decoded[j]);
+}
+
+unsigned int EBuilder::build()
+{
+  const unsigned int nevents =
+    merger.SuperBuildEvents(decoded, streams.size(), build_events, this);
+  deliver();
+  return nevents;
+}
+
+unsigned int EBuilder::finish()
+{
+  // Nothing more is coming from any USB, so none is waited for
+  bool absent[streams.size() + 1];
+  for(unsigned int j = 0; j < streams.size(); j++){
+    streams[j]->GetAllDecodedData(decoded[j]);
+    absent[j] = true;
+  }
+
+  unsigned int nevents =
+    merger.SuperBuildEvents(decoded, streams.size(), build_events, this,
+                            absent);
+  nevents += merger.FlushEvents(build_events, this);
+  deliver();
+  return nevents;
+}
+
+// Gives what has been built to the sink, if there is one
+void EBuilder::deliver()
+{
+  if(sink != NULL && !built.empty()){
+    sink(sinkcontext, &built[0], built.size());
+    built.clear();
+  }
+}
+
+void EBuilder::pull(vector<char> & events)
+{
+  if(events.empty()) events.swap(built);
+  else events.insert(events.end(), built.begin(), built.end());
+  built.clear();
+}
+
+// Serializes the events in 'packets', for EventMerger::SuperBuildEvents()
+unsigned int EBuilder::build_events(void * eb,
+                                    const vector<decoded_packet> & packets,
+                                    const vector<int> & usbs)
+{
+  EBuilder & b = *(EBuilder *)eb;
+
+  b.packetmodules.resize(packets.size());
+  for(unsigned int i = 0; i < packets.size(); i++){
+    const std::pair<int, int> board(b.streams[usbs[i]]->GetUSB(),
+                                    packets[i].module);
+    const std::map<std::pair<int, int>, uint16_t>::const_iterator m =
+      b.modules.find(board);
+    if(m == b.modules.end())
+      log_msg(LOG_ERR, "Got unknown module number %d on USB %d\n",
+              board.second, board.first);
+    b.packetmodules[i] = m == b.modules.end()? 0: m->second;
+  }
+
+  return SerializeEvents(packets, 0, packets.size(), &b.packetmodules[0],
+                         0xff, b.built);
+}
@@ -4,12 +4,12 @@
 #include <pthread.h>
 #include <errno.h>
 #include <syslog.h>
-#include <libgen.h>
 #include <dirent.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <time.h>
 #include <netinet/in.h>
@@ -22,14 +22,24 @@
 #include <deque>
 #include <vector>
 
-#include "USBstream.h"
 #include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "SPSCQueue.h"
+#include "EventRing.h"
+#include "EventServer.h"
+#include "EventMerger.h"
+#include "Checkpoint.h"
+#include "OutputFile.h"
+#include "InputRetirer.h"
+#include "RunSummary.h"
+#include "WorkPool.h"
+#include "RemoteStream.h"
+#include "LatencyTrace.h"
 
 using std::vector;
 using std::string;
 using std::map;
 
-enum TriggerMode {kNone, kSingleLayer, kDoubleLayer};
 enum packet_type { kOVR_DISCRIM = 0, kOVR_ADC = 1, kOVR_TRIGBOX = 2};
 
 
@@ -66,61 +76,371 @@ static const int numChannels=64; // Number of channels in M64
 static const int maxModules=64; // Maximum number of modules PER USB
                                 // (okay if less than total number of modules)
 
-// Map from USB serial numbers to their location in array of OVUSBStreams
-// (sigh).  Filled in setup_from_config().
-static map<int, int> usbserial_to_usbindex;
-
 // Will stop if we haven't seen a new input file in ENDTIME seconds when
 // we know the run is over or MAXTIME seconds regardless. For Double
 // Chooz, MAXTIME was 60.
 static const int MAXTIME=5;
 static const int ENDTIME=1;
 
-static const int SYNC_PULSE_CLK_COUNT_PERIOD_LOG2=29; // trigger system emits
-                                                      // sync pulse at 62.5MHz
-
-// Mutated as program runs
-static int OV_EB_State = 0;
-static int initial_delay = 0;
+// Size of the shared memory ring that built events are published to, if
+// asked for.  Several seconds of data at typical rates.
+static const uint64_t SHM_RING_SIZE = 64 << 20;
+
+// In low latency mode, how long to wait between looking for more data in
+// the files the DAQ is writing, in microseconds.
+static const int FOLLOW_POLL_US = 100000;
+
+// In remote mode, how much of each USB stream's data, as sent, to take in
+// from its agent before it is built, without -m
+static const uint64_t REMOTE_QUEUE_BYTES = 64 << 20;
+
+// Catch-up mode: once this many sets of input files are waiting, the event
+// builder has fallen well behind, and works for throughput instead of
+// latency until no more than CATCHUP_LEAVE_SETS are.  It takes a checkpoint,
+// syncing the output files, only every CATCHUP_CHECKPOINT_SETS file sets,
+// decodes files in smaller pieces so more of them are spread over the
+// threads, and leaves retiring input files until it has caught up.
+static const unsigned int CATCHUP_ENTER_SETS = 6;
+static const unsigned int CATCHUP_LEAVE_SETS = 2;
+static const int CATCHUP_CHECKPOINT_SETS = 4;
+static const unsigned int CATCHUP_PIECE_BYTES = 256 << 10;
+
+// One stream of built events, with its own trigger mode and threshold,
+// going to its own series of output files.  All are built from the same
+// decoded and merged data; each packet is tagged with the outputs that want
+// it (see decoded_packet::tags), and each output's events are formed from
+// its own packets alone.
+struct output_stream {
+  output_stream()
+  {
+    threshold = 73; //default 1.5 PE threshold
+    mode = kDoubleLayer; // double-layer threshold
+    subrun = 0;
+    start = 0;
+    events = 0;
+  }
 
-// Set in parse_options()
-static int Threshold = 73; //default 1.5 PE threshold
-static string OutBase; // output file
-static TriggerMode EBTrigMode = kDoubleLayer; // double-layer threshold
-static string InputDir; // input data directory
+  string base; // output file name, before the subrun number
+  int threshold;
+  TriggerMode mode;
 
-// Set in setup_from_config() and used throughout
-static unsigned int numUSB = 0;
+  OutputFile file; // The file we are writing, and where we are in the run
+  unsigned int subrun;
+  time_t start; // When this subrun's file was opened
+  unsigned int events; // Events written to this subrun
+  RunSummary summary; // Of this subrun, if Monitor
+};
 
-// Maps {USB_serial, board_number}, the input numbering convention, to
-// pmtboard_u, the output numbering convention
-static map<std::pair<int, int>, uint16_t> PMTUniqueMap;
+// The events in each file set are formed and put into the output format in
+// up to this many slices at once, each a job for the WorkPool, but only if
+// each slice would get at least minSlicePackets packets.
+static const unsigned int maxSlices = 8;
+static const unsigned int minSlicePackets = 4096;
+
+// One slice of the merged packets, from 'begin' to 'end', each moved
+// forward to the start of an event, made into events for one output in
+// 'buf'
+struct event_slice {
+  const char * name; // Of the partition, for logging
+  const vector<decoded_packet> * packets;
+  const uint16_t * modules; // output module number for each of 'packets'
+  uint8_t mask; // The output's bit in decoded_packet::tags
+  size_t begin, end;
+  vector<char> buf;
+  vector<size_t> eventends; // offset in 'buf' of the end of each event
+  bool monitor; // Whether to fill 'summary'
+  RunSummary summary; // Of these events, if monitor
+  int pending; // For WorkPool::wait().  Only touch with __atomic builtins
+};
 
-static USBstream OVUSBStream[maxUSB];
+// Everything needed to build one run: its own options, input directory,
+// USB streams, outputs and checkpoint.  The event builder runs just one, or
+// in daemon mode (see -D), several at once, one per thread, all sharing the
+// decoding and event forming threads in Pool.
+class Partition {
+
+public:
+
+  // 'name' is put in front of log messages, if not empty
+  Partition(const string & name);
+
+  // Sets the options from the command line, or a line of the partitions
+  // file.  If they are bad, prints the usage and exits.
+  void parse_options(int argc, char **argv);
+
+  // Builds the run, and returns when it is over.  For threading.
+  static void * Run(void * partition);
+
+private:
+
+  const char * log_name() const { return Name == ""? NULL: Name.c_str(); }
+
+  static bool decode(void * job);
+  static unsigned int build_events(void * partition,
+                                   const vector<decoded_packet> & in_packets,
+                                   const vector<int> & OutIndex);
+
+  void queue_batch(const int j, vector<decoded_packet> * batch);
+  void check_status(const vector<string> & files);
+  void catch_up(const bool yes, const unsigned int backlog);
+  bool TryInitRun();
+  void InitRun();
+  void set_aside_late(vector<string> & files);
+  void leave_out(const unsigned int j, const string & set);
+  bool OpenNextFileSet();
+  void open_subrun(output_stream & out);
+  void reopen_subrun(output_stream & out, const int64_t offset);
+  void close_subrun(output_stream & out);
+  void next_subrun(output_stream & out);
+  bool subrun_full(const output_stream & out, const size_t len);
+  unsigned int BuildEvents(const vector<decoded_packet> & in_packets,
+                           const vector<int> & OutIndex);
+  bool add_output(const string & arg);
+  bool GetBaselines();
+  void LoadBaselineData();
+  void setup_from_config(const string & configfile);
+  vector<string> files_being_read();
+  bool HandleOpenNextFileSet();
+  bool ReceiveFileSet(vector< vector<decoded_packet> > & CurrentData);
+  void start_remote();
+  void StartDecodeFileSet();
+  void FinishDecodeFileSet();
+  void DrainQueues(vector< vector<decoded_packet> > & CurrentData);
+  void trace_decoded();
+  void BuildQueuedData(vector< vector<decoded_packet> > & CurrentData);
+  void write_checkpoint(vector< vector<decoded_packet> > & CurrentData,
+                        const vector<string> & done);
+  void save_progress(vector< vector<decoded_packet> > & CurrentData);
+  void read_checkpoint(vector< vector<decoded_packet> > & CurrentData,
+                       int64_t offsets[MAX_OUTPUTS]);
+  void build_subrun(vector< vector<decoded_packet> > & CurrentData);
+  void MainBuild();
+
+  const string Name;
+  string ConfigFile; // Set in parse_options()
+
+  // This partition's number in Pool
+  unsigned int Client;
+
+  // Mutated as program runs
+  int OV_EB_State;
+  int initial_delay;
+  int Ddelay;
+  bool CatchingUp; // See CATCHUP_ENTER_SETS
+
+  // Set in parse_options()
+  string InputDir; // input data directory
+  bool LowLatency; // follow files while the DAQ writes them
+  string ShmName; // shared memory to publish events to, if any
+  string SocketPath; // Unix-domain socket to serve events on, if any
+  bool Resume; // carry on from the checkpoint
+  string CheckpointName; // first output's base name + ".checkpoint"
+  uint64_t MemoryBudget; // bytes of decoded data to hold, 0 = no limit
+  uint64_t RotateBytes; // start a new output file at this size, or
+  int RotateSeconds;    // after this long.  If both are 0, after
+                        // max_filesets_subrun sets of input files.
+  RetireMode Retire; // what to do with input files
+  string RetireWhere; // archive directory or file of sums, for Retire
+  bool Monitor; // write a RunSummary with each output file
+  int RemotePort; // take decoded data from agents on this port instead, if
+                  // not 0.  See RemoteStream.h.
+  bool Trace; // time each file set's way through, see LatencyTrace.h
+  int DegradeSeconds; // build without a USB stream whose file is this many
+                      // seconds late, if not 0
+
+  // Set in setup_from_config() and used throughout
+  unsigned int numUSB;
+
+  // Map from USB serial numbers to their location in array of OVUSBStreams
+  // (sigh).  Filled in setup_from_config().
+  map<int, int> usbserial_to_usbindex;
+
+  // Maps {USB_serial, board_number}, the input numbering convention, to
+  // pmtboard_u, the output numbering convention
+  map<std::pair<int, int>, uint16_t> PMTUniqueMap;
+
+  USBstream OVUSBStream[maxUSB];
+
+  // Shared by this partition's USB streams.  See USBstream::SetFirstCount().
+  int64_t FirstCount;
+
+  // Decoded data on its way from each USB stream's decoding job to the
+  // event builder, one batch per file set, or with -l, one every so often
+  // as the files grow.  Each queue has exactly one producer (the decoding)
+  // and one consumer (the partition's thread), so decoding the next file
+  // set can go on while events are built from the last one.  Only that
+  // far, though: the streams still go from file set to file set together,
+  // so one slow stream holds up the decoding of the others' next files.
+  SPSCQueue<vector<decoded_packet> *, 16> DecodedQueue[maxUSB];
+
+  // For a decoding job to wait on when its queue is full, signalled each
+  // time the queues are drained
+  pthread_mutex_t QueueLock;
+  pthread_cond_t QueueDrained;
+
+  // Decoded data handed over by the partition's thread itself, which can't
+  // use DecodedQueue.  See leave_out().
+  vector<decoded_packet> Unqueued[maxUSB];
+
+  // For the decoding jobs, see StartDecodeFileSet()
+  struct decode_job {
+    Partition * partition;
+    int usb;
+    int64_t started, finished; // wall_us(), if Trace
+  };
+  decode_job DecodeJobs[maxUSB];
+  int decoders_running; // Only touch with __atomic builtins
+
+  // Holds the state of event building between file sets
+  EventMerger Merger;
+
+  // For -g.  Which USB streams the file set being read has no file from,
+  // and which have been left out and not yet had data merged since.  For
+  // each, the name of the latest file set built without it, up to which its
+  // files are set aside in late/.  And since when we have been waiting for
+  // a file, or 0.
+  bool Absent[maxUSB];
+  bool Rejoining[maxUSB];
+  string MissedUpTo[maxUSB];
+  time_t MissingSince;
+
+  // The first is set with -o, -t and -T, and any others with -O.  Only the
+  // first is published to the shared memory ring and the socket, and only
+  // its files count for -d delete.
+  output_stream Outputs[MAX_OUTPUTS];
+  unsigned int numOutputs;
+
+  // Sets of input files that have gone into the first output's current file
+  int NFileSets;
+
+  // Input files decoded since the last checkpoint, and how many sets of
+  // them.  They are left where they are until a checkpoint covers them.
+  vector<string> Unsaved;
+  int UnsavedSets;
+
+  // Sync pulse diagnostics for the data being built, for every output's
+  // summary, if Monitor
+  RunSummary SyncSummary;
+
+  // Gets input files out of the way after we read them
+  InputRetirer Retirer;
+
+  // In remote mode, gets the decoded data from the agents instead
+  RemoteReceiver Receiver;
+
+  // Opened in Run() if the user asked for them
+  EventRingWriter EventRing;
+  EventServer EventSocket;
+
+  // *Size* set in setup_from_config()
+  bool *overflow; // Keeps track of sync overflows for all boards
+
+  // Keeps track of max clock count for sync overflows for all boards
+  long int *maxcount_16ns;
+
+  // If Trace, the times of the file set being read: when each file was
+  // last modified and when they were found.  And of the last set decoded,
+  // if it hasn't been built from yet: when its oldest file was last
+  // modified, or 0 if unknown, and when it was decoded, or 0 if none.
+  LatencyTrace Latency;
+  int64_t FileTimes[maxUSB];
+  int64_t FoundTime;
+  int64_t WaitingOldest, WaitingDecoded;
+
+  // Module number of each packet being built, see BuildEvents()
+  vector<uint16_t> Modules;
+
+  event_slice Slices[MAX_OUTPUTS][maxSlices];
+};
 
-// *Size* set in setup_from_config()
-static bool *overflow; // Keeps track of sync overflows for all boards
+// Runs the decoding and event forming for every partition.  Made in main().
+static WorkPool * Pool;
 
-// Keeps track of max clock count for sync overflows for all boards
-static long int *maxcount_16ns;
+// Set in parse_options() from the command line.  PoolThreads 0 means one per
+// CPU.
+static string PartitionsFile; // If given, run the partitions it lists
+static int PoolThreads = 0;
 
+Partition::Partition(const string & name): Name(name)
+{
+  Client = 0;
+  OV_EB_State = 0;
+  initial_delay = 0;
+  Ddelay = 0;
+  CatchingUp = false;
+  LowLatency = false;
+  Resume = false;
+  MemoryBudget = 0;
+  RotateBytes = 0;
+  RotateSeconds = 0;
+  Retire = kRetireRename;
+  Monitor = false;
+  RemotePort = 0;
+  Trace = false;
+  DegradeSeconds = 0;
+  numUSB = 0;
+  FirstCount = USBstream::NO_COUNT;
+  decoders_running = 0;
+  numOutputs = 1;
+  NFileSets = 0;
+  UnsavedSets = 0;
+  overflow = NULL;
+  maxcount_16ns = NULL;
+  FoundTime = WaitingOldest = WaitingDecoded = 0;
+  for(int j = 0; j < maxUSB; j++) Absent[j] = Rejoining[j] = false;
+  MissingSince = 0;
+  pthread_mutex_init(&QueueLock, NULL);
+  pthread_cond_init(&QueueDrained, NULL);
+}
 
-// Decodes USB stream with array index *usbindex. For threading.
-static void * decode(void * usbindex)
+// Pass a batch of decoded data from USB stream j to the event builder
+void Partition::queue_batch(const int j, vector<decoded_packet> * batch)
 {
-  OVUSBStream[*((int *)usbindex)].decodefile();
-  return NULL;
+  // The partition's thread drains the queues at least once per file set, so
+  // this should very rarely have to wait.  It never runs a decoding job
+  // itself while a queue could be full: it only helps with them in
+  // FinishDecodeFileSet(), after draining the queues, and each job queues
+  // one batch per file set, except with -l, when the decoding is over by
+  // then.
+  if(DecodedQueue[j].push(batch)) return;
+
+  pthread_mutex_lock(&QueueLock);
+  while(!DecodedQueue[j].push(batch))
+    pthread_cond_wait(&QueueDrained, &QueueLock);
+  pthread_mutex_unlock(&QueueLock);
 }
 
-// opens output data file
-static int open_file(const char * const name)
+// Decodes the file of one USB stream, given by a decode_job, and queues the
+// result up for the event builder.  A job for Pool.  If we're following a
+// file as it's written, passes on what we have so far and asks to be run
+// again after a while.
+bool Partition::decode(void * job)
 {
-  errno = 0;
-  const int fd = open(name, O_WRONLY | O_CREAT, 0644);
-  if(fd < 0)
-    log_msg(LOG_CRIT, "Fatal Error: failed to open file %s: %s\n",
-            name, strerror(errno));
-  return fd;
+  Partition & p = *((decode_job *)job)->partition;
+  const int j = ((decode_job *)job)->usb;
+  set_log_name(p.log_name());
+
+  if(p.Trace && !((decode_job *)job)->started)
+    ((decode_job *)job)->started = wall_us();
+
+  if(p.OVUSBStream[j].decodefile()){
+    vector<decoded_packet> * batch = new vector<decoded_packet>;
+    p.OVUSBStream[j].GetDecodedDataUpToLatestUnixTimeStamp(*batch);
+    p.queue_batch(j, batch);
+    return true;
+  }
+
+  vector<decoded_packet> * batch = new vector<decoded_packet>;
+  if(p.LowLatency)
+    p.OVUSBStream[j].GetDecodedDataUpToLatestUnixTimeStamp(*batch);
+  else
+    // XXX worried about this.  It reads up to the Unix time stamp, a
+    // synchronization point, except nothing seems to keep these time stamps
+    // synchronized between the several USB streams.
+    p.OVUSBStream[j].GetDecodedDataUpToNextUnixTimeStamp(*batch);
+  p.queue_batch(j, batch);
+  if(p.Trace) ((decode_job *)job)->finished = wall_us();
+  return false;
 }
 
 static int check_disk_space(const string & dir)
@@ -148,12 +468,11 @@ static int check_disk_space(const string & dir)
   return 0;
 }
 
-static void check_status(const vector<string> & files)
+void Partition::check_status(const vector<string> & files)
 {
   // Performance monitor
   const int f_delay = (int)(latency*files.size()/numUSB/20);
   if(f_delay != OV_EB_State) {
-    static int Ddelay = 0;
     if(f_delay > OV_EB_State) {
       if(OV_EB_State <= initial_delay) { // OV EBuilder was not already behind
         log_msg(LOG_NOTICE, "Falling behind processing files\n");
@@ -182,13 +501,33 @@ static void check_status(const vector<string> & files)
     }
     OV_EB_State = f_delay;
   }
+
+  const unsigned int backlog = files.size()/numUSB;
+  if(!CatchingUp && backlog >= CATCHUP_ENTER_SETS) catch_up(true, backlog);
+  else if(CatchingUp && backlog <= CATCHUP_LEAVE_SETS) catch_up(false, backlog);
+}
+
+// Goes into catch-up mode, see CATCHUP_ENTER_SETS, or back to normal.
+// None of it changes the output.
+void Partition::catch_up(const bool yes, const unsigned int backlog)
+{
+  if(yes)
+    log_msg(LOG_NOTICE, "%u file sets waiting, catching up\n", backlog);
+  else
+    log_msg(LOG_NOTICE, "Caught up, %u file sets waiting\n", backlog);
+
+  CatchingUp = yes;
+  for(unsigned int j = 0; j < numUSB; j++)
+    OVUSBStream[j].SetPieceBytes(yes? CATCHUP_PIECE_BYTES:
+                                 USBstream::PIECE_BYTES);
+  Retirer.defer(yes);
 }
 
 // Fills myfiles with a list of files in the given directory.
 //
 // These files are the set that does not have a dot in their name.
 // This excludes files that the DAQ is in the process of writing out,
-// which end with ".wr".
+// which end with ".wr", unless 'allow_wr' is true.
 //
 // Also exclude files with names containing "baseline" unless
 // 'allow_baseline' is true.
@@ -196,7 +535,8 @@ static void check_status(const vector<string> & files)
 // Return true if no files are found that satisfy those rules, including if
 // the directory couldn't be read.  Otherwise, returns false.
 static bool GetDir(const std::string & dir, std::vector<std::string> &myfiles,
-                   const bool allow_baseline = false)
+                   const bool allow_baseline = false,
+                   const bool allow_wr = false)
 {
   DIR *dp;
   struct dirent *dirp;
@@ -207,7 +547,9 @@ static bool GetDir(const std::string & dir, std::vector<std::string> &myfiles,
   while((dirp = readdir(dp)) != NULL){
     const std::string myfname = std::string(dirp->d_name);
 
-    if(myfname.find(".") != std::string::npos)
+    const size_t dot = myfname.find(".");
+    if(dot != std::string::npos &&
+       !(allow_wr && dot == myfname.size() - 3 && myfname.substr(dot) == ".wr"))
       continue;
 
     if(!allow_baseline && (myfname.find("baseline")  != std::string::npos))
@@ -221,7 +563,7 @@ static bool GetDir(const std::string & dir, std::vector<std::string> &myfiles,
   return myfiles.size()==0;
 }
 
-static bool TryInitRun()
+bool Partition::TryInitRun()
 {
   vector<string> files;
   if(GetDir(InputDir, files) && errno)
@@ -235,7 +577,7 @@ static bool TryInitRun()
 
 // Checks that we can open the input directory and that there's at least
 // one file in there. Sets up performance statistics.
-static void InitRun()
+void Partition::InitRun()
 {
   const time_t oldtime = time(0);
 
@@ -247,16 +589,88 @@ static void InitRun()
   }
 }
 
+// Moves the files of USB streams that have been left out of file sets
+// already built (see -g) into late/, since their data would come too late to
+// be merged in order, and takes them out of 'files'.  Such a stream is
+// waited for again from the next file set on.
+void Partition::set_aside_late(vector<string> & files)
+{
+  for(unsigned int i = 0; i < files.size(); i++){
+    const size_t delim = files[i].find('_');
+    const int usb = strtol(files[i].substr(delim+1).c_str(), NULL, 10);
+    const map<int, int>::const_iterator k = usbserial_to_usbindex.find(usb);
+    if(k == usbserial_to_usbindex.end() || MissedUpTo[k->second] == "" ||
+       files[i].substr(0, delim) > MissedUpTo[k->second] ||
+       files[i].find('.') != string::npos) // Still being written
+      continue;
+
+    const string late = InputDir + "/late";
+    if(mkdir(late.c_str(), 0755) < 0 && errno != EEXIST)
+      log_msg(LOG_CRIT, "Could not create directory %s: %s\n", late.c_str(),
+              strerror(errno));
+    if(rename((InputDir + "/" + files[i]).c_str(),
+              (late + "/" + files[i]).c_str()) < 0)
+      log_msg(LOG_CRIT, "Could not move input file %s to late/: %s\n",
+              files[i].c_str(), strerror(errno));
+
+    log_msg(LOG_WARNING, "%s came after its file set was built without it, "
+            "moved to late/\n", files[i].c_str());
+    Absent[k->second] = false;
+    files.erase(files.begin()+i);
+    i--;
+  }
+}
+
+// Builds the file set being opened without USB stream j, whose file is late
+// (see -g).  'set' is the name of the file set.
+void Partition::leave_out(const unsigned int j, const string & set)
+{
+  if(!Absent[j]){
+    log_msg(LOG_WARNING, "Building without USB %d, whose file is late\n",
+            OVUSBStream[j].GetUSB());
+
+    // What it has decoded can still be merged, since it won't be waited for
+    OVUSBStream[j].GetAllDecodedData(Unqueued[j]);
+  }
+  Absent[j] = Rejoining[j] = true;
+  MissedUpTo[j] = set;
+
+  if(Monitor)
+    for(map<std::pair<int, int>, uint16_t>::const_iterator m =
+        PMTUniqueMap.begin(); m != PMTUniqueMap.end(); m++)
+      if(m->first.first == OVUSBStream[j].GetUSB())
+        for(unsigned int o = 0; o < numOutputs; o++)
+          Outputs[o].summary.add_missing_set(m->second);
+}
+
 // If there is a file ready for each USB stream, open one for each.
-// Returns true if this happens, and false otherwise.
-static bool OpenNextFileSet()
+// Returns true if this happens, and false otherwise.  With -g, once the
+// missing files are DegradeSeconds late, opens the ones there are instead,
+// and from then on doesn't wait for those streams until they send a file.
+bool Partition::OpenNextFileSet()
 {
   if(check_disk_space(InputDir) < 0) // Why are we checking the *input* directory?
     log_msg(LOG_CRIT, "Fatal error in check_disk_space(%s)\n", InputDir.c_str());
 
+  // Ignore files we have already read but haven't got out of the way yet.
+  // Ask which those are before looking, since Retirer may finish with one
+  // in between.
+  vector<string> retiring = Retirer.pending_names();
+  retiring.insert(retiring.end(), Unsaved.begin(), Unsaved.end());
+  for(unsigned int j = 0; j < retiring.size(); j++)
+    retiring[j] = retiring[j].substr(retiring[j].rfind('/') + 1);
+
   vector<string> files;
-  if(GetDir(InputDir, files)) return false;
-  if(files.size() < numUSB) return false;
+  if(GetDir(InputDir, files, false, LowLatency)) return false;
+
+  for(unsigned int j = 0; j < files.size(); j++){
+    if(find(retiring.begin(), retiring.end(), files[j]) != retiring.end()){
+      files.erase(files.begin()+j);
+      j--;
+    }
+  }
+
+  if(files.size() < (DegradeSeconds? 1: numUSB)) return false;
 
   sort(files.begin(), files.end());
 
@@ -270,39 +684,49 @@ static bool OpenNextFileSet()
     }
   }
 
+  if(DegradeSeconds) set_aside_late(files);
+
   check_status(files); // Performance monitor
 
-  int missing = 0;
+  // The oldest file from each USB stream.  Those we are already building
+  // without aren't waited for.
+  vector<string> next(numUSB);
+  int missing = 0, late = 0;
   for(unsigned int k = 0; k<numUSB; k++) {
-    for(unsigned int j = k; j < files.size(); j++) {
+    for(unsigned int j = 0; j < files.size() && next[k] == ""; j++) {
       const size_t fname_it_delim = files[j].find(fdelim);
 
       const string fusb = files[j].substr(fname_it_delim+1);
-      if(strtol(fusb.c_str(), NULL, 10) == OVUSBStream[k].GetUSB()) {
-        log_msg(LOG_INFO, "Data file from USB %d found\n", OVUSBStream[k].GetUSB());
-        std::swap(files[j], files[k]);
-        break;
-      }
+      if(strtol(fusb.c_str(), NULL, 10) == OVUSBStream[k].GetUSB())
+        next[k] = files[j];
+    }
 
-      if(j == files.size()-1){ // Failed to find a file for USB k
-        log_msg(LOG_INFO, "Data file from USB %d not found\n", OVUSBStream[k].GetUSB());
-        missing++;
-      }
+    if(next[k] != "")
+      log_msg(LOG_INFO, "Data file from USB %d found\n", OVUSBStream[k].GetUSB());
+    else{ // Failed to find a file for USB k
+      log_msg(LOG_INFO, "Data file from USB %d not found\n", OVUSBStream[k].GetUSB());
+      missing++;
+      if(!Absent[k]) late++;
     }
   }
-  if(missing > 0){
+  if(late > 0 || missing == (int)numUSB){
     log_msg(LOG_WARNING, "Only %d of %d USB data files found\n",
             numUSB-missing, numUSB);
-    return false;
-  }
+    if(!DegradeSeconds || missing == (int)numUSB) return false;
 
-  vector<string>::iterator filesit = files.begin();
+    if(!MissingSince) MissingSince = time(0);
+    if(difftime(time(0), MissingSince) < DegradeSeconds) return false;
+  }
+  MissingSince = 0;
 
   string base_filename;
+  string newest; // Name of the file set, from its newest file
   for(unsigned int k=0; k<numUSB; k++) {
-    const size_t fname_it_delim = filesit->find(fdelim);
-    const string ftime_min = filesit->substr(0, fname_it_delim);
-    const string fusb = filesit->substr(fname_it_delim+1);
+    if(next[k] == "") continue;
+
+    const size_t fname_it_delim = next[k].find(fdelim);
+    const string ftime_min = next[k].substr(0, fname_it_delim);
+    newest = std::max(newest, ftime_min);
 
     // Build input filename ( _$usb will be added by LoadFile function )
     base_filename=InputDir;
@@ -310,32 +734,137 @@ static bool OpenNextFileSet()
     base_filename.append(ftime_min);
     int status = 0;
     if( (status = OVUSBStream[k].LoadFile(base_filename)) < 1 ) // Can't load file
-      return status;
+      return false;
+
+    if(Trace){
+      // Still being written, if we're following it
+      const string name = OVUSBStream[k].GetFileName();
+      struct stat st;
+      FileTimes[k] = 0;
+      if(stat(name.c_str(), &st) == 0 || stat((name + ".wr").c_str(), &st) == 0)
+        FileTimes[k] = (int64_t)st.st_mtim.tv_sec*1000000 +
+                       st.st_mtim.tv_nsec/1000;
+    }
+  }
 
-    filesit++;
+  for(unsigned int k = 0; k < numUSB; k++){
+    if(next[k] == "") leave_out(k, newest);
+    else if(Absent[k]){
+      log_msg(LOG_NOTICE, "Building with USB %d again\n",
+              OVUSBStream[k].GetUSB());
+      Absent[k] = false;
+    }
   }
 
+  if(Trace) FoundTime = wall_us();
   return true;
 }
 
-static void BuildEvent(const vector<decoded_packet> & in_packets,
-                       const vector<int> & OutIndex, const int fd)
+static string subrun_name(const output_stream & out)
 {
-  if(fd <= 0)
-    log_msg(LOG_CRIT, "Fatal Error in BuildEvent(). Invalid file "
-      "handle for previously opened data file!\n");
+  const unsigned int BUFSIZE = 1024;
+  char name[BUFSIZE];
+  snprintf(name, BUFSIZE, "%s_%05u", out.base.c_str(), out.subrun);
+  return name;
+}
 
-  if(in_packets.empty()){
-    log_msg(LOG_WARNING, "Got empty data in BuildEvent(). Trying to continue.\n");
-    return;
+// Starts the output file for this output's current subrun number
+void Partition::open_subrun(output_stream & out)
+{
+  if(!out.file.open(subrun_name(out)))
+    log_msg(LOG_CRIT, "Fatal Error: failed to open output file %s\n",
+            subrun_name(out).c_str());
+  if(&out == &Outputs[0]) NFileSets = 0;
+  out.start = time(0);
+  out.events = 0;
+}
+
+// Opens the output file for this output's current subrun number again
+// after a crash, throwing away anything after 'offset'
+void Partition::reopen_subrun(output_stream & out, const int64_t offset)
+{
+  if(!out.file.reopen(subrun_name(out), offset))
+    log_msg(LOG_CRIT, "Fatal Error: failed to reopen output file %s\n",
+            subrun_name(out).c_str());
+  out.start = time(0);
+  out.events = 0;
+}
+
+void Partition::close_subrun(output_stream & out)
+{
+  const uint32_t end = 0x53544F50; // "STOP"
+  const uint32_t nend = htonl(end);
+  if(!out.file.write(&nend, sizeof nend))
+    log_msg(LOG_ERR, "End of run write error\n");
+
+  if(!out.file.close())
+    log_msg(LOG_ERR, "Could not close output data file\n");
+  else if(&out == &Outputs[0])
+    Retirer.output_done(subrun_name(out));
+
+  if(Monitor){
+    out.summary.write(subrun_name(out) + ".summary", subrun_name(out));
+    out.summary.clear();
+  }
+
+  log_msg(LOG_INFO, "Number of built events in %s: %d\n"
+          "Processed time stamp: %d\n", subrun_name(out).c_str(),
+          out.events, OVUSBStream[0].GetUnixTime());
+
+  if(Trace && &out == &Outputs[0]){
+    Latency.report(subrun_name(out));
+    Latency.clear();
   }
+}
+
+// Closes this output's file and starts the next one
+void Partition::next_subrun(output_stream & out)
+{
+  close_subrun(out);
+  out.subrun++;
+  open_subrun(out);
+}
+
+// True if an event of 'len' bytes should go in a new output file instead of
+// the current one.  Only when rotating by size or time, since otherwise that
+// is done between file sets.
+bool Partition::subrun_full(const output_stream & out, const size_t len)
+{
+  if(out.file.size() == 0) return false;
+  if(RotateBytes && out.file.size() + len + sizeof(uint32_t) > RotateBytes)
+    return true;
+  return RotateSeconds && difftime(time(0), out.start) >= RotateSeconds;
+}
 
-  OVEventHeader evheader;
-  evheader.time_sec = in_packets[0].timeunix;
-  evheader.n_ov_data_packets = in_packets.size();
+// Forms the events of one event_slice and serializes them.  A job for Pool.
+static bool build_slice(void * arg)
+{
+  event_slice & slice = *(event_slice *)arg;
+  const vector<decoded_packet> & packets = *slice.packets;
+  set_log_name(slice.name);
+
+  slice.buf.clear();
+  slice.eventends.clear();
+  if(slice.monitor) slice.summary.clear();
+
+  SerializeEvents(packets, slice.begin, slice.end, slice.modules,
+                  slice.mask, slice.buf, &slice.eventends,
+                  slice.monitor? &slice.summary: NULL);
+  return false;
+}
 
-  if(!evheader.writeout(fd))
-    log_msg(LOG_CRIT, "Fatal Error: Cannot write event header!\n");
+// Builds events out of 'in_packets', which are whole events in time order,
+// for each output, and writes them to its output file and wherever else
+// they go, starting a new output file whenever it is full.  'OutIndex'
+// gives the USB stream index of each packet.  Returns the number of events
+// in the first output.
+unsigned int Partition::BuildEvents(const vector<decoded_packet> & in_packets,
+                                    const vector<int> & OutIndex)
+{
+  // Look up the module numbers, and check the sync pulses, in order here,
+  // since these keep state from packet to packet.
+  Modules.resize(in_packets.size());
+  if(Monitor) SyncSummary.clear();
 
   for(unsigned int packeti = 0; packeti < in_packets.size(); packeti++){
     const decoded_packet & packet = in_packets[packeti];
@@ -346,6 +875,7 @@ static void BuildEvent(const vector<decoded_packet> & in_packets,
               packet.module, usb);
 
     const int16_t module = PMTUniqueMap[std::pair<int, int>(usb, packet.module)];
+    Modules[packeti] = module;
 
     if(!packet.isadc){
       log_msg(LOG_ERR, "Got non-ADC packet. Not supported!\n");
@@ -355,9 +885,11 @@ static void BuildEvent(const vector<decoded_packet> & in_packets,
     // Sync pulse diagnostic info: pulse expected at clock count
     // 2^(SYNC_PULSE_CLK_COUNT_PERIOD_LOG2).  Look for overflows.
     if( packet.time16ns > (1 << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2) ) {
+      if(Monitor)
+        SyncSummary.add_late_count(module, packet.time16ns, !overflow[module]);
       if(!overflow[module]) {
         log_msg(LOG_WARNING, "Module %d missed sync pulse near "
-          "Unix time stamp %ld\n", module, evheader.time_sec);
+          "Unix time stamp %ld\n", module, packet.timeunix);
         overflow[module] = true;
       }
       maxcount_16ns[module] = packet.time16ns;
@@ -368,69 +900,260 @@ static void BuildEvent(const vector<decoded_packet> & in_packets,
       maxcount_16ns[module] = packet.time16ns;
       overflow[module] = false;
     }
+  }
+
+  // Cut the packets into slices at event boundaries and build each
+  // separately for each output.  The first output's first slice is done in
+  // this thread, and the others by Pool, or by this thread too if Pool's
+  // threads are all busy.
+  static const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  const unsigned int nslices = std::max(1u, std::min(
+    std::min((unsigned int)std::max(ncpu, 1L), maxSlices),
+    (unsigned int)(in_packets.size()/minSlicePackets)));
+
+  for(unsigned int o = 0; o < numOutputs; o++){
+    for(unsigned int s = 0; s < nslices; s++){
+      event_slice & slice = Slices[o][s];
+      slice.packets = &in_packets;
+      slice.modules = &Modules[0];
+      slice.mask = 1 << o;
+      slice.begin = in_packets.size()*s/nslices;
+      slice.end   = in_packets.size()*(s+1)/nslices;
+      if(o > 0 || s > 0)
+        Pool->submit(Client, build_slice, &slice, &slice.pending);
+    }
+  }
+  build_slice(&Slices[0][0]);
+
+  // Write them out in order
+  const int64_t now = Trace? wall_us(): 0;
+  unsigned int nevents = 0;
+  for(unsigned int o = 0; o < numOutputs; o++){
+    output_stream & out = Outputs[o];
+
+    for(unsigned int s = 0; s < nslices; s++){
+      if(o > 0 || s > 0) Pool->wait(Client, &Slices[o][s].pending);
+
+      // The slice's counts go in the file its first event goes into
+      const vector<size_t> & ends = Slices[o][s].eventends;
+      if(!ends.empty() && subrun_full(out, ends[0])) next_subrun(out);
+      if(Monitor){
+        if(s == 0) out.summary.add(SyncSummary);
+        out.summary.add(Slices[o][s].summary);
+      }
 
-    OVDataPacketHeader moduleheader;
-    moduleheader.nHits = packet.hits.size();
-    moduleheader.module = module;
-    moduleheader.time16ns = packet.time16ns;
+      const vector<char> & buf = Slices[o][s].buf;
+      for(size_t e = 0, start = 0; e < ends.size(); e++){
+        const size_t end = ends[e];
 
-    if(!moduleheader.writeout(fd))
-      log_msg(LOG_CRIT, "Fatal Error: Cannot write data packet header!\n");
+        if(e > 0 && subrun_full(out, end - start)) next_subrun(out);
 
-    for(int m = 0; m < moduleheader.nHits; m++) {
-      OVHitData hit;
-      hit.channel = packet.hits[m].channel;
-      hit.charge  = packet.hits[m].charge;
+        if(!out.file.write(&buf[start], end - start))
+          log_msg(LOG_CRIT, "Fatal Error: Cannot write event!\n");
+        out.events++;
 
-      if(!hit.writeout(fd))
-        log_msg(LOG_CRIT, "Fatal Error: Cannot write hit!\n");
+        if(o == 0){
+          EventRing.publish(&buf[start], end - start);
+          EventSocket.publish(&buf[start], end - start);
+
+          if(Trace){
+            uint32_t ntime_sec; // See OVEventHeader
+            memcpy(&ntime_sec, &buf[start + 4], sizeof ntime_sec);
+            Latency.add(LatencyTrace::kEventAge,
+                        now - (int64_t)ntohl(ntime_sec)*1000000);
+          }
+        }
+        start = end;
+      }
+      if(o == 0) nevents += ends.size();
     }
   }
+
+  return nevents;
+}
+
+// BuildEvents() for EventMerger::SuperBuildEvents()
+unsigned int Partition::build_events(void * partition,
+                                     const vector<decoded_packet> & in_packets,
+                                     const vector<int> & OutIndex)
+{
+  return ((Partition *)partition)->BuildEvents(in_packets, OutIndex);
+}
+
+// Adds an output given as <output file>:<trigger mode>[:<threshold>] for
+// -O.  Returns false if it can't be made sense of.
+bool Partition::add_output(const string & arg)
+{
+  if(numOutputs >= MAX_OUTPUTS){
+    printf("At most %u outputs allowed\n", MAX_OUTPUTS);
+    return false;
+  }
+
+  // The file name may have colons in its directories, but not after them
+  const size_t slash = arg.rfind('/');
+  const size_t colon = arg.find(':', slash == string::npos? 0: slash);
+  if(colon == string::npos || colon == 0) return false;
+
+  output_stream & out = Outputs[numOutputs];
+  out.base = arg.substr(0, colon);
+
+  char * end;
+  const char * const modestr = arg.c_str() + colon + 1;
+  out.mode = (TriggerMode)strtol(modestr, &end, 10);
+  if(end == modestr) return false;
+  if(*end == ':'){
+    const char * const threshstr = end + 1;
+    out.threshold = strtol(threshstr, &end, 10);
+    if(end == threshstr) return false;
+  }
+  if(*end != '\0') return false;
+
+  numOutputs++;
+  return true;
+}
+
+// Reads the number of megabytes given to option -'opt' into 'bytes', where
+// 'what' says what it is for.  Returns false, having said why, if it isn't
+// a whole number of megabytes that fits.
+static bool parse_megabytes(const char opt, const char * const arg,
+                            const char * const what, uint64_t & bytes)
+{
+  if(arg[strspn(arg, " \t")] == '-'){
+    printf("Negative %s not allowed.\n", what);
+    return false;
+  }
+
+  char * end;
+  errno = 0;
+  const unsigned long mb = strtoul(arg, &end, 10);
+  if(end == arg || *end != '\0' || errno == ERANGE ||
+     (uint64_t)mb > ~(uint64_t)0 >> 20){
+    printf("Invalid -%c option %s\n", opt, arg);
+    return false;
+  }
+  bytes = (uint64_t)mb << 20;
+  return true;
 }
 
-static string parse_options(int argc, char **argv)
+void Partition::parse_options(int argc, char **argv)
 {
-  bool option_t_used = false;
-  string configfile;
+  bool option_t_used = false, option_j_used = false;
+  unsigned int noptions = 0;
+  string retire = "rename";
   if(argc <= 1) goto fail;
 
+  // 0 rather than 1 makes glibc start over completely, as it must for the
+  // next partition's line, if any
+  optind = 0;
   char c;
-  while((c = getopt(argc, argv, "c:t:T:i:o:h")) != -1) {
+  while((c = getopt(argc, argv, "c:t:T:i:o:O:s:u:m:b:w:d:D:j:R:g:lrMLh")) != -1) {
+    noptions++;
     switch (c) {
       case 'i': InputDir = optarg; break;
-      case 'o': OutBase  = optarg; break;
-      case 't': Threshold = atoi(optarg); option_t_used = true; break;
-      case 'T': EBTrigMode = (TriggerMode)atoi(optarg); break;
-      case 'c': configfile = optarg; break;
+      case 'o': Outputs[0].base = optarg; break;
+      case 't': Outputs[0].threshold = atoi(optarg); option_t_used = true; break;
+      case 'T': Outputs[0].mode = (TriggerMode)atoi(optarg); break;
+      case 'O':
+        if(!add_output(optarg)){
+          printf("Invalid -O option %s\n", optarg);
+          goto fail;
+        }
+        break;
+      case 'c': ConfigFile = optarg; break;
+      case 'l': LowLatency = true; break;
+      case 'r': Resume = true; break;
+      case 'M': Monitor = true; break;
+      case 'L': Trace = true; break;
+      case 'm':
+        if(!parse_megabytes(c, optarg, "memory budget", MemoryBudget))
+          goto fail;
+        break;
+      case 'b':
+        if(!parse_megabytes(c, optarg, "output file size", RotateBytes))
+          goto fail;
+        break;
+      case 'w': RotateSeconds = atoi(optarg); break;
+      case 'g': DegradeSeconds = atoi(optarg); break;
+      case 'd': retire = optarg; break;
+      case 's': ShmName = optarg; break;
+      case 'u': SocketPath = optarg; break;
+      case 'R': RemotePort = atoi(optarg); break;
+      case 'D':
+      case 'j':
+        if(Name != ""){
+          printf("-%c can only be given on the command line\n", c);
+          goto fail;
+        }
+        if(c == 'D') PartitionsFile = optarg;
+        else{
+          PoolThreads = atoi(optarg);
+          option_j_used = true;
+        }
+        break;
       case 'h':
       default:  goto fail;
     }
   }
-  if(configfile == ""){
+  if(Name == "" && PartitionsFile != ""){
+    if(noptions != 1u + option_j_used || optind < argc){
+      printf("With -D, only -j may be given as well\n");
+      goto fail;
+    }
+    return;
+  }
+  if(option_j_used && PoolThreads < 1){
+    printf("At least one thread needed for -j\n");
+    goto fail;
+  }
+  if(ConfigFile == ""){
     printf("You must use the -c option\n");
     goto fail;
   }
-  if(OutBase == ""){
+  if(Outputs[0].base == ""){
     printf("You must use the -o option\n");
     goto fail;
   }
-  if(InputDir == ""){
-    printf("You must use the -i option\n");
+  if((InputDir == "") == (RemotePort == 0)){
+    printf("You must use either the -i or the -R option\n");
+    goto fail;
+  }
+  if(RemotePort && retire != "rename"){
+    printf("With -R, give -d to EBDecoder instead\n");
     goto fail;
   }
-  if(option_t_used && EBTrigMode == kNone){
+  if(RemotePort && DegradeSeconds){
+    printf("-g can only be used with -i\n");
+    goto fail;
+  }
+  if(option_t_used && Outputs[0].mode == kNone){
     printf("Warning: threshold given with -t ignored with -T 0\n");
   }
   if(optind < argc){
     printf("Unknown options given\n");
     goto fail;
   }
-  if(EBTrigMode < kNone || EBTrigMode > kDoubleLayer){
-    printf("Invalid trigger mode %d\n", EBTrigMode);
+  for(unsigned int o = 0; o < numOutputs; o++){
+    if(Outputs[o].mode < kNone || Outputs[o].mode > kDoubleLayer){
+      printf("Invalid trigger mode %d\n", Outputs[o].mode);
+      goto fail;
+    }
+    if(Outputs[o].threshold < 0) {
+      printf("Negative thresholds not allowed.\n");
+      goto fail;
+    }
+    for(unsigned int p = 0; p < o; p++){
+      if(Outputs[p].base == Outputs[o].base){
+        printf("Output %s given twice\n", Outputs[o].base.c_str());
+        goto fail;
+      }
+    }
+  }
+  if(RotateSeconds < 0) {
+    printf("Negative output file length not allowed.\n");
     goto fail;
   }
-  if(Threshold < 0) {
-    printf("Negative thresholds not allowed.\n");
+  if(DegradeSeconds < 0) {
+    printf("Negative wait for late files not allowed.\n");
     goto fail;
   }
 
@@ -439,16 +1162,43 @@ static string parse_options(int argc, char **argv)
     goto fail;
   }
 
-  return configfile;
+  if(retire == "rename") Retire = kRetireRename;
+  else if(retire == "compress") Retire = kRetireCompress;
+  else if(retire == "delete"){
+    Retire = kRetireDelete;
+    RetireWhere = Outputs[0].base + ".md5";
+  }
+  else if(retire.compare(0, 8, "archive:") == 0 && retire.size() > 8){
+    Retire = kRetireArchive;
+    RetireWhere = retire.substr(8);
+  }
+  else{
+    printf("Invalid -d option %s\n", retire.c_str());
+    goto fail;
+  }
+
+  CheckpointName = Outputs[0].base + ".checkpoint";
+
+  return;
 
   fail:
+  if(Name != "") printf("In partition %s:\n", Name.c_str());
   printf(
-    "Usage: %s -i <input data directory> -o <EBuilder_output_disk>\n"
+    "Usage: %s -i <input data directory> | -R <port>\n"
+    "          -o <EBuilder_output_disk>\n"
     "          -c <config file>\n"
-    "         [-t <offline_threshold>] [-T <offline_trigger_mode>]\n"
+    "         [-t <offline_threshold>] [-T <offline_trigger_mode>] [-l] [-r]\n"
+    "         [-s <shared memory name>] [-u <socket path>] [-m <megabytes>]\n"
+    "         [-b <megabytes>] [-w <seconds>] [-d <what>] [-M] [-L]\n"
+    "         [-g <seconds>]\n"
+    "         [-O <output file>:<trigger mode>[:<threshold>] ...]\n"
+    "         [-j <threads>]\n"
+    "   or: %s -D <partitions file> [-j <threads>]\n"
     "\n"
     "Mandatory arguments:\n"
-    "  -i : Input data directory\n"
+    "  -i : Input data directory, or instead\n"
+    "  -R : Take decoded data from EBDecoder agents connecting on this TCP\n"
+    "       port.  See RemoteStream.h\n"
     "  -o : Output file\n"
     "  -c : Configuration file giving USB and PMT information\n"
     "\n"
@@ -458,52 +1208,58 @@ static string parse_options(int argc, char **argv)
     "  -T : offline trigger mode\n"
     "       0: No threshold\n"
     "       1: Per-channel threshold\n"
-    "       2: [default] Overlapping pair: both hits over threshold, if any\n",
-    argv[0]);
+    "       2: [default] Overlapping pair: both hits over threshold, if any\n"
+    "  -O : Also write events to another series of output files, with their\n"
+    "       own trigger mode and threshold (default 73), from the same\n"
+    "       decoding of the input.  May be given up to %u times.  Events\n"
+    "       for -s and -u, and the checkpoint, go with -o\n"
+    "  -l : Low latency mode.  Decode files while the DAQ is still writing\n"
+    "       them and pass on each second of data as soon as it is complete\n"
+    "  -r : Resume after a crash from the checkpoint <output file>.checkpoint,\n"
+    "       which is kept up to date after each set of input files\n"
+    "  -m : Keep at most about this many megabytes of decoded data waiting\n"
+    "       to be built in memory, and the rest in temporary files in the\n"
+    "       output directory.  default: no limit.  With -R, how much to take\n"
+    "       in from the agents before building it.  default: %d per USB\n"
+    "  -b : Start a new output file before one would go over this many\n"
+    "       megabytes\n"
+    "  -w : Start a new output file after this many seconds\n"
+    "       default for both: a new output file after every %d sets of\n"
+    "       input files\n"
+    "  -d : What to do with input files once they have been read:\n"
+    "       rename:        [default] move them to decoded/ as *.done\n"
+    "       archive:<dir>: hard link them into <dir>, on the same file\n"
+    "                      system, and remove them\n"
+    "       compress:      gzip them into decoded/ as *.done.gz\n"
+    "       delete:        delete them once the -o output file with\n"
+    "                      their events is finished and its md5sum is\n"
+    "                      recorded in <output file>.md5\n"
+    "  -M : Write a monitoring summary of each output file, with hit rates,\n"
+    "       charge spectra and missed sync pulses, to <output file>.summary\n"
+    "  -g : If some USB streams' files are this many seconds later than the\n"
+    "       others', build without them, and don't wait for them again\n"
+    "       until they send a file.  Files that come after their file set\n"
+    "       was built are moved to late/.  default: wait for every file\n"
+    "  -L : Log how long input files take to get through each stage of\n"
+    "       event building, and how old events are when written, for each\n"
+    "       -o output file.  See LatencyTrace.h\n"
+    "  -s : Also publish built events to a ring buffer in POSIX shared\n"
+    "       memory with this name, e.g. /ebuilder.  See EventRing.h\n"
+    "  -u : Also serve built events to clients on a Unix-domain socket\n"
+    "       at this path.  See EventServer.h\n"
+    "  -j : Decode and form events with this many threads, shared by all\n"
+    "       partitions.  default: one per CPU\n"
+    "\n"
+    "Daemon mode:\n"
+    "  -D : Build several runs at once, one for each line of this file,\n"
+    "       which gives the partition's name and then its options, as\n"
+    "       above except -j.  Lines starting with # are ignored\n",
+    argv[0], argv[0], MAX_OUTPUTS - 1,
+    (int)(REMOTE_QUEUE_BYTES >> 20), max_filesets_subrun);
   exit(127);
 }
 
-static void CalculatePedestal(int baseptr[maxModules][numChannels],
-                              const vector<decoded_packet> & BaselineData)
-{
-  double baseline[maxModules][numChannels] = {};
-  int counter[maxModules][numChannels] = {};
-
-  for(vector<decoded_packet>::const_iterator I = BaselineData.begin();
-      I != BaselineData.end();
-      I++) {
-
-    const int module = I->module;
-    const int type = I->isadc;
-
-    if(type != kOVR_ADC) continue;
-
-    if(module > maxModules)
-      log_msg(LOG_CRIT, "Fatal Error: Module number requested "
-        "(%d) out of range (0-%d) in calculate pedestal\n", module, maxModules);
-
-    for(unsigned int i = 0; i < I->hits.size(); i++) {
-      const int charge = I->hits[i].charge;
-      const int channel = I->hits[i].channel;
-      if(channel >= numChannels)
-        log_msg(LOG_CRIT, "Fatal Error: Channel number requested "
-          "(%d) out of range (0-%d) in calculate pedestal\n",
-          channel, numChannels-1);
-
-      // Should these be modified to better handle large numbers of baseline
-      // triggers?
-      baseline[module][channel] = (baseline[module][channel]*
-        counter[module][channel] + charge)/(counter[module][channel]+1);
-      counter[module][channel]++;
-    }
-  }
-
-  for(int i = 0; i < maxModules; i++)
-    for(int j = 0; j < numChannels; j++)
-      baseptr[i][j] = (int)baseline[i][j];
-}
-
-static bool GetBaselines()
+bool Partition::GetBaselines()
 {
   // Check for a baseline file directory with the right right number of files.
   {
@@ -550,7 +1306,9 @@ static bool GetBaselines()
     vector<decoded_packet> BaselineData;
     OVUSBStream[i].GetBaselineData(&BaselineData);
     int baselines[maxModules][numChannels] = { { } };
-    CalculatePedestal(baselines, BaselineData);
+    if(!CalculatePedestal(baselines, BaselineData))
+      log_msg(LOG_CRIT, "Bad baseline data from USB %d\n",
+              OVUSBStream[i].GetUSB());
     OVUSBStream[i].SetBaseline(baselines);
   }
 
@@ -559,7 +1317,7 @@ static bool GetBaselines()
 
 // Try to read in the baselines for MAXTIME seconds.  If they don't appear,
 // exit with status 127.
-static void LoadBaselineData()
+void Partition::LoadBaselineData()
 {
   const time_t oldtime = time(0);
   while(!GetBaselines()){
@@ -613,7 +1371,7 @@ static int sbop_max_board(const vector<usb_sbop> & sbops)
   return maxb;
 }
 
-static void setup_from_config(const string & configfile)
+void Partition::setup_from_config(const string & configfile)
 {
   const vector<usb_sbop> sbops = get_sbops(configfile.c_str());
 
@@ -647,9 +1405,40 @@ static void setup_from_config(const string & configfile)
   memset(overflow, 0, (max_board+1)*sizeof(bool));
   memset(maxcount_16ns, 0, (max_board+1)*sizeof(long int));
 
+  // Spill to where the output goes, since there should be room there
+  const string & outbase = Outputs[0].base;
+  const string outdir = outbase.find('/') == string::npos? ".":
+    outbase.substr(0, outbase.rfind('/') + 1);
+
   for(unsigned int i = 0; i < numUSB; i++){
-    OVUSBStream[i].SetThresh(Threshold, (int)EBTrigMode);
+    OVUSBStream[i].SetMemoryBudget(MemoryBudget/numUSB, outdir);
+    for(unsigned int o = 0; o < numOutputs; o++)
+      OVUSBStream[i].SetThresh(Outputs[o].threshold, (int)Outputs[o].mode, o);
     OVUSBStream[i].SetUSB(usbserials[i]);
+    OVUSBStream[i].SetFollow(LowLatency);
+    OVUSBStream[i].SetFirstCount(&FirstCount);
+    OVUSBStream[i].SetWorkPool(Pool, Client);
+  }
+  for(unsigned int o = 0; o < numOutputs; o++){
+    for(unsigned int s = 0; s < maxSlices; s++){
+      Slices[o][s].name = log_name();
+      Slices[o][s].monitor = Monitor;
+      Slices[o][s].pending = 0;
+    }
+  }
+  if(Monitor){
+    vector<uint16_t> modules;
+    for(unsigned int i = 0; i < sbops.size(); i++)
+      modules.push_back(sbops[i].pmtboard_u);
+    std::sort(modules.begin(), modules.end());
+    modules.erase(std::unique(modules.begin(), modules.end()), modules.end());
+
+    SyncSummary.init(modules);
+    for(unsigned int o = 0; o < numOutputs; o++){
+      Outputs[o].summary.init(modules);
+      for(unsigned int s = 0; s < maxSlices; s++)
+        Slices[o][s].summary.init(modules);
+    }
   }
 }
 
@@ -660,118 +1449,14 @@ static void end_run_signal_handler(__attribute__((unused)) int sig)
   run_has_ended = true;
 }
 
-static bool write_end_block_and_close(const int data_fd)
-{
-  const uint32_t end = 0x53544F50; // "STOP"
-  const uint32_t nend = htonl(end);
-  if(sizeof nend != write(data_fd, &nend, sizeof nend)){
-    log_msg(LOG_ERR, "End of run write error\n");
-    return false;
-  }
-
-  if(close(data_fd) < 0){
-    log_msg(LOG_ERR, "Could not close output data file\n");
-    return false;
-  }
-
-  return true;
-}
-
-// This is all the code that I found around BuildEvent. It does some things. I
-// have not really figured out what they are yet. Sorry sorry sorrysorrysorry.
-// In some fashion it does the building of the available data and leaves the
-// unbuilt data for the next try.  It returns the number of events built.
-static unsigned int
-  SuperBuildEvents(vector< vector<decoded_packet> > & CurrentData, const int fd)
-{
-  // I don't know how many of these need to be static
-  static vector<decoded_packet>::iterator CurrentDataIt[maxUSB];
-  static vector<decoded_packet> MinData; // Current minimum data packets
-  static decoded_packet MinDataPacket; // Minimum and Last Data Packets added
-  static vector<int> MinIndex; // USB indices of Minimum Data Packet
-  static vector<decoded_packet> ExtraData;// carries events from last timestamp
-  static vector<int> ExtraIndex;
-
-  unsigned int EventCounter = 0;
-  // index of minimum event added to USB stream
-  int imin = 0;
-  for(unsigned int i = 0; i < numUSB; i++) {
-    // MinIndex is set to the last CurrentData that's empty,
-    // or zero if none are empty.
-    CurrentDataIt[i] = CurrentData[i].begin();
-    if(CurrentData[i].empty()) imin = i;
-  }
-  MinData .assign(ExtraData .begin(), ExtraData .end());
-  MinIndex.assign(ExtraIndex.begin(), ExtraIndex.end());
-
-  // This is an elaborate test for whether all CurrentDatas are
-  // non-empty up to numUSB.
-  while( CurrentDataIt[imin] != CurrentData[imin].end() ) {
-    // Until 1 USB stream finishes timestamp
-
-    imin=0; // Reset minimum to first USB stream
-    MinDataPacket = *(CurrentDataIt[imin]);
-
-    for(unsigned int k = 0; k < numUSB; k++) { // Loop over USB streams, find minimum
-      decoded_packet CurrentDataPacket = *(CurrentDataIt[k]);
-
-      // Find real minimum; no clock slew
-      if( LessThan(CurrentDataPacket, MinDataPacket, 0) ) {
-        // If current packet less than min packet, min = current
-        MinDataPacket = CurrentDataPacket;
-        imin = k;
-      }
-    } // End of for loop: MinDataPacket has been filled appropriately
-
-    if(MinData.size() > 0) { // Check for equal events
-      if( LessThan(MinData.back(), MinDataPacket, 3) ) {
-        // Ignore gaps which consist of fewer than 4 clock cycles
-        ++EventCounter;
-        BuildEvent(MinData, MinIndex, fd);
-
-        MinData.clear();
-        MinIndex.clear();
-      }
-    }
-    MinData.push_back(MinDataPacket); // Add new element
-    MinIndex.push_back(imin);
-    CurrentDataIt[imin]++; // Increment iterator for added packet
-
-  } // End of while loop: Events have been built for this time stamp
-
-  // Clean up operations and store data for later
-  for(unsigned int k = 0; k < numUSB; k++)
-    CurrentData[k].assign(CurrentDataIt[k], CurrentData[k].end());
-  ExtraData .assign(MinData .begin(), MinData .end());
-  ExtraIndex.assign(MinIndex.begin(), MinIndex.end());
-
-  return EventCounter;
-}
-
-// move files into a subdirectory called decoded/ and rename then with ".done"
-static void rename_files_we_have_read()
+// The names of the input files we are reading, one per USB stream that
+// isn't absent
+vector<string> Partition::files_being_read()
 {
-  for(unsigned int j = 0; j<numUSB; j++) {
-    const string origname = OVUSBStream[j].GetFileName();
-    const string origname2 = OVUSBStream[j].GetFileName(); // basename insanity
-    const string donedir = dirname((char *)origname.c_str()) + string("/decoded/");
-    const string donename = donedir +
-      string(basename((char *)OVUSBStream[j].GetFileName())) + ".done";
-
-    errno = 0;
-    if(mkdir(donedir.c_str(), 0755) == -1 && errno != EEXIST){
-      log_msg(LOG_CRIT, "Could not create directory %s: %s.\n",
-              donedir.c_str(), strerror(errno));
-      exit(1);
-    }
-
-    errno = 0;
-    if(rename(origname2.c_str(), donename.c_str())) {
-      log_msg(LOG_CRIT, "Could not rename input file %s to %s: %s.\n",
-              origname2.c_str(), donename.c_str(), strerror(errno));
-      exit(1);
-    }
-  }
+  vector<string> names;
+  for(unsigned int j = 0; j < numUSB; j++)
+    if(!Absent[j]) names.push_back(OVUSBStream[j].GetFileName());
+  return names;
 }
 
 static void setup_signals()
@@ -791,7 +1476,7 @@ static void setup_signals()
 
 // Waits for new files and returns true if it opened some.  If the run
 // ends or no files are forthcoming, return false.
-static bool HandleOpenNextFileSet()
+bool Partition::HandleOpenNextFileSet()
 {
   const time_t oldtime = time(0);
 
@@ -813,82 +1498,564 @@ static bool HandleOpenNextFileSet()
   return true;
 }
 
-// Decode the latest set of open input files.  Each is decoded in a
-// separate thread.  The decoded data is kept inside the USBStream
-// objects for later retrieval.
-static void DecodeFileSet()
+// In remote mode, takes what the agents send until each USB stream has
+// sent the whole of its next file, building events as it goes if
+// LowLatency.  Returns false if the run ends or no data is forthcoming, as
+// HandleOpenNextFileSet() does.
+bool Partition::ReceiveFileSet(vector< vector<decoded_packet> > & CurrentData)
+{
+  bool ended[maxUSB] = { false };
+  unsigned int nended = 0;
+  time_t oldtime = time(0);
+
+  while(nended < numUSB){
+    bool got = false;
+    for(unsigned int j = 0; j < numUSB; j++){
+      vector<decoded_packet> * batch;
+      bool endfile;
+      while(!ended[j] && Receiver.take(j, batch, endfile)){
+        OVUSBStream[j].RekeyUntimed(*batch);
+        MovePackets(CurrentData[j], *batch);
+        delete batch;
+        got = true;
+        if(endfile){
+          ended[j] = true;
+          nended++;
+        }
+      }
+    }
+
+    if(got){
+      oldtime = time(0);
+      if(LowLatency)
+        Merger.SuperBuildEvents(CurrentData, numUSB, build_events, this);
+      continue;
+    }
+
+    if((difftime(time(0), oldtime) > ENDTIME && run_has_ended)
+     || difftime(time(0), oldtime) > MAXTIME) {
+      if(run_has_ended)
+        log_msg(LOG_INFO, "Finished processing run\n");
+      else
+        log_msg(LOG_ERR, "No new data for %ds, but I didn't hear that "
+          "the run was over! Closing output file anyway.\n", MAXTIME);
+      return false;
+    }
+    Receiver.wait(FOLLOW_POLL_US);
+  }
+  return true;
+}
+
+// Starts taking decoded data from the agents, telling each how to decode
+// its USB stream
+void Partition::start_remote()
 {
-  pthread_t threads[numUSB]; // An array of threads to decode files
+  const vector<usb_sbop> sbops = get_sbops(ConfigFile.c_str());
+
+  vector<int> serials;
+  vector<CheckpointWriter> setups(numUSB);
+  for(unsigned int j = 0; j < numUSB; j++){
+    serials.push_back(OVUSBStream[j].GetUSB());
+
+    CheckpointWriter & setup = setups[j];
+    setup.put((uint8_t)LowLatency);
+    setup.put((uint32_t)numOutputs);
+    for(unsigned int o = 0; o < numOutputs; o++){
+      setup.put(Outputs[o].threshold);
+      setup.put((int)Outputs[o].mode);
+    }
+
+    vector<usb_sbop> boards;
+    for(unsigned int i = 0; i < sbops.size(); i++)
+      if(sbops[i].serial == serials[j]) boards.push_back(sbops[i]);
+    setup.put((uint32_t)boards.size());
+    for(unsigned int i = 0; i < boards.size(); i++){
+      setup.put(boards[i].board);
+      setup.put(boards[i].offset);
+    }
+  }
+
+  const uint64_t maxbytes =
+    MemoryBudget? MemoryBudget/numUSB: REMOTE_QUEUE_BYTES;
+  if(!Receiver.start(RemotePort, serials, setups, maxbytes))
+    log_msg(LOG_CRIT, "Could not set up taking data from agents\n");
+}
 
-  int indices[numUSB]; // arguments for pthread.
+// Start decoding the latest set of open input files.  Each is decoded in
+// a separate job for Pool.  The decoded data is handed to the event builder
+// through DecodedQueue as each job finishes, or in low latency mode, as it
+// goes.
+void Partition::StartDecodeFileSet()
+{
   for(unsigned int j = 0; j < numUSB; j++){ // Load all files in at once
-    indices[j] = j;
-    pthread_create(&threads[j], NULL, decode, &indices[j]);
+    if(Absent[j]) continue;
+    DecodeJobs[j].partition = this;
+    DecodeJobs[j].usb = j;
+    DecodeJobs[j].started = DecodeJobs[j].finished = 0;
+    Pool->submit(Client, decode, &DecodeJobs[j], &decoders_running,
+                 LowLatency? FOLLOW_POLL_US: 0);
   }
+}
 
-  for(unsigned int j = 0; j < numUSB; j++)
-    pthread_join(threads[j], NULL);
+// Wait for all the decoding started by StartDecodeFileSet() to finish
+void Partition::FinishDecodeFileSet()
+{
+  Pool->wait(Client, &decoders_running);
+}
+
+// For Trace, times the file set just decoded, which events will be built
+// from next
+void Partition::trace_decoded()
+{
+  WaitingOldest = 0;
+  WaitingDecoded = 0;
+  for(unsigned int j = 0; j < numUSB; j++){
+    if(Absent[j]) continue;
+    if(FileTimes[j])
+      Latency.add(LatencyTrace::kFileWait, FoundTime - FileTimes[j]);
+    Latency.add(LatencyTrace::kDecodeWait, DecodeJobs[j].started - FoundTime);
+    Latency.add(LatencyTrace::kDecode,
+                DecodeJobs[j].finished - DecodeJobs[j].started);
+
+    if(FileTimes[j] && (!WaitingOldest || FileTimes[j] < WaitingOldest))
+      WaitingOldest = FileTimes[j];
+    WaitingDecoded = std::max(WaitingDecoded, DecodeJobs[j].finished);
+  }
 }
 
-// Reads in data from files into CurrentData until either the maximum
-// number of files has been read or the conditions for stopping the run
-// have been met. A "subrun" is the set of data read in this way. All
-// data for a subrun is kept in memory together so that it can be sorted
-// by time.
-static void read_in_for_subrun(vector< vector<decoded_packet> > & CurrentData)
+// Moves whatever decoded data is waiting in DecodedQueue, or Unqueued,
+// into CurrentData
+void Partition::DrainQueues(vector< vector<decoded_packet> > & CurrentData)
 {
-  for(int nfilesets = 0; nfilesets < max_filesets_subrun; nfilesets++){
-    // Open set of files
-    if(!HandleOpenNextFileSet()) return;
+  bool drained = false;
+  for(unsigned int j = 0; j < numUSB; j++){
+    vector<decoded_packet> * batch;
+    while(DecodedQueue[j].pop(batch)){
+      MovePackets(CurrentData[j], *batch);
+      delete batch;
+      drained = true;
+    }
+    if(!Unqueued[j].empty()) MovePackets(CurrentData[j], Unqueued[j]);
+  }
+
+  if(!drained) return;
+  pthread_mutex_lock(&QueueLock);
+  pthread_cond_broadcast(&QueueDrained);
+  pthread_mutex_unlock(&QueueLock);
+}
 
-    // Move the data from the files into USBStream objects
-    log_msg(LOG_INFO, "Decoding file set #%d for this run\n", nfilesets);
-    DecodeFileSet();
+// Moves whatever decoded data is waiting in DecodedQueue into CurrentData
+// and builds as many events as can be built from it.
+void Partition::BuildQueuedData(vector< vector<decoded_packet> > & CurrentData)
+{
+  const int64_t start = Trace? wall_us(): 0;
 
-    rename_files_we_have_read();
+  DrainQueues(CurrentData);
 
-    // Move data from USBStream object into CurrentData's.
-    // XXX worried about this.  It reads up to the Unix time stamp, a
-    // synchronization point, except nothing seems to keep these time stamps
-    // synchronized between the several USB streams.
-    for(unsigned int j = 0; j < numUSB; j++)
-      OVUSBStream[j].GetDecodedDataUpToNextUnixTimeStamp(CurrentData[j]);
+  // The first data from a USB stream that has been left out may be older
+  // than events already written
+  for(unsigned int j = 0; j < numUSB; j++){
+    if(!Rejoining[j] || Absent[j] || CurrentData[j].empty()) continue;
+    const unsigned int dropped = Merger.DropLate(CurrentData[j]);
+    if(dropped)
+      log_msg(LOG_WARNING, "Dropped %u packets from USB %d that came too "
+              "late to be built\n", dropped, OVUSBStream[j].GetUSB());
+    Rejoining[j] = CurrentData[j].empty();
   }
+
+  Merger.SuperBuildEvents(CurrentData, numUSB, build_events, this, Absent);
+
+  if(Trace && WaitingDecoded){
+    const int64_t end = wall_us();
+    Latency.add(LatencyTrace::kMergeWait, start - WaitingDecoded);
+    Latency.add(LatencyTrace::kBuild, end - start);
+    if(WaitingOldest) Latency.add(LatencyTrace::kTotal, end - WaitingOldest);
+    WaitingDecoded = 0;
+  }
+}
+
+// Saves everything needed to carry on from here after a crash: which subrun
+// we are on, how much of it has been written, how many file sets have gone
+// into it, and all the data not yet built into events.  'done' are the
+// input files just decoded, which, along with any that Retirer hasn't got
+// to yet, have yet to be moved out of the way.
+// Only between file sets, when no decoding is going on.
+void Partition::write_checkpoint(vector< vector<decoded_packet> > & CurrentData,
+                                 const vector<string> & done)
+{
+  // Keep the decoded data here instead of in the queues, where it will be
+  // built from next just the same.
+  DrainQueues(CurrentData);
+
+  CheckpointWriter out;
+  out.put(CHECKPOINT_MAGIC);
+  out.put(CHECKPOINT_VERSION);
+  out.put(numUSB);
+  out.put(numOutputs);
+  out.put(NFileSets);
+
+  for(unsigned int j = 0; j < numUSB; j++){
+    out.put((uint8_t)Absent[j]);
+    out.put((uint8_t)Rejoining[j]);
+    out.put(MissedUpTo[j]);
+  }
+
+  // The checkpoint vouches for the output up to here, so it had better
+  // really be there.
+  for(unsigned int o = 0; o < numOutputs; o++){
+    if(!Outputs[o].file.sync())
+      log_msg(LOG_ERR, "Could not sync output file: %s\n", strerror(errno));
+    out.put(Outputs[o].subrun);
+    out.put((int64_t)Outputs[o].file.size());
+  }
+
+  out.put((uint8_t)Monitor);
+  if(Monitor)
+    for(unsigned int o = 0; o < numOutputs; o++) Outputs[o].summary.save(out);
+
+  out.put((uint8_t)(RemotePort != 0));
+  if(RemotePort) Receiver.save(out);
+
+  vector<string> notretired = Retirer.pending_names();
+  notretired.insert(notretired.end(), done.begin(), done.end());
+  out.put((uint32_t)notretired.size());
+  for(unsigned int i = 0; i < notretired.size(); i++) out.put(notretired[i]);
+
+  for(unsigned int j = 0; j < numUSB; j++){
+    OVUSBStream[j].SaveState(out);
+    out.put(CurrentData[j]);
+  }
+
+  out.put(Merger.ExtraData);
+  out.put((uint32_t)Merger.ExtraIndex.size());
+  for(unsigned int i = 0; i < Merger.ExtraIndex.size(); i++)
+    out.put(Merger.ExtraIndex[i]);
+
+  // The agents can forget what is safe in the checkpoint
+  if(out.commit(CheckpointName) && RemotePort) Receiver.ack();
+}
+
+// Takes a checkpoint, and retires the input files it covers
+void Partition::save_progress(vector< vector<decoded_packet> > & CurrentData)
+{
+  write_checkpoint(CurrentData, Unsaved);
+  Retirer.retire(Unsaved);
+  Unsaved.clear();
+  UnsavedSets = 0;
+}
+
+// Restores what write_checkpoint() saved, and finishes moving the input
+// files it covers out of the way.  Sets NFileSets, and each output's subrun
+// and 'offsets' to where to carry on in it.
+void Partition::read_checkpoint(vector< vector<decoded_packet> > & CurrentData,
+                                int64_t offsets[MAX_OUTPUTS])
+{
+  CheckpointReader in;
+  if(!in.load(CheckpointName))
+    log_msg(LOG_CRIT, "Cannot resume without a checkpoint\n");
+
+  uint32_t magic, version;
+  in.get(magic);
+  in.get(version);
+  if(magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION)
+    log_msg(LOG_CRIT, "%s is not a checkpoint from this version of the "
+            "event builder\n", CheckpointName.c_str());
+
+  unsigned int nusb;
+  in.get(nusb);
+  if(nusb != numUSB)
+    log_msg(LOG_CRIT, "Checkpoint has %u USB streams, but the configuration "
+            "has %u\n", nusb, numUSB);
+
+  unsigned int nout;
+  in.get(nout);
+  if(nout != numOutputs)
+    log_msg(LOG_CRIT, "Checkpoint has %u outputs, but %u were asked for\n",
+            nout, numOutputs);
+
+  in.get(NFileSets);
+
+  for(unsigned int j = 0; j < numUSB; j++){
+    uint8_t absent, rejoining;
+    in.get(absent);
+    in.get(rejoining);
+    in.get(MissedUpTo[j]);
+    Absent[j] = absent;
+    Rejoining[j] = rejoining;
+  }
+
+  for(unsigned int o = 0; o < numOutputs; o++){
+    in.get(Outputs[o].subrun);
+    in.get(offsets[o]);
+  }
+
+  uint8_t monitor;
+  in.get(monitor);
+  if((bool)monitor != Monitor)
+    log_msg(LOG_CRIT, "Checkpoint was made %s -M, so resume %s it\n",
+            monitor? "with": "without", monitor? "with": "without");
+  if(Monitor)
+    for(unsigned int o = 0; o < numOutputs; o++)
+      if(!Outputs[o].summary.load(in))
+        log_msg(LOG_CRIT, "Checkpoint %s does not fit the configuration\n",
+                CheckpointName.c_str());
+
+  uint8_t remote;
+  in.get(remote);
+  if((bool)remote != (RemotePort != 0))
+    log_msg(LOG_CRIT, "Checkpoint was made %s -R, so resume %s it\n",
+            remote? "with": "without", remote? "with": "without");
+  if(RemotePort && !Receiver.load(in, numUSB))
+    log_msg(LOG_CRIT, "Checkpoint %s does not fit the configuration\n",
+            CheckpointName.c_str());
+
+  uint32_t ndone;
+  in.get(ndone);
+  vector<string> done;
+  for(uint32_t i = 0; i < ndone && in.good(); i++){
+    string name;
+    in.get(name);
+    done.push_back(name);
+  }
+
+  for(unsigned int j = 0; j < numUSB; j++){
+    if(!OVUSBStream[j].LoadState(in))
+      log_msg(LOG_CRIT, "Checkpoint %s does not fit the configuration\n",
+              CheckpointName.c_str());
+    in.get(CurrentData[j]);
+  }
+
+  in.get(Merger.ExtraData);
+  uint32_t nextra;
+  in.get(nextra);
+  Merger.ExtraIndex.clear();
+  for(uint32_t i = 0; i < nextra && in.good(); i++){
+    int index;
+    in.get(index);
+    Merger.ExtraIndex.push_back(index);
+  }
+
+  if(!in.done())
+    log_msg(LOG_CRIT, "Checkpoint %s is corrupt\n", CheckpointName.c_str());
+
+  // We may have stopped after taking the checkpoint but before moving these
+  vector<string> leftover;
+  for(unsigned int i = 0; i < done.size(); i++)
+    if(access(done[i].c_str(), F_OK) == 0)
+      leftover.push_back(done[i]);
+  Retirer.retire(leftover);
+
+  for(unsigned int o = 0; o < numOutputs; o++)
+    log_msg(LOG_NOTICE, "Resuming %s after %d file sets at byte %ld\n",
+            subrun_name(Outputs[o]).c_str(), NFileSets, (long)offsets[o]);
+}
+
+// Reads in data from files and builds events from it until either the
+// maximum number of files has been read or the conditions for stopping the
+// run have been met. A "subrun" is the set of data read in this way. All
+// data for a subrun is written to the same output file, unless we are
+// starting new output files by size or time instead, in which case this
+// only stops at the end of the run.
+//
+// Decoding of each file set overlaps with building events out of the
+// previous one.  SuperBuildEvents() picks up where it left off each time,
+// so this gives the same events as reading in the whole subrun first.
+//
+// Takes a checkpoint after each file set.
+void Partition::build_subrun(vector< vector<decoded_packet> > & CurrentData)
+{
+  const bool by_filesets = !RotateBytes && !RotateSeconds;
+
+  while(!by_filesets || NFileSets < max_filesets_subrun){
+    if(RemotePort){
+      // The agents have done the decoding
+      if(!ReceiveFileSet(CurrentData)) break;
+      log_msg(LOG_INFO, "Received file set #%d for this run\n", NFileSets);
+      if(Trace) WaitingDecoded = wall_us();
+      BuildQueuedData(CurrentData);
+    }
+    else{
+      // Open set of files
+      if(!HandleOpenNextFileSet()) break;
+
+      log_msg(LOG_INFO, "Decoding file set #%d for this run\n", NFileSets);
+      StartDecodeFileSet();
+
+      // Meanwhile, build what we got from the last file set
+      BuildQueuedData(CurrentData);
+
+      // And if we are following the files as they are written, keep
+      // building as data comes in.
+      while(LowLatency &&
+            __atomic_load_n(&decoders_running, __ATOMIC_ACQUIRE)){
+        usleep(FOLLOW_POLL_US);
+        BuildQueuedData(CurrentData);
+      }
+
+      FinishDecodeFileSet();
+      if(Trace) trace_decoded();
+    }
+    NFileSets++;
+
+    // If we stop after this, we can carry on from here instead of
+    // decoding these files again.  But when catching up, not every time,
+    // and if we stop before the next checkpoint, they are decoded again.
+    if(!RemotePort){
+      const vector<string> done = files_being_read();
+      Unsaved.insert(Unsaved.end(), done.begin(), done.end());
+    }
+    if(!CatchingUp || ++UnsavedSets >= CATCHUP_CHECKPOINT_SETS)
+      save_progress(CurrentData);
+  }
+
+  // Before this output file is closed, for -d delete
+  if(!Unsaved.empty()) save_progress(CurrentData);
+
+  BuildQueuedData(CurrentData);
 }
 
 // Do everything after the setup steps and the baseline determinations.
 // Reads data and writes out subrun files until there's no more to do.
-static void MainBuild()
+void Partition::MainBuild()
 {
   // for current timestamp to process
   vector< vector<decoded_packet> > CurrentData(maxUSB);
 
-  for(unsigned int subrun = 0; !run_has_ended; subrun++){
-    read_in_for_subrun(CurrentData);
+  if(Resume){
+    int64_t offsets[MAX_OUTPUTS] = {0};
+    read_checkpoint(CurrentData, offsets);
+    for(unsigned int o = 0; o < numOutputs; o++)
+      reopen_subrun(Outputs[o], offsets[o]);
+  }
+  else{
+    for(unsigned int o = 0; o < numOutputs; o++) open_subrun(Outputs[o]);
+  }
+  if(RemotePort) start_remote();
+  if(!Resume) save_progress(CurrentData);
+
+  while(true){
+    build_subrun(CurrentData);
+    if(run_has_ended) break;
+
+    for(unsigned int o = 0; o < numOutputs; o++) next_subrun(Outputs[o]);
+    save_progress(CurrentData);
+  }
+  for(unsigned int o = 0; o < numOutputs; o++) close_subrun(Outputs[o]);
+  Retirer.finish();
+  Receiver.stop();
+
+  // Finished cleanly, so there's nothing to resume
+  unlink(CheckpointName.c_str());
+}
+
+void * Partition::Run(void * partition)
+{
+  Partition & p = *(Partition *)partition;
+  set_log_name(p.log_name());
+  p.Client = Pool->add_client();
+
+  if(p.ShmName != "" && !p.EventRing.open(p.ShmName.c_str(), SHM_RING_SIZE))
+    log_msg(LOG_CRIT, "Could not set up shared memory %s\n",
+            p.ShmName.c_str());
+  if(p.SocketPath != "" && !p.EventSocket.open(p.SocketPath.c_str()))
+    log_msg(LOG_CRIT, "Could not set up socket %s\n", p.SocketPath.c_str());
+  p.setup_from_config(p.ConfigFile);
+
+  // In remote mode, the agents do all this
+  if(!p.RemotePort){
+    if(!p.Resume) p.LoadBaselineData(); // Otherwise they are in the checkpoint
+    p.InitRun();
+    if(!p.Retirer.start(p.InputDir, p.Retire, p.RetireWhere))
+      log_msg(LOG_CRIT, "Could not set up retiring of input files\n");
+  }
+
+  p.MainBuild();
+
+  p.EventSocket.close();
+  return NULL;
+}
+
+// Makes a partition for each line of the partitions file given with -D.
+// Exits if it can't be read or any line is bad.
+static vector<Partition *> read_partitions(const char * const program)
+{
+  std::ifstream in(PartitionsFile.c_str());
+  if(!in){
+    printf("Could not read partitions file %s\n", PartitionsFile.c_str());
+    exit(127);
+  }
 
-    const unsigned int BUFSIZE = 1024;
-    char outfile[BUFSIZE];
-    snprintf(outfile, BUFSIZE, "%s_%05u", OutBase.c_str(), subrun);
-    const int fd = open_file(outfile);
+  vector<Partition *> partitions;
+  vector<string> names;
+  string line;
+  while(std::getline(in, line)){
+    // Split into words, the first being the partition's name
+    vector<string> words;
+    const char * const space = " \t\r";
+    for(size_t start = line.find_first_not_of(space); start != string::npos;
+        start = line.find_first_not_of(space, start)){
+      const size_t end = line.find_first_of(space, start);
+      words.push_back(line.substr(start, end - start));
+      start = end;
+    }
+    if(words.empty() || words[0][0] == '#') continue;
 
-    const unsigned int EventCounter = SuperBuildEvents(CurrentData, fd);
-    write_end_block_and_close(fd);
+    if(find(names.begin(), names.end(), words[0]) != names.end()){
+      printf("Partition %s given twice\n", words[0].c_str());
+      exit(127);
+    }
+    names.push_back(words[0]);
+
+    // The rest is just like a command line
+    vector<char *> args;
+    args.push_back((char *)program);
+    for(unsigned int i = 1; i < words.size(); i++)
+      args.push_back((char *)words[i].c_str());
+    args.push_back(NULL);
+
+    Partition * const partition = new Partition(words[0]);
+    partition->parse_options(args.size() - 1, &args[0]);
+    partitions.push_back(partition);
+  }
 
-    log_msg(LOG_INFO, "Number of built events: %d\nProcessed time stamp: %d\n",
-            EventCounter, OVUSBStream[0].GetUnixTime());
+  if(partitions.empty()){
+    printf("No partitions in %s\n", PartitionsFile.c_str());
+    exit(127);
   }
+  return partitions;
 }
 
 int main(int argc, char **argv)
 {
-  const string configfile = parse_options(argc, argv);
+  Pool = new WorkPool;
+
+  // Just one run, unless the command line says to read the partitions file
+  vector<Partition *> partitions(1, new Partition(""));
+  partitions[0]->parse_options(argc, argv);
+  if(PartitionsFile != ""){
+    delete partitions[0];
+    partitions = read_partitions(argv[0]);
+  }
+
   setup_signals(); // so we will know when each run has ended
   start_log(); // establish syslog connection
-  setup_from_config(configfile);
-  LoadBaselineData();
-  InitRun();
 
-  MainBuild();
+  if(PoolThreads == 0)
+    PoolThreads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  if(!Pool->start(PoolThreads))
+    log_msg(LOG_CRIT, "Could not start %d threads\n", PoolThreads);
+
+  if(PartitionsFile == ""){
+    Partition::Run(partitions[0]);
+    return 0;
+  }
+
+  vector<pthread_t> threads(partitions.size());
+  for(unsigned int i = 0; i < partitions.size(); i++)
+    if(pthread_create(&threads[i], NULL, Partition::Run, partitions[i]))
+      log_msg(LOG_CRIT, "Could not start a thread for each partition\n");
+  for(unsigned int i = 0; i < partitions.size(); i++)
+    pthread_join(threads[i], NULL);
 
   return 0;
 }
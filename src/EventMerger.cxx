@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "EventMerger.h"
+#include "RunSummary.h"
+
+using std::vector;
+
+// This is all the code that I found around BuildEvent. It does some things. I
+// have not really figured out what they are yet. Sorry sorry sorrysorrysorry.
+// In some fashion it does the building of the available data and leaves the
+// unbuilt data for the next try.  It returns the number of events built.
+//
+// The streams are merged into one time-ordered list first, and then every
+// whole event in it is handed to BuildEvents() at once, so that it can split
+// the work of forming and writing them up however it likes.
+unsigned int EventMerger::SuperBuildEvents(
+  vector< vector<decoded_packet> > & CurrentData,
+  const unsigned int numUSB, EventHandler BuildEvents, void * context,
+  const bool * const absent)
+{
+  // Index of the next packet to take from each USB stream
+  unsigned int Next[numUSB];
+  for(unsigned int i = 0; i < numUSB; i++) Next[i] = 0;
+
+  // Packets are only ever moved from here on, never copied
+  MinData.clear();
+  MovePackets(MinData, ExtraData);
+  MinIndex.swap(ExtraIndex);
+  ExtraIndex.clear();
+
+  while(true) { // Until 1 USB stream finishes timestamp
+    int imin = -1; // Stream with the minimum packet, if none has run out
+    for(unsigned int k = 0; k < numUSB; k++) { // Loop over USB streams, find minimum
+      if(Next[k] == CurrentData[k].size()){
+        if(absent != NULL && absent[k]) continue;
+        imin = -1;
+        break;
+      }
+      // Find real minimum; no clock slew
+      if(imin < 0 ||
+         LessThan(CurrentData[k][Next[k]], CurrentData[imin][Next[imin]], 0))
+        imin = k;
+    }
+    if(imin < 0) break;
+
+    MovePacket(MinData, CurrentData[imin][Next[imin]]); // Add new element
+    MinIndex.push_back(imin);
+    Next[imin]++;
+
+  } // End of while loop: Merged everything we can for this time stamp
+
+  // Clean up operations and store data for later
+  for(unsigned int k = 0; k < numUSB; k++)
+    ErasePackets(CurrentData[k], 0, Next[k]);
+
+  // The last event might go on in the next data, so hold it over
+  size_t last = MinData.size();
+  while(last > 1 && !StartsNewEvent(MinData[last-2], MinData[last-1])) last--;
+  if(last > 0) last--;
+
+  for(size_t i = last; i < MinData.size(); i++)
+    MovePacket(ExtraData, MinData[i]);
+  ExtraIndex.assign(MinIndex.begin() + last, MinIndex.end());
+  MinData .resize(last);
+  MinIndex.resize(last);
+
+  if(MinData.empty()) return 0;
+  return BuildEvents(context, MinData, MinIndex);
+}
+
+unsigned int EventMerger::DropLate(vector<decoded_packet> & packets) const
+{
+  if(ExtraData.empty()) return 0;
+
+  unsigned int n = 0;
+  while(n < packets.size() && LessThan(packets[n], ExtraData.back(), 0)) n++;
+  ErasePackets(packets, 0, n);
+  return n;
+}
+
+unsigned int EventMerger::FlushEvents(EventHandler BuildEvents, void * context)
+{
+  if(ExtraData.empty()) return 0;
+
+  MinData.clear();
+  MovePackets(MinData, ExtraData);
+  MinIndex.swap(ExtraIndex);
+  ExtraIndex.clear();
+  return BuildEvents(context, MinData, MinIndex);
+}
+
+// This is the same for every mask, since a gap between packets is a gap
+// between whichever of them are taken.
+size_t NextEventStart(const vector<decoded_packet> & packets, size_t i)
+{
+  while(i > 0 && i < packets.size() && !StartsNewEvent(packets[i-1], packets[i]))
+    i++;
+  return i;
+}
+
+// Serializes the event made of packets 'first' to 'last', for
+// SerializeEvents()
+static void serialize_event(const vector<decoded_packet> & packets,
+                            const size_t first, const size_t last,
+                            const uint16_t * const modules,
+                            const uint8_t mask, vector<char> & buf,
+                            vector<size_t> * const eventends,
+                            RunSummary * const summary)
+{
+  SerializeEvent(&packets[first], last - first, modules + first, buf, mask);
+  if(eventends != NULL) eventends->push_back(buf.size());
+  if(summary != NULL)
+    summary->add_event(&packets[first], last - first, modules + first, mask);
+}
+
+unsigned int SerializeEvents(const vector<decoded_packet> & packets,
+                             const size_t begin, const size_t end_,
+                             const uint16_t * const modules,
+                             const uint8_t mask, vector<char> & buf,
+                             vector<size_t> * const eventends,
+                             RunSummary * const summary)
+{
+  unsigned int nevents = 0;
+
+  // Each event runs from 'first' to 'prev', the last of the wanted packets
+  // so far
+  const size_t end = NextEventStart(packets, end_);
+  size_t first = end, prev = end;
+  for(size_t i = NextEventStart(packets, begin); i < end; i++){
+    if(!(packets[i].tags & mask)) continue;
+
+    if(first != end && StartsNewEvent(packets[prev], packets[i])){
+      serialize_event(packets, first, prev + 1, modules, mask, buf,
+                      eventends, summary);
+      nevents++;
+      first = end;
+    }
+    if(first == end) first = i;
+    prev = i;
+  }
+  if(first != end){
+    serialize_event(packets, first, prev + 1, modules, mask, buf, eventends,
+                    summary);
+    nevents++;
+  }
+  return nevents;
+}
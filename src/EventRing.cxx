@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "EventRing.h"
+#include "USBstreamUtils.h"
+
+// Room for the header, rounded up so that records are nicely aligned
+static const uint32_t HEADERSIZE = 64;
+
+bool EventRingWriter::open(const char * const name, const uint64_t reqsize)
+{
+  uint64_t size = 1;
+  while(size < reqsize) size <<= 1;
+
+  // Replace any old ring rather than reusing it, since readers may still
+  // have the old one mapped.
+  shm_unlink(name);
+
+  errno = 0;
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd < 0){
+    log_msg(LOG_ERR, "Could not create shared memory %s: %s\n",
+            name, strerror(errno));
+    return false;
+  }
+
+  if(ftruncate(fd, HEADERSIZE + size) < 0){
+    log_msg(LOG_ERR, "Could not size shared memory %s: %s\n",
+            name, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  void * const m = mmap(NULL, HEADERSIZE + size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED){
+    log_msg(LOG_ERR, "Could not map shared memory %s: %s\n",
+            name, strerror(errno));
+    return false;
+  }
+
+  header = (EventRingHeader *)m;
+  data = (char *)m + HEADERSIZE;
+
+  header->headersize = HEADERSIZE;
+  header->size = size;
+  header->begin = header->end = 0;
+
+  // Readers check this to see that the rest is filled in
+  __atomic_store_n(&header->magic, EVENTRING_MAGIC, __ATOMIC_RELEASE);
+
+  log_msg(LOG_INFO, "Publishing events to shared memory %s\n", name);
+  return true;
+}
+
+// Advance the start of the intact region until nothing before 'upto'
+// would be overwritten by writing up to 'upto'.
+void EventRingWriter::reclaim(const uint64_t upto)
+{
+  uint64_t begin = header->begin;
+  while(begin + header->size < upto)
+    begin += ((EventRingRecord *)(data + (begin & (header->size-1))))->reclen;
+
+  if(begin == header->begin) return;
+
+  // Readers must be able to see that this space is being reused before
+  // we actually start to scribble on it.
+  __atomic_store_n(&header->begin, begin, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void EventRingWriter::publish(const char * const ev, const uint32_t len)
+{
+  if(header == NULL) return;
+
+  // Keeping records to multiples of the header size means there is always
+  // room for a padding record at the end of the ring.
+  const uint64_t reclen = (sizeof(EventRingRecord) + len + 15) & ~(uint64_t)15;
+  if(reclen > header->size/2){
+    log_msg(LOG_WARNING, "Event of %u bytes too big for shared memory\n", len);
+    return;
+  }
+
+  uint64_t end = header->end;
+
+  // Don't let a record run off the end of the ring.  Fill up the end with
+  // padding and start again at the beginning instead.
+  const uint64_t room = header->size - (end & (header->size-1));
+  if(room < reclen){
+    reclaim(end + room);
+    EventRingRecord * const pad = (EventRingRecord *)(data + (end & (header->size-1)));
+    pad->reclen = room;
+    pad->evlen = EVENTRING_PAD;
+    pad->seq = seq;
+    end += room;
+  }
+
+  reclaim(end + reclen);
+
+  EventRingRecord * const rec = (EventRingRecord *)(data + (end & (header->size-1)));
+  rec->reclen = reclen;
+  rec->evlen = len;
+  rec->seq = seq++;
+  memcpy(rec + 1, ev, len);
+
+  __atomic_store_n(&header->end, end + reclen, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h> // For ntohs, ntohl
+
+#include <string>
+#include <deque>
+#include <set>
+#include <vector>
+
+#include "EventServer.h"
+#include "USBstreamUtils.h"
+
+// Most events a client can have waiting for it before the backpressure
+// policy kicks in
+static const unsigned int MAX_QUEUED = 4096;
+
+// Most events sent with one system call
+static const unsigned int MAX_BATCH = 64;
+
+// A serialized event, shared between all the clients that want it
+struct EventBlock {
+  int refs; // Only touch with __atomic builtins
+  uint32_t len;
+  char data[1];
+};
+
+static EventBlock * new_block(const char * const ev, const uint32_t len)
+{
+  EventBlock * b = (EventBlock *)malloc(sizeof(EventBlock) + len);
+  if(b == NULL) log_msg(LOG_CRIT, "Out of memory in EventServer\n");
+  b->refs = 1;
+  b->len = len;
+  memcpy(b->data, ev, len);
+  return b;
+}
+
+static void unref(EventBlock * b)
+{
+  if(__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+}
+
+struct EventClient {
+  EventClient(const int fd_)
+  {
+    fd = fd_;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&notempty, NULL);
+    pthread_cond_init(&notfull, NULL);
+    subscribed = closing = dead = false;
+    from = 0;
+    to = 0xffffffff;
+    block_ms = 0;
+    dropped = 0;
+  }
+
+  ~EventClient()
+  {
+    ::close(fd);
+    for(unsigned int i = 0; i < queue.size(); i++) unref(queue[i]);
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&notempty);
+    pthread_cond_destroy(&notfull);
+  }
+
+  bool wants(const char * const ev, const uint32_t len) const;
+  bool subscribe(const std::string & line);
+
+  int fd;
+  pthread_t thread;
+
+  // Protects everything below
+  pthread_mutex_t lock;
+  pthread_cond_t notempty, notfull;
+  std::deque<EventBlock *> queue;
+
+  bool subscribed; // Whether we've heard what the client wants yet
+  bool closing;    // Whether we should hang up once the queue is empty
+  bool dead;       // Whether the sending thread has finished
+
+  std::set<int> modules; // Empty means all of them
+  uint32_t from, to;
+  int block_ms; // zero means the "drop" policy
+  uint64_t dropped;
+};
+
+// Returns true if this event passes the client's module and time cuts
+bool EventClient::wants(const char * const ev, const uint32_t len) const
+{
+  if(len < 8) return false;
+
+  const uint32_t time_sec = ntohl(*(const uint32_t *)(ev + 4));
+  if(time_sec < from || time_sec > to) return false;
+
+  if(modules.empty()) return true;
+
+  // Walk the module packet headers
+  const uint16_t npackets = ntohs(*(const uint16_t *)(ev + 2));
+  uint32_t off = 8;
+  for(unsigned int i = 0; i < npackets && off + 8 <= len; i++){
+    const uint8_t nhits = ev[off + 1];
+    const uint16_t module = ntohs(*(const uint16_t *)(ev + off + 2));
+    if(modules.count(module)) return true;
+    off += 8 + 4*nhits;
+  }
+  return false;
+}
+
+// Reads the client's settings.  Returns false if they don't make sense.
+bool EventClient::subscribe(const std::string & line)
+{
+  size_t pos = 0;
+  while(pos < line.size()){
+    size_t end = line.find(' ', pos);
+    if(end == std::string::npos) end = line.size();
+    const std::string item = line.substr(pos, end - pos);
+    pos = end + 1;
+
+    if(item.empty()) continue;
+
+    if(item.compare(0, 8, "modules=") == 0){
+      const char * p = item.c_str() + 8;
+      while(*p){
+        char * e;
+        modules.insert(strtol(p, &e, 10));
+        if(e == p) return false;
+        p = (*e == ',')? e+1: e;
+      }
+    }
+    else if(item.compare(0, 5, "from=") == 0)
+      from = strtoul(item.c_str() + 5, NULL, 10);
+    else if(item.compare(0, 3, "to=") == 0)
+      to = strtoul(item.c_str() + 3, NULL, 10);
+    else if(item == "policy=drop")
+      block_ms = 0;
+    else if(item.compare(0, 13, "policy=block:") == 0)
+      block_ms = atoi(item.c_str() + 13);
+    else
+      return false;
+  }
+  return true;
+}
+
+// Sends everything in 'batch' down the socket, or returns false
+static bool send_batch(const int fd, const std::vector<EventBlock *> & batch)
+{
+  struct iovec iov[MAX_BATCH];
+  for(unsigned int i = 0; i < batch.size(); i++){
+    iov[i].iov_base = batch[i]->data;
+    iov[i].iov_len = batch[i]->len;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = batch.size();
+
+  while(msg.msg_iovlen){
+    // MSG_NOSIGNAL so that a client going away doesn't kill us with SIGPIPE
+    const ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if(sent < 0){
+      if(errno == EINTR) continue;
+      return false;
+    }
+
+    // Skip over what went out, which may end partway through an event
+    size_t done = sent;
+    while(msg.msg_iovlen && done >= msg.msg_iov->iov_len){
+      done -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if(msg.msg_iovlen){
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + done;
+      msg.msg_iov->iov_len -= done;
+    }
+  }
+  return true;
+}
+
+// Gets one client's settings and then sends it events until it or we hang up
+static void * client_loop(void * c)
+{
+  EventClient * const client = (EventClient *)c;
+
+  std::string line;
+  char ch;
+  while(line.size() < 4096 && read(client->fd, &ch, 1) == 1 && ch != '\n')
+    line += ch;
+
+  pthread_mutex_lock(&client->lock);
+  const bool ok = client->subscribe(line);
+  client->subscribed = ok;
+  pthread_mutex_unlock(&client->lock);
+
+  if(!ok)
+    log_msg(LOG_WARNING, "Event client sent bad request \"%s\"\n", line.c_str());
+
+  std::vector<EventBlock *> batch;
+  while(ok){
+    pthread_mutex_lock(&client->lock);
+    while(client->queue.empty() && !client->closing)
+      pthread_cond_wait(&client->notempty, &client->lock);
+    if(client->queue.empty()){ // and so we are closing
+      pthread_mutex_unlock(&client->lock);
+      break;
+    }
+    while(!client->queue.empty() && batch.size() < MAX_BATCH){
+      batch.push_back(client->queue.front());
+      client->queue.pop_front();
+    }
+    pthread_cond_signal(&client->notfull);
+    pthread_mutex_unlock(&client->lock);
+
+    const bool sent = send_batch(client->fd, batch);
+    for(unsigned int i = 0; i < batch.size(); i++) unref(batch[i]);
+    batch.clear();
+    if(!sent) break;
+  }
+
+  // Hang up, but leave closing the socket to whoever reaps us, so that
+  // nothing else can get the same descriptor until we're gone.
+  shutdown(client->fd, SHUT_RDWR);
+
+  pthread_mutex_lock(&client->lock);
+  if(client->dropped)
+    log_msg(LOG_INFO, "Event client disconnected, %lu events dropped for it\n",
+            (unsigned long)client->dropped);
+  client->dead = true;
+  pthread_cond_broadcast(&client->notfull);
+  pthread_mutex_unlock(&client->lock);
+  return NULL;
+}
+
+EventServer::EventServer()
+{
+  listenfd = -1;
+  pthread_mutex_init(&clientlock, NULL);
+}
+
+bool EventServer::open(const char * const path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof addr.sun_path){
+    log_msg(LOG_ERR, "Socket path %s too long\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  errno = 0;
+  if((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+    log_msg(LOG_ERR, "Could not make socket: %s\n", strerror(errno));
+    return false;
+  }
+
+  unlink(path);
+  if(bind(listenfd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+     listen(listenfd, 16) < 0){
+    log_msg(LOG_ERR, "Could not listen on %s: %s\n", path, strerror(errno));
+    ::close(listenfd);
+    listenfd = -1;
+    return false;
+  }
+
+  sockpath = path;
+  pthread_create(&acceptor, NULL, accept_loop, this);
+  log_msg(LOG_INFO, "Serving events on %s\n", path);
+  return true;
+}
+
+void * EventServer::accept_loop(void * s)
+{
+  EventServer * const server = (EventServer *)s;
+
+  int fd;
+  while((fd = accept(server->listenfd, NULL, NULL)) >= 0 || errno == EINTR){
+    if(fd < 0) continue;
+
+    EventClient * client = new EventClient(fd);
+    pthread_mutex_lock(&server->clientlock);
+    server->clients.push_back(client);
+    pthread_create(&client->thread, NULL, client_loop, client);
+    pthread_mutex_unlock(&server->clientlock);
+    log_msg(LOG_INFO, "New event client\n");
+  }
+
+  return NULL; // close() shut the socket down
+}
+
+// Must hold clientlock
+void EventServer::reap_dead_clients()
+{
+  for(unsigned int i = 0; i < clients.size(); i++){
+    pthread_mutex_lock(&clients[i]->lock);
+    const bool dead = clients[i]->dead;
+    pthread_mutex_unlock(&clients[i]->lock);
+    if(!dead) continue;
+
+    pthread_join(clients[i]->thread, NULL);
+    delete clients[i];
+    clients.erase(clients.begin() + i);
+    i--;
+  }
+}
+
+void EventServer::publish(const char * const ev, const uint32_t len)
+{
+  if(listenfd < 0) return;
+
+  EventBlock * block = NULL;
+
+  pthread_mutex_lock(&clientlock);
+  reap_dead_clients();
+
+  for(unsigned int i = 0; i < clients.size(); i++){
+    EventClient * const c = clients[i];
+    pthread_mutex_lock(&c->lock);
+
+    if(!c->subscribed || c->dead || !c->wants(ev, len)){
+      pthread_mutex_unlock(&c->lock);
+      continue;
+    }
+
+    if(c->queue.size() >= MAX_QUEUED && c->block_ms > 0){
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += (long)c->block_ms * 1000000;
+      until.tv_sec += until.tv_nsec / 1000000000;
+      until.tv_nsec %= 1000000000;
+      while(c->queue.size() >= MAX_QUEUED && !c->dead &&
+            pthread_cond_timedwait(&c->notfull, &c->lock, &until) == 0)
+        ;
+    }
+
+    if(c->queue.size() >= MAX_QUEUED){
+      unref(c->queue.front());
+      c->queue.pop_front();
+      c->dropped++;
+    }
+
+    if(block == NULL) block = new_block(ev, len);
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    c->queue.push_back(block);
+    pthread_cond_signal(&c->notempty);
+    pthread_mutex_unlock(&c->lock);
+  }
+
+  pthread_mutex_unlock(&clientlock);
+
+  if(block) unref(block);
+}
+
+void EventServer::close()
+{
+  if(listenfd < 0) return;
+
+  shutdown(listenfd, SHUT_RDWR); // Wakes up the acceptor
+  pthread_join(acceptor, NULL);
+  ::close(listenfd);
+  listenfd = -1;
+  unlink(sockpath.c_str());
+
+  pthread_mutex_lock(&clientlock);
+  for(unsigned int i = 0; i < clients.size(); i++){
+    pthread_mutex_lock(&clients[i]->lock);
+    clients[i]->closing = true;
+    pthread_cond_signal(&clients[i]->notempty);
+    pthread_mutex_unlock(&clients[i]->lock);
+
+    // A client that never said what it wanted is still waiting to read
+    shutdown(clients[i]->fd, SHUT_RD);
+  }
+  for(unsigned int i = 0; i < clients.size(); i++){
+    pthread_join(clients[i]->thread, NULL);
+    delete clients[i];
+  }
+  clients.clear();
+  pthread_mutex_unlock(&clientlock);
+}
@@ -0,0 +1,272 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "InputRetirer.h"
+
+extern char ** environ;
+
+// The part of 'path' after the last slash
+static std::string base_name(const std::string & path)
+{
+  const size_t slash = path.rfind('/');
+  return slash == std::string::npos? path: path.substr(slash + 1);
+}
+
+// Runs 'argv' with its standard input and output connected to 'in' and
+// 'out' (if not -1) and waits for it.  Returns true if it succeeded.
+static bool run_command(char * const argv[], const int in, const int out)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if(in  >= 0) posix_spawn_file_actions_adddup2(&actions, in,  STDIN_FILENO);
+  if(out >= 0) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+  pid_t pid;
+  const int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if(err){
+    log_msg(LOG_ERR, "Could not run %s: %s\n", argv[0], strerror(err));
+    return false;
+  }
+
+  int status;
+  while(waitpid(pid, &status, 0) < 0)
+    if(errno != EINTR) return false;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+InputRetirer::InputRetirer()
+{
+  mode = kRetireRename;
+  indir = donedir = archivedir = sumsfd = -1;
+  running = stopping = deferring = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+}
+
+bool InputRetirer::start(const std::string & inputdir, const RetireMode mode_,
+                         const std::string & where_)
+{
+  mode = mode_;
+  where = where_;
+
+  errno = 0;
+  if((indir = open(inputdir.c_str(), O_RDONLY | O_DIRECTORY)) < 0){
+    log_msg(LOG_ERR, "Could not open input directory %s: %s\n",
+            inputdir.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Always made, since it is where files go if anything else fails
+  if((mkdirat(indir, "decoded", 0755) < 0 && errno != EEXIST) ||
+     (donedir = openat(indir, "decoded", O_RDONLY | O_DIRECTORY)) < 0){
+    log_msg(LOG_ERR, "Could not create directory %s/decoded: %s\n",
+            inputdir.c_str(), strerror(errno));
+    return false;
+  }
+
+  if(mode == kRetireArchive &&
+     (archivedir = open(where.c_str(), O_RDONLY | O_DIRECTORY)) < 0){
+    log_msg(LOG_ERR, "Could not open archive directory %s: %s\n",
+            where.c_str(), strerror(errno));
+    return false;
+  }
+
+  if(mode == kRetireDelete &&
+     (sumsfd = open(where.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0){
+    log_msg(LOG_ERR, "Could not open %s to record sums in: %s\n",
+            where.c_str(), strerror(errno));
+    return false;
+  }
+
+  stopping = false;
+  if(pthread_create(&thread, NULL, run, this)){
+    log_msg(LOG_ERR, "Could not start thread to retire input files\n");
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+void InputRetirer::retire(const std::vector<std::string> & names)
+{
+  pthread_mutex_lock(&lock);
+  for(unsigned int i = 0; i < names.size(); i++){
+    job j;
+    j.output = false;
+    j.name = names[i];
+    queue.push_back(j);
+    waiting[base_name(names[i])] = names[i];
+  }
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void InputRetirer::output_done(const std::string & name)
+{
+  if(mode != kRetireDelete) return;
+
+  pthread_mutex_lock(&lock);
+  job j;
+  j.output = true;
+  j.name = name;
+  queue.push_back(j);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+std::vector<std::string> InputRetirer::pending_names()
+{
+  std::vector<std::string> names;
+  pthread_mutex_lock(&lock);
+  for(std::map<std::string, std::string>::const_iterator i = waiting.begin();
+      i != waiting.end(); i++)
+    names.push_back(i->second);
+  pthread_mutex_unlock(&lock);
+  return names;
+}
+
+void InputRetirer::defer(const bool yes)
+{
+  pthread_mutex_lock(&lock);
+  deferring = yes;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void InputRetirer::finish()
+{
+  if(!running) return;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(thread, NULL);
+  running = false;
+}
+
+// Takes 'name' off the list of files still to be retired
+void InputRetirer::done_with(const std::string & name)
+{
+  pthread_mutex_lock(&lock);
+  waiting.erase(base_name(name));
+  pthread_mutex_unlock(&lock);
+}
+
+void * InputRetirer::run(void * retirer)
+{
+  InputRetirer & r = *(InputRetirer *)retirer;
+
+  while(true){
+    pthread_mutex_lock(&r.lock);
+    while((r.queue.empty() || r.deferring) && !r.stopping)
+      pthread_cond_wait(&r.wake, &r.lock);
+    if(r.queue.empty()){
+      pthread_mutex_unlock(&r.lock);
+      break;
+    }
+    const job j = r.queue.front();
+    r.queue.pop_front();
+    pthread_mutex_unlock(&r.lock);
+
+    if(r.mode != kRetireDelete){
+      r.retire_one(j.name, r.mode);
+      r.done_with(j.name);
+    }
+    else if(!j.output){
+      r.held.push_back(j.name);
+    }
+    else{
+      // If the sum can't be recorded, keep the input files instead
+      const RetireMode how = r.record_sum(j.name)? kRetireDelete: kRetireRename;
+      for(unsigned int i = 0; i < r.held.size(); i++){
+        r.retire_one(r.held[i], how);
+        r.done_with(r.held[i]);
+      }
+      r.held.clear();
+    }
+  }
+  return NULL;
+}
+
+// Does whatever 'how' says with the input file 'path'
+void InputRetirer::retire_one(const std::string & path, RetireMode how)
+{
+  const std::string name = base_name(path);
+
+  if(how == kRetireArchive){
+    // It may already be there if we stopped partway through last time
+    if(linkat(indir, name.c_str(), archivedir, name.c_str(), 0) == 0 ||
+       errno == EEXIST){
+      if(unlinkat(indir, name.c_str(), 0) == 0) return;
+    }
+    log_msg(LOG_ERR, "Could not archive %s in %s: %s\n", path.c_str(),
+            where.c_str(), strerror(errno));
+    how = kRetireRename;
+  }
+
+  if(how == kRetireCompress){
+    const std::string part = name + ".done.gz.part";
+    const int in = openat(indir, name.c_str(), O_RDONLY);
+    const int out = openat(donedir, part.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char gzip[] = "gzip", c[] = "-c";
+    char * const argv[] = { gzip, c, NULL };
+
+    const bool ok = in >= 0 && out >= 0 && run_command(argv, in, out) &&
+      fdatasync(out) == 0 &&
+      renameat(donedir, part.c_str(), donedir, (name + ".done.gz").c_str()) == 0;
+    if(in  >= 0) close(in);
+    if(out >= 0) close(out);
+
+    if(ok && unlinkat(indir, name.c_str(), 0) == 0) return;
+
+    log_msg(LOG_ERR, "Could not compress %s\n", path.c_str());
+    unlinkat(donedir, part.c_str(), 0);
+    how = kRetireRename;
+  }
+
+  if(how == kRetireDelete){
+    if(unlinkat(indir, name.c_str(), 0) == 0 || errno == ENOENT) return;
+    log_msg(LOG_ERR, "Could not delete %s: %s\n", path.c_str(), strerror(errno));
+    how = kRetireRename;
+  }
+
+  // kRetireRename, or anything else that failed.  If this fails we would
+  // read the file again, so give up.
+  if(renameat(indir, name.c_str(), donedir, (name + ".done").c_str()))
+    log_msg(LOG_CRIT, "Could not rename input file %s to decoded/%s.done: "
+            "%s.\n", path.c_str(), name.c_str(), strerror(errno));
+}
+
+// Appends the MD5 sum of 'output' to the file of sums.  Returns true if it
+// got there.
+bool InputRetirer::record_sum(const std::string & output)
+{
+  char md5sum[] = "md5sum";
+  std::string arg = output;
+  char * const argv[] = { md5sum, &arg[0], NULL };
+
+  if(run_command(argv, -1, sumsfd) && fdatasync(sumsfd) == 0) return true;
+
+  log_msg(LOG_ERR, "Could not record the sum of %s, so keeping its input "
+          "files\n", output.c_str());
+  return false;
+}
@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "LatencyTrace.h"
+
+int64_t wall_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void LatencyHistogram::clear()
+{
+  memset(counts, 0, sizeof counts);
+  total = 0;
+  largest = 0;
+}
+
+// Times below 2*SUB_BUCKETS each have a bucket of their own.  Above that,
+// each power of two is split into SUB_BUCKETS buckets.
+int LatencyHistogram::bucket(const uint64_t us)
+{
+  if(us < 2*SUB_BUCKETS) return us;
+  const int shift = 63 - __builtin_clzll(us) - SUB_BITS;
+  return (shift + 1)*SUB_BUCKETS + (int)(us >> shift) - SUB_BUCKETS;
+}
+
+// The longest time that goes in bucket 'b'
+int64_t LatencyHistogram::bucket_top(const int b)
+{
+  if(b < 2*SUB_BUCKETS) return b;
+  const int shift = b/SUB_BUCKETS - 1;
+  return (((int64_t)(b % SUB_BUCKETS + SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+void LatencyHistogram::add(const int64_t us)
+{
+  const int64_t t = std::min(std::max(us, (int64_t)0),
+                             ((int64_t)1 << MAX_BITS) - 1);
+  counts[bucket(t)]++;
+  total++;
+  largest = std::max(largest, t);
+}
+
+void LatencyHistogram::add(const LatencyHistogram & other)
+{
+  for(int b = 0; b < BUCKETS; b++) counts[b] += other.counts[b];
+  total += other.total;
+  largest = std::max(largest, other.largest);
+}
+
+int64_t LatencyHistogram::percentile(const double fraction) const
+{
+  if(total == 0) return 0;
+
+  const uint64_t wanted = std::max((uint64_t)1,
+                                   (uint64_t)(fraction*total + 0.5));
+  uint64_t sofar = 0;
+  for(int b = 0; b < BUCKETS; b++){
+    sofar += counts[b];
+    if(sofar >= wanted) return std::min(bucket_top(b), largest);
+  }
+  return largest;
+}
+
+void LatencyTrace::clear()
+{
+  for(int s = 0; s < kStages; s++) stages[s].clear();
+}
+
+void LatencyTrace::report(const std::string & name) const
+{
+  // Milliseconds, since most stages take that long or longer
+  char text[kStages][48];
+  for(int s = 0; s < kStages; s++){
+    const LatencyHistogram & h = stages[s];
+    if(h.count() == 0) snprintf(text[s], sizeof text[s], "-");
+    else snprintf(text[s], sizeof text[s], "%.1f/%.1f/%.1f",
+                  h.percentile(0.5)/1e3, h.percentile(0.99)/1e3, h.max()/1e3);
+  }
+
+  log_msg(LOG_INFO, "Latency in ms (median/99%%/max) for %s: file wait %s, "
+          "decode wait %s, decode %s, merge wait %s, build %s, total %s, "
+          "event age %s\n", name.c_str(), text[kFileWait], text[kDecodeWait],
+          text[kDecode], text[kMergeWait], text[kBuild], text[kTotal],
+          text[kEventAge]);
+}
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "OutputFile.h"
+
+// How much space to allocate and map at a time.  A multiple of the page size.
+static const int64_t SEGMENT_SIZE = 1 << 25;
+
+OutputFile::OutputFile()
+{
+  fd = -1;
+  written = 0;
+  map = NULL;
+  mapbase = maplen = 0;
+  use_write = false;
+}
+
+OutputFile::~OutputFile()
+{
+  unmap();
+  if(fd >= 0) ::close(fd);
+}
+
+bool OutputFile::open(const std::string & name_)
+{
+  name = name_;
+  tmpname = name + ".part";
+  written = 0;
+  mapbase = maplen = 0;
+  use_write = false;
+
+  errno = 0;
+  if((fd = ::open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+    log_msg(LOG_ERR, "Failed to open file %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::reopen(const std::string & name_, const int64_t offset)
+{
+  name = name_;
+  tmpname = name + ".part";
+  use_write = false;
+
+  // If we got as far as closing it, open it up again
+  if(access(tmpname.c_str(), F_OK) < 0 && rename(name.c_str(), tmpname.c_str())){
+    log_msg(LOG_ERR, "Failed to find %s or %s to reopen: %s\n",
+            tmpname.c_str(), name.c_str(), strerror(errno));
+    return false;
+  }
+
+  errno = 0;
+  if((fd = ::open(tmpname.c_str(), O_RDWR)) < 0){
+    log_msg(LOG_ERR, "Failed to reopen file %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < offset){
+    log_msg(LOG_ERR, "%s is shorter than expected\n", tmpname.c_str());
+    return false;
+  }
+
+  if(ftruncate(fd, offset) < 0){
+    log_msg(LOG_ERR, "Could not rewind %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  // The next write maps in the segment this is in
+  written = mapbase = offset;
+  maplen = 0;
+  return true;
+}
+
+// Unmaps the current segment, if any, and starts writing it back to disk
+bool OutputFile::unmap()
+{
+  if(map == NULL) return true;
+
+  const bool ok = munmap(map, maplen) == 0;
+  map = NULL;
+  sync_file_range(fd, mapbase, maplen, SYNC_FILE_RANGE_WRITE);
+  return ok;
+}
+
+// Maps in the segment that the next byte goes in, first allocating space
+// for it.  Switches to using write() if the file system can't do that.
+bool OutputFile::next_segment()
+{
+  unmap();
+  if(use_write) return true;
+
+  const int64_t base = written - written % SEGMENT_SIZE;
+
+  errno = 0;
+  if(fallocate(fd, 0, base, SEGMENT_SIZE) < 0){
+    if(errno == EOPNOTSUPP || errno == ENOSYS){
+      log_msg(LOG_NOTICE, "Cannot preallocate %s, so writing it plainly\n",
+              tmpname.c_str());
+      use_write = true;
+      return true;
+    }
+    log_msg(LOG_ERR, "Could not allocate space in %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  void * const m = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, base);
+  if(m == MAP_FAILED){
+    log_msg(LOG_NOTICE, "Cannot map %s (%s), so writing it plainly\n",
+            tmpname.c_str(), strerror(errno));
+    use_write = true;
+    return true;
+  }
+
+  map = (char *)m;
+  mapbase = base;
+  maplen = SEGMENT_SIZE;
+  return true;
+}
+
+bool OutputFile::write_slow(const void * data, size_t len)
+{
+  while(len > 0){
+    const ssize_t n = pwrite(fd, data, len, written);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    data = (const char *)data + n;
+    written += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool OutputFile::sync()
+{
+  if(map != NULL && msync(map, written - mapbase, MS_SYNC) < 0)
+    return false;
+  return fdatasync(fd) == 0;
+}
+
+bool OutputFile::close()
+{
+  bool ok = unmap();
+  ok &= ftruncate(fd, written) == 0;
+  ok &= fdatasync(fd) == 0;
+  ok &= ::close(fd) == 0;
+  fd = -1;
+
+  if(!ok){
+    log_msg(LOG_ERR, "Could not finish writing %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  if(rename(tmpname.c_str(), name.c_str()) < 0){
+    log_msg(LOG_ERR, "Could not rename %s to %s: %s\n", tmpname.c_str(),
+            name.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
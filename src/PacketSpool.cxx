@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "PacketSpool.h"
+#include "Checkpoint.h"
+
+// How much to read or write at once
+static const unsigned int SPOOL_BUFSIZE = 1 << 16;
+
+PacketSpool::PacketSpool()
+{
+  dir = ".";
+  fd = -1;
+  rpos = 0;
+  roff = woff = 0;
+  count = 0;
+  headlen = 0;
+}
+
+PacketSpool::~PacketSpool()
+{
+  if(fd >= 0) close(fd);
+}
+
+void PacketSpool::push_back(const decoded_packet & packet)
+{
+  EncodePacket(packet, wbuf);
+  last = packet;
+  count++;
+  if(wbuf.size() >= SPOOL_BUFSIZE) write_out();
+}
+
+// Moves the contents of 'wbuf' to the end of the file
+void PacketSpool::write_out()
+{
+  if(fd < 0){
+    std::string name = dir + "/EBspool.XXXXXX";
+    errno = 0;
+    if((fd = mkstemp(&name[0])) < 0)
+      log_msg(LOG_CRIT, "Could not make spool file in %s: %s\n",
+              dir.c_str(), strerror(errno));
+    unlink(name.c_str());
+  }
+
+  if((ssize_t)wbuf.size() != pwrite(fd, &wbuf[0], wbuf.size(), woff))
+    log_msg(LOG_CRIT, "Could not write to spool file: %s\n", strerror(errno));
+  woff += wbuf.size();
+  wbuf.clear();
+}
+
+// Gets more encoded packets into 'rbuf', from the file if there are any
+// there, otherwise straight from 'wbuf'
+void PacketSpool::read_in()
+{
+  rbuf.erase(rbuf.begin(), rbuf.begin() + rpos);
+  rpos = 0;
+
+  if(roff < woff){
+    const unsigned int n = std::min((uint64_t)SPOOL_BUFSIZE, woff - roff);
+    const unsigned int had = rbuf.size();
+    rbuf.resize(had + n);
+    if((ssize_t)n != pread(fd, &rbuf[had], n, roff))
+      log_msg(LOG_CRIT, "Could not read spool file: %s\n", strerror(errno));
+    roff += n;
+  }
+  else{
+    rbuf.insert(rbuf.end(), wbuf.begin(), wbuf.end());
+    wbuf.clear();
+  }
+}
+
+const decoded_packet & PacketSpool::front()
+{
+  while(headlen == 0){
+    if(rpos < rbuf.size())
+      headlen = DecodePacket(&rbuf[rpos], rbuf.size() - rpos, head);
+    if(headlen == 0) read_in();
+  }
+  return head;
+}
+
+void PacketSpool::pop_front()
+{
+  front();
+  rpos += headlen;
+  headlen = 0;
+
+  // Once it's empty, start the file over
+  if(--count == 0) clear();
+}
+
+void PacketSpool::take_front(decoded_packet & packet)
+{
+  front();
+  packet.swap(head);
+  pop_front();
+}
+
+void PacketSpool::clear()
+{
+  if(fd >= 0 && ftruncate(fd, 0) < 0)
+    log_msg(LOG_WARNING, "Could not truncate spool file: %s\n", strerror(errno));
+  rbuf.clear();
+  wbuf.clear();
+  rpos = 0;
+  roff = woff = 0;
+  count = 0;
+  headlen = 0;
+}
+
+void PacketSpool::save(CheckpointWriter & out)
+{
+  if(rbuf.size() > rpos) out.put_raw(&rbuf[rpos], rbuf.size() - rpos);
+
+  std::vector<char> buf(SPOOL_BUFSIZE);
+  for(uint64_t off = roff; off < woff; ){
+    const unsigned int n = std::min((uint64_t)SPOOL_BUFSIZE, woff - off);
+    if((ssize_t)n != pread(fd, &buf[0], n, off))
+      log_msg(LOG_CRIT, "Could not read spool file: %s\n", strerror(errno));
+    out.put_raw(&buf[0], n);
+    off += n;
+  }
+
+  if(!wbuf.empty()) out.put_raw(&wbuf[0], wbuf.size());
+}
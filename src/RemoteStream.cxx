@@ -0,0 +1,464 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Checkpoint.h"
+#include "RemoteStream.h"
+
+// Bytes before the rest of each message: magic number, type and length
+static const unsigned int HEADER_SIZE = 3*sizeof(uint32_t);
+
+// Largest message we'll believe in, so that garbage doesn't make us try to
+// allocate something huge
+static const uint32_t MAX_MESSAGE = 1 << 30;
+
+// How often the receiver thread looks for acknowledgements to send, and
+// whether it can read from agents it has stopped reading from, in ms
+static const int ACK_POLL_MS = 100;
+
+// Most to read from one agent at a time, so that its batches are counted
+// against its limit before much more comes in
+static const size_t READ_BYTES = 1 << 20;
+
+static bool send_all(const int fd, const char * data, size_t len)
+{
+  while(len > 0){
+    const ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool recv_all(const int fd, char * data, size_t len)
+{
+  while(len > 0){
+    const ssize_t n = recv(fd, data, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool send_message(const int fd, const uint32_t type,
+                  const CheckpointWriter & payload)
+{
+  const std::vector<char> & data = payload.data();
+  const uint32_t header[3] = { REMOTE_MAGIC, type, (uint32_t)data.size() };
+  return send_all(fd, (const char *)header, HEADER_SIZE) &&
+         (data.empty() || send_all(fd, &data[0], data.size()));
+}
+
+bool recv_message(const int fd, uint32_t & type, CheckpointReader & payload)
+{
+  uint32_t header[3];
+  if(!recv_all(fd, (char *)header, HEADER_SIZE)) return false;
+  if(header[0] != REMOTE_MAGIC || header[2] > MAX_MESSAGE) return false;
+  type = header[1];
+
+  std::vector<char> data(header[2]);
+  if(!data.empty() && !recv_all(fd, &data[0], data.size())) return false;
+  payload.take(data);
+  return true;
+}
+
+RemoteReceiver::RemoteReceiver()
+{
+  listenfd = -1;
+  running = false;
+  stopping = false;
+  highbytes = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&arrived, NULL);
+}
+
+bool RemoteReceiver::start(const int port, const std::vector<int> & serials,
+                           const std::vector<CheckpointWriter> & setups,
+                           const uint64_t maxbytes)
+{
+  highbytes = maxbytes;
+  if(streams.empty()) streams.resize(serials.size());
+  for(unsigned int j = 0; j < streams.size(); j++){
+    streams[j].serial = serials[j];
+    streams[j].setup = setups[j];
+    streams[j].fd = -1;
+  }
+
+  errno = 0;
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenfd < 0){
+    log_msg(LOG_ERR, "Could not make a socket for agents: %s\n",
+            strerror(errno));
+    return false;
+  }
+
+  const int on = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if(bind(listenfd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+     listen(listenfd, 16) < 0){
+    log_msg(LOG_ERR, "Could not listen for agents on port %d: %s\n",
+            port, strerror(errno));
+    close(listenfd);
+    listenfd = -1;
+    return false;
+  }
+
+  if(pthread_create(&thread, NULL, run, this)){
+    log_msg(LOG_ERR, "Could not start the thread for agents\n");
+    close(listenfd);
+    listenfd = -1;
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+bool RemoteReceiver::take(const unsigned int j,
+                          std::vector<decoded_packet> * & packets,
+                          bool & endfile)
+{
+  pthread_mutex_lock(&lock);
+  stream & s = streams[j];
+  const bool got = !s.queue.empty();
+  if(got){
+    packets = s.queue.front().packets;
+    endfile = s.queue.front().endfile;
+    s.queuedbytes -= s.queue.front().bytes;
+    s.queue.pop_front();
+    s.taken++;
+    if(s.paused && s.queuedbytes <= highbytes/2) s.paused = false;
+  }
+  pthread_mutex_unlock(&lock);
+  return got;
+}
+
+void RemoteReceiver::wait(const unsigned int us)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)us*1000;
+  ts.tv_sec += ts.tv_nsec/1000000000;
+  ts.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&lock);
+  pthread_cond_timedwait(&arrived, &lock, &ts);
+  pthread_mutex_unlock(&lock);
+}
+
+void RemoteReceiver::ack()
+{
+  pthread_mutex_lock(&lock);
+  for(unsigned int j = 0; j < streams.size(); j++)
+    streams[j].acked = streams[j].taken;
+  pthread_mutex_unlock(&lock);
+}
+
+void RemoteReceiver::save(CheckpointWriter & out)
+{
+  pthread_mutex_lock(&lock);
+  out.put((uint32_t)streams.size());
+  for(unsigned int j = 0; j < streams.size(); j++) out.put(streams[j].taken);
+  pthread_mutex_unlock(&lock);
+}
+
+bool RemoteReceiver::load(CheckpointReader & in, const unsigned int nstreams)
+{
+  uint32_t n;
+  in.get(n);
+  if(n != nstreams) return false;
+
+  streams.resize(n);
+  for(unsigned int j = 0; j < n; j++){
+    in.get(streams[j].taken);
+    streams[j].received = streams[j].acked = streams[j].taken;
+  }
+  return in.good();
+}
+
+void RemoteReceiver::stop()
+{
+  if(!running) return;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  running = false;
+
+  for(unsigned int i = 0; i < connections.size(); i++)
+    hang_up(connections[i]);
+  connections.clear();
+  close(listenfd);
+  listenfd = -1;
+}
+
+void RemoteReceiver::accept_agent()
+{
+  const int fd = accept(listenfd, NULL, NULL);
+  if(fd < 0) return;
+
+  const int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+  connection c;
+  c.fd = fd;
+  c.stream = -1;
+  connections.push_back(c);
+}
+
+void RemoteReceiver::hang_up(connection & c)
+{
+  if(c.fd < 0) return;
+
+  pthread_mutex_lock(&lock);
+  if(c.stream >= 0 && streams[c.stream].fd == c.fd){
+    streams[c.stream].fd = -1;
+    if(!stopping)
+      log_msg(LOG_WARNING, "Lost the agent for USB %d\n",
+              streams[c.stream].serial);
+  }
+  pthread_mutex_unlock(&lock);
+
+  close(c.fd);
+  c.fd = -1;
+}
+
+// Reads whatever has come in on 'c' and deals with each whole message.
+// Returns false if the connection should be dropped.
+bool RemoteReceiver::read_messages(connection & c)
+{
+  char chunk[1 << 16];
+  for(size_t got = 0; got < READ_BYTES; ){
+    const ssize_t n = recv(c.fd, chunk, sizeof chunk, MSG_DONTWAIT);
+    if(n > 0){
+      c.buf.insert(c.buf.end(), chunk, chunk + n);
+      got += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    return false; // Closed or failed
+  }
+
+  size_t used = 0;
+  while(c.buf.size() - used >= HEADER_SIZE){
+    uint32_t header[3];
+    memcpy(header, &c.buf[used], HEADER_SIZE);
+    if(header[0] != REMOTE_MAGIC || header[2] > MAX_MESSAGE){
+      log_msg(LOG_ERR, "Got garbage from an agent.  Is it on a machine of "
+              "another byte order?\n");
+      return false;
+    }
+    if(c.buf.size() - used < HEADER_SIZE + header[2]) break;
+
+    std::vector<char> data(c.buf.begin() + used + HEADER_SIZE,
+                           c.buf.begin() + used + HEADER_SIZE + header[2]);
+    used += HEADER_SIZE + header[2];
+
+    CheckpointReader in;
+    in.take(data);
+    if(!handle(c, header[1], in, header[2])) return false;
+  }
+  c.buf.erase(c.buf.begin(), c.buf.begin() + used);
+  return true;
+}
+
+bool RemoteReceiver::handle(connection & c, const uint32_t type,
+                            CheckpointReader & in, const uint32_t bytes)
+{
+  if(type == kRemoteHello && c.stream < 0) return hello(c, in);
+
+  if(type != kRemoteBatch || c.stream < 0){
+    log_msg(LOG_ERR, "Got an unexpected message of type %u from an agent\n",
+            type);
+    return false;
+  }
+
+  uint64_t seq;
+  uint8_t endfile;
+  std::vector<decoded_packet> * packets = new std::vector<decoded_packet>;
+  in.get(seq);
+  in.get(endfile);
+  in.get(*packets);
+  if(!in.done()){
+    log_msg(LOG_ERR, "Got a bad batch from an agent\n");
+    delete packets;
+    return false;
+  }
+
+  pthread_mutex_lock(&lock);
+  stream & s = streams[c.stream];
+  const uint64_t expected = s.received;
+  bool pause = false;
+  uint64_t waiting = 0;
+  if(seq == expected){
+    batch b;
+    b.packets = packets;
+    b.endfile = endfile;
+    b.bytes = bytes;
+    s.queue.push_back(b);
+    s.queuedbytes += bytes;
+    s.received++;
+    pause = !s.paused && s.queuedbytes > highbytes;
+    if(pause) s.paused = true;
+    waiting = s.queuedbytes;
+    pthread_cond_broadcast(&arrived);
+  }
+  pthread_mutex_unlock(&lock);
+
+  if(pause)
+    log_msg(LOG_INFO, "Holding off the agent for USB %d, with %lu kB "
+            "waiting\n", s.serial, (unsigned long)(waiting >> 10));
+  if(seq == expected) return true;
+
+  delete packets;
+  if(seq < expected) return true; // Sent again after reconnecting
+  log_msg(LOG_ERR, "Agent for USB %d skipped from batch %lu to %lu\n",
+          s.serial, (unsigned long)expected, (unsigned long)seq);
+  return false;
+}
+
+// Finds out which stream the agent on 'c' has, and sends it its setup.
+// Returns false if it can't be used.
+bool RemoteReceiver::hello(connection & c, CheckpointReader & in)
+{
+  int serial;
+  uint64_t first, next;
+  in.get(serial);
+  in.get(first);
+  in.get(next);
+  if(!in.done()){
+    log_msg(LOG_ERR, "Got a bad greeting from an agent\n");
+    return false;
+  }
+
+  unsigned int j = 0;
+  while(j < streams.size() && streams[j].serial != serial) j++;
+  if(j == streams.size()){
+    log_msg(LOG_ERR, "Got an agent for USB %d, which is not in the "
+            "configuration\n", serial);
+    return false;
+  }
+
+  pthread_mutex_lock(&lock);
+  stream & s = streams[j];
+  const uint64_t from = s.received;
+  const bool fresh = from == 0;
+  const int oldfd = s.fd;
+  if(fresh || (first <= from && from <= next)){
+    s.fd = c.fd;
+    s.acksent = 0;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if(!fresh && !(first <= from && from <= next)){
+    log_msg(LOG_ERR, "Agent for USB %d has batches %lu to %lu, but the run "
+            "needs them from %lu on.  The run must be restarted.\n", serial,
+            (unsigned long)first, (unsigned long)next, (unsigned long)from);
+    return false;
+  }
+
+  // A new connection from the same agent replaces the old one
+  for(unsigned int i = 0; i < connections.size(); i++)
+    if(connections[i].fd == oldfd && oldfd >= 0)
+      shutdown(oldfd, SHUT_RDWR);
+  c.stream = j;
+  log_msg(LOG_NOTICE, "Agent for USB %d connected, from batch %lu\n",
+          serial, (unsigned long)from);
+
+  CheckpointWriter out;
+  out.put((uint8_t)fresh);
+  out.put(from);
+  out.put_raw(&s.setup.data()[0], s.setup.data().size());
+  return send_message(c.fd, kRemoteSetup, out);
+}
+
+// Tells each agent about batches that have been put in a checkpoint since
+// it was last told
+void RemoteReceiver::send_acks()
+{
+  for(unsigned int j = 0; j < streams.size(); j++){
+    pthread_mutex_lock(&lock);
+    const int fd = streams[j].fd;
+    const uint64_t acked = streams[j].acked;
+    const bool tell = fd >= 0 && acked > streams[j].acksent;
+    if(tell) streams[j].acksent = acked;
+    pthread_mutex_unlock(&lock);
+
+    if(!tell) continue;
+
+    CheckpointWriter out;
+    out.put(acked);
+    // If this fails, poll() will see the connection close
+    if(!send_message(fd, kRemoteAck, out)) shutdown(fd, SHUT_RDWR);
+  }
+}
+
+void * RemoteReceiver::run(void * receiver)
+{
+  RemoteReceiver & r = *(RemoteReceiver *)receiver;
+
+  while(true){
+    pthread_mutex_lock(&r.lock);
+    const bool stop = r.stopping;
+    pthread_mutex_unlock(&r.lock);
+    if(stop) break;
+
+    // Agents with too much waiting are left alone, which poll() does with
+    // negative fds
+    std::vector<struct pollfd> fds(r.connections.size() + 1);
+    fds[0].fd = r.listenfd;
+    fds[0].events = POLLIN;
+    pthread_mutex_lock(&r.lock);
+    for(unsigned int i = 0; i < r.connections.size(); i++){
+      const int j = r.connections[i].stream;
+      const bool paused = j >= 0 && r.streams[j].paused;
+      fds[i+1].fd = paused? -1: r.connections[i].fd;
+      fds[i+1].events = POLLIN;
+    }
+    pthread_mutex_unlock(&r.lock);
+
+    if(poll(&fds[0], fds.size(), ACK_POLL_MS) > 0){
+      for(unsigned int i = 0; i < r.connections.size(); i++)
+        if(fds[i+1].revents && !r.read_messages(r.connections[i]))
+          r.hang_up(r.connections[i]);
+      if(fds[0].revents & POLLIN) r.accept_agent();
+    }
+
+    for(unsigned int i = 0; i < r.connections.size(); i++){
+      if(r.connections[i].fd < 0){
+        r.connections.erase(r.connections.begin() + i);
+        i--;
+      }
+    }
+
+    r.send_acks();
+  }
+  return NULL;
+}
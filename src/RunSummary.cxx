@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Checkpoint.h"
+#include "RunSummary.h"
+
+static const unsigned int NCHANNELS = 64;
+
+void RunSummary::init(const std::vector<uint16_t> & modules_)
+{
+  modules = modules_;
+  slots.clear();
+  for(unsigned int i = 0; i < modules.size(); i++){
+    if(modules[i] >= slots.size()) slots.resize(modules[i] + 1, -1);
+    slots[modules[i]] = i;
+  }
+
+  packets    .resize(modules.size());
+  missedsyncs.resize(modules.size());
+  maxcount   .resize(modules.size());
+  missingsets.resize(modules.size());
+  hits       .resize(modules.size()*NCHANNELS);
+  charge     .resize(modules.size()*NCHANNELS*CHARGE_BINS);
+  clear();
+}
+
+void RunSummary::clear()
+{
+  events = 0;
+  firsttime = lasttime = 0;
+  std::fill(packets.begin(), packets.end(), 0);
+  std::fill(missedsyncs.begin(), missedsyncs.end(), 0);
+  std::fill(maxcount.begin(), maxcount.end(), 0);
+  std::fill(missingsets.begin(), missingsets.end(), 0);
+  std::fill(hits.begin(), hits.end(), 0);
+  std::fill(charge.begin(), charge.end(), 0);
+}
+
+void RunSummary::add_event(const decoded_packet * const in_packets,
+                           const unsigned int npackets,
+                           const uint16_t * const in_modules,
+                           const uint8_t mask)
+{
+  events++;
+
+  for(unsigned int p = 0; p < npackets; p++){
+    const decoded_packet & packet = in_packets[p];
+    if(!(packet.tags & mask) || !packet.isadc) continue;
+
+    if(packet.timeunix != 0){
+      if(firsttime == 0 || packet.timeunix < firsttime)
+        firsttime = packet.timeunix;
+      if(packet.timeunix > lasttime) lasttime = packet.timeunix;
+    }
+
+    const int s = slot(in_modules[p]);
+    if(s < 0) continue;
+    packets[s]++;
+
+    for(unsigned int h = 0; h < packet.hits.size(); h++){
+      const decoded_hit & hit = packet.hits[h];
+      if(hit.channel >= NCHANNELS) continue;
+
+      const unsigned int c = s*NCHANNELS + hit.channel;
+      hits[c]++;
+
+      int bin = hit.charge/CHARGE_BIN_WIDTH;
+      if(bin < 0) bin = 0;
+      if(bin >= CHARGE_BINS) bin = CHARGE_BINS - 1;
+      charge[c*CHARGE_BINS + bin]++;
+    }
+  }
+}
+
+void RunSummary::add_late_count(const uint16_t module, const uint32_t count,
+                                const bool first)
+{
+  const int s = slot(module);
+  if(s < 0) return;
+  if(first) missedsyncs[s]++;
+  if(count > maxcount[s]) maxcount[s] = count;
+}
+
+void RunSummary::add_missing_set(const uint16_t module)
+{
+  const int s = slot(module);
+  if(s >= 0) missingsets[s]++;
+}
+
+void RunSummary::add(const RunSummary & other)
+{
+  events += other.events;
+  if(other.firsttime != 0 && (firsttime == 0 || other.firsttime < firsttime))
+    firsttime = other.firsttime;
+  if(other.lasttime > lasttime) lasttime = other.lasttime;
+
+  for(unsigned int s = 0; s < modules.size(); s++){
+    packets[s]     += other.packets[s];
+    missedsyncs[s] += other.missedsyncs[s];
+    missingsets[s] += other.missingsets[s];
+    if(other.maxcount[s] > maxcount[s]) maxcount[s] = other.maxcount[s];
+  }
+
+  // Most channels are empty in most slices, so skip their histograms
+  for(unsigned int c = 0; c < hits.size(); c++){
+    if(other.hits[c] == 0) continue;
+    hits[c] += other.hits[c];
+    for(int b = 0; b < CHARGE_BINS; b++)
+      charge[c*CHARGE_BINS + b] += other.charge[c*CHARGE_BINS + b];
+  }
+}
+
+bool RunSummary::write(const std::string & name,
+                       const std::string & outname) const
+{
+  const std::string tmpname = name + ".part";
+
+  errno = 0;
+  FILE * const f = fopen(tmpname.c_str(), "w");
+  if(f == NULL){
+    log_msg(LOG_ERR, "Could not open summary %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  // Rates are per second of Unix time stamps, counting both ends
+  const double seconds = firsttime? lasttime - firsttime + 1: 0;
+
+  fprintf(f, "# Event builder monitoring summary.  Charge histograms have "
+             "%d bins of %d ADC counts,\n"
+             "# given as bin:count for those that aren't empty.\n",
+          CHARGE_BINS, CHARGE_BIN_WIDTH);
+  fprintf(f, "file %s\n", outname.c_str());
+  fprintf(f, "first_time %u\nlast_time %u\nseconds %.0f\n", firsttime,
+          lasttime, seconds);
+  fprintf(f, "events %lu\n", (unsigned long)events);
+
+  for(unsigned int s = 0; s < modules.size(); s++){
+    uint64_t modhits = 0;
+    for(unsigned int ch = 0; ch < NCHANNELS; ch++)
+      modhits += hits[s*NCHANNELS + ch];
+
+    fprintf(f, "module %u packets %lu hits %lu missed_syncs %u "
+               "max_late_count %u missing_file_sets %u\n", modules[s],
+            (unsigned long)packets[s], (unsigned long)modhits, missedsyncs[s],
+            maxcount[s], missingsets[s]);
+
+    for(unsigned int ch = 0; ch < NCHANNELS; ch++){
+      const unsigned int c = s*NCHANNELS + ch;
+      if(hits[c] == 0) continue;
+
+      fprintf(f, "channel %u %u hits %lu rate %.3g charge", modules[s], ch,
+              (unsigned long)hits[c], seconds? hits[c]/seconds: 0);
+      for(int b = 0; b < CHARGE_BINS; b++)
+        if(charge[c*CHARGE_BINS + b])
+          fprintf(f, " %d:%u", b, charge[c*CHARGE_BINS + b]);
+      fprintf(f, "\n");
+    }
+  }
+
+  const bool failed = ferror(f);
+  if(fclose(f) != 0 || failed){
+    log_msg(LOG_ERR, "Could not write summary %s\n", tmpname.c_str());
+    return false;
+  }
+
+  if(rename(tmpname.c_str(), name.c_str()) < 0){
+    log_msg(LOG_ERR, "Could not rename %s to %s: %s\n", tmpname.c_str(),
+            name.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Only the channels with hits are saved, each with its module number, so
+// that this doesn't depend on the order of the modules
+void RunSummary::save(CheckpointWriter & out) const
+{
+  out.put(events);
+  out.put(firsttime);
+  out.put(lasttime);
+
+  out.put((uint32_t)modules.size());
+  for(unsigned int s = 0; s < modules.size(); s++){
+    out.put(modules[s]);
+    out.put(packets[s]);
+    out.put(missedsyncs[s]);
+    out.put(maxcount[s]);
+    out.put(missingsets[s]);
+  }
+
+  uint32_t nchannels = 0;
+  for(unsigned int c = 0; c < hits.size(); c++) nchannels += hits[c] != 0;
+  out.put(nchannels);
+
+  for(unsigned int c = 0; c < hits.size(); c++){
+    if(hits[c] == 0) continue;
+    out.put(modules[c/NCHANNELS]);
+    out.put((uint8_t)(c%NCHANNELS));
+    out.put(hits[c]);
+    out.put_raw((const char *)&charge[c*CHARGE_BINS],
+                CHARGE_BINS*sizeof charge[0]);
+  }
+}
+
+bool RunSummary::load(CheckpointReader & in)
+{
+  clear();
+  in.get(events);
+  in.get(firsttime);
+  in.get(lasttime);
+
+  uint32_t nmodules;
+  in.get(nmodules);
+  if(nmodules != modules.size()) return false;
+  for(uint32_t i = 0; i < nmodules && in.good(); i++){
+    uint16_t module;
+    in.get(module);
+    const int s = slot(module);
+    if(s < 0) return false;
+    in.get(packets[s]);
+    in.get(missedsyncs[s]);
+    in.get(maxcount[s]);
+    in.get(missingsets[s]);
+  }
+
+  uint32_t nchannels;
+  in.get(nchannels);
+  for(uint32_t i = 0; i < nchannels && in.good(); i++){
+    uint16_t module;
+    uint8_t ch;
+    in.get(module);
+    in.get(ch);
+    const int s = slot(module);
+    if(s < 0 || ch >= NCHANNELS) return false;
+
+    const unsigned int c = s*NCHANNELS + ch;
+    in.get(hits[c]);
+    for(int b = 0; b < CHARGE_BINS; b++) in.get(charge[c*CHARGE_BINS + b]);
+  }
+  return in.good();
+}
@@ -1,30 +1,82 @@
+#include <string.h>
+#include <errno.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h> // For htons, htonl
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <deque>
 
-#include "USBstream.h"
 #include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "Checkpoint.h"
+#include "PacketSpool.h"
+#include "WorkPool.h"
+
+int64_t USBstream::sharedfirstcount = USBstream::NO_COUNT;
+
+// When a file is decoded in pieces, module packets are made from their
+// words in jobs of PACKETS_PER_JOB, up to PACKETS_AT_ONCE at a time before
+// they are sorted in, so as not to hold many more packets than we have to.
+static const unsigned int PACKETS_PER_JOB = 4096;
+static const unsigned int PACKETS_AT_ONCE = 16*PACKETS_PER_JOB;
+
+// ADC packet word indices.  As per Toups thesis:
+//
+// 0xffff                         | Header word
+// 1, mod#[7 bits], wdcnt[8 bits] | Data type, module #, word count
+// time                           | High 16 bits of 62.5 MHz clock counter
+// time                           | Low  16 bits of 62.5 MHz clock counter
+// adc                            | ADC ...
+// channel                        | ... and channel number, repeated N times
+// parity                         | Parity
+enum ADC_WINX { ADC_WIDX_HEAD   = 0,
+                ADC_WIDX_MODLEN = 1,
+                ADC_WIDX_CLKHI  = 2,
+                ADC_WIDX_CLKLO  = 3,
+                ADC_WIDX_HIT    = 4 };
 
 USBstream::USBstream()
 {
-  sortedpacketsptr = sortedpackets.end();
-  mythresh=0;
+  nextpacket = 0;
+  firstcount = &sharedfirstcount;
+  spool = new PacketSpool;
+  membudget = 0;
+  rambytes = 0;
+  pool = NULL;
+  poolclient = 0;
+  piecebytes = PIECE_BYTES;
+  numoutputs = 1;
+  for(unsigned int o = 0; o < MAX_OUTPUTS; o++){
+    mythresh[o] = 0;
+    threshmode[o] = kNone;
+  }
   myusb=-1;
   unix_time = 0;
   got_unix_time_hi = false;
   unix_time_hi = 0;
   unix_time_lo = 0;
-  BothLayerThresh = false;
-  UseThresh = false;
+  have_phase = false;
+  phase = 0;
   myFile = NULL;
+  follow = false;
+  following = false;
+  unpacker = 0;
+  unpackfd = -1;
+  bytesdecoded = 0;
+  word = 0;
+  expcounter = 0;
+  memset(baseline, 0, sizeof baseline);
+  memset(offset, 0, sizeof offset);
   for(int i = 0; i < 32; i++) { // Map of adjacent channels
     adj1[i] = i+32;
     if(i==0) adj2[i] = adj1[i];
@@ -32,6 +84,14 @@ USBstream::USBstream()
     else if(i % 8 < 4) adj2[i] = adj1[i]+3;
     else adj2[i] = adj1[i]-4;
   }
+  choose_decoder();
+}
+
+USBstream::~USBstream()
+{
+  stop_unpacker();
+  delete myFile;
+  delete spool;
 }
 
 void USBstream::SetOffset(const int module, const int off)
@@ -42,17 +102,25 @@ void USBstream::SetOffset(const int module, const int off)
   }
 
   offset[module] = off;
+  choose_decoder();
 }
 
-void USBstream::SetThresh(int thresh, int threshtype)
+void USBstream::SetThresh(int thresh, int threshtype, const unsigned int output)
 {
+  if(output >= MAX_OUTPUTS){
+    log_msg(LOG_WARNING, "Ignoring threshold for output %u\n", output);
+    return;
+  }
+  if(output >= numoutputs) numoutputs = output + 1;
+
   //threshtype: 0=NONE, 1=OR, 2=AND
-  UseThresh = (bool)threshtype;
-  BothLayerThresh=(bool)(threshtype-1);
+  threshmode[output] = threshtype == 0? kNone:
+                       threshtype == 1? kSingleLayer: kDoubleLayer;
   if(thresh)
-    mythresh=thresh;
+    mythresh[output]=thresh;
   else
-    mythresh = -20; // Put SW threshold well below HW threshold (including spread)
+    mythresh[output] = -20; // Put SW threshold well below HW threshold (including spread)
+  choose_decoder();
 }
 
 void USBstream::SetBaseline(
@@ -61,6 +129,88 @@ void USBstream::SetBaseline(
   for(int i = 0; i < 64; i++)
     for(int j = 0; j < 64; j++)
       baseline[i][j] = std::max(0, baseptr[i][j]);
+  choose_decoder();
+}
+
+void USBstream::SetMemoryBudget(const uint64_t bytes, const std::string & dir)
+{
+  membudget = bytes;
+  spool->SetDir(dir);
+}
+
+// Roughly how much memory a packet takes up
+static uint64_t packet_bytes(const decoded_packet & packet)
+{
+  return sizeof(decoded_packet) + packet.hits.capacity()*sizeof(decoded_hit);
+}
+
+// Whether there are any packets not yet sent on
+bool USBstream::pending()
+{
+  return !spool->empty() || nextpacket < sortedpackets.size();
+}
+
+// The oldest packet not yet sent on.  Only if pending().
+const decoded_packet & USBstream::pending_front()
+{
+  return spool->empty()? sortedpackets[nextpacket]: spool->front();
+}
+
+// Count the oldest packet not yet sent on as sent.  Only if pending().
+void USBstream::pending_pop()
+{
+  if(spool->empty()) nextpacket++;
+  else spool->pop_front();
+}
+
+// Moves the oldest packet not yet sent on to the end of 'vec'.  Only if
+// pending().
+void USBstream::pending_take(std::vector<decoded_packet> & vec)
+{
+  if(!spool->empty()){
+    if(vec.size() == vec.capacity()) GrowPackets(vec);
+    vec.resize(vec.size() + 1);
+    spool->take_front(vec.back());
+    return;
+  }
+
+  // What's left behind is counted when it is thrown out in decodefile()
+  decoded_packet & packet = sortedpackets[nextpacket++];
+  rambytes -= packet_bytes(packet);
+  MovePacket(vec, packet);
+  rambytes += packet_bytes(packet);
+}
+
+// Moves the oldest packets to the spool until we are well within budget
+void USBstream::spill()
+{
+  const unsigned int first = nextpacket;
+  while(rambytes > membudget/2 && nextpacket < sortedpackets.size()){
+    spool->push_back(sortedpackets[nextpacket]);
+    rambytes -= packet_bytes(sortedpackets[nextpacket]);
+    nextpacket++;
+  }
+  ErasePackets(sortedpackets, first, nextpacket);
+  nextpacket = first;
+}
+
+// Moves everything in the spool back to memory
+void USBstream::unspill()
+{
+  log_msg(LOG_WARNING, "USB %d: packet out of order by more than the memory "
+          "budget allows for, reading back %lu packets\n", myusb,
+          (unsigned long)spool->size());
+
+  std::vector<decoded_packet> all;
+  for(unsigned int i = 0; i < nextpacket; i++)
+    MovePacket(all, sortedpackets[i]);
+  while(!spool->empty()){
+    pending_take(all);
+    rambytes += packet_bytes(all.back());
+  }
+  for(unsigned int i = nextpacket; i < sortedpackets.size(); i++)
+    MovePacket(all, sortedpackets[i]);
+  sortedpackets.swap(all);
 }
 
 void USBstream::GetBaselineData(std::vector<decoded_packet> *vec)
@@ -68,15 +218,26 @@ void USBstream::GetBaselineData(std::vector<decoded_packet> *vec)
   if(!vec->empty())
     log_msg(LOG_CRIT, "Expected vec to be empty for GetBaselineData()\n");
 
-  for(std::vector<decoded_packet>::iterator i = sortedpackets.begin();
-      i != sortedpackets.end(); i++)
-    if(!i->hits.empty())
-      vec->push_back(*i);
+  // Baselines are found from the packets that pass the first output's
+  // threshold, as they were before there could be more than one output
+  while(pending()){
+    if(pending_front().hits.empty() || !(pending_front().tags & 1))
+      pending_pop();
+    else pending_take(*vec);
+  }
 
   // Done with baselines. Clear this to be ready for the main data.
   sortedpackets.clear();
+  nextpacket = 0;
+  rambytes = 0;
+  std::vector<char>().swap(untimed);
 
   unix_time_hi = unix_time_lo = 0;
+
+  // The baselines' clock counts and time stamps have nothing to do with
+  // the run's, so don't let them set the sync pulse phase.
+  have_phase = false;
+  __atomic_store_n(firstcount, NO_COUNT, __ATOMIC_RELEASE);
 }
 
 // Appends all decoded data to 'vec' up to the next change of Unix time stamp
@@ -85,60 +246,185 @@ void USBstream::GetBaselineData(std::vector<decoded_packet> *vec)
 bool USBstream::GetDecodedDataUpToNextUnixTimeStamp(
   std::vector<decoded_packet> & vec)
 {
-  if(sortedpacketsptr == sortedpackets.end()){
+  if(!pending()){
     log_msg(LOG_NOTICE, "No decoded data to send (Unix time stamp %lu) "
       "for USB %d\n", unix_time, myusb);
     return false;
   }
 
-  for( ; sortedpacketsptr != sortedpackets.end(); sortedpacketsptr++) {
-    vec.push_back(*sortedpacketsptr);
+  bool newsecond = false;
+  while(pending()) {
+    pending_take(vec);
+    const decoded_packet & packet = vec.back();
 
-    if(sortedpacketsptr->hits.empty()) continue;
+    if(packet.hits.empty()) continue;
 
-    const uint32_t new_time = sortedpacketsptr->timeunix;
+    const uint32_t new_time = packet.timeunix;
 
-    if(new_time > unix_time) break;
+    if(new_time > unix_time){
+      newsecond = true;
+      break;
+    }
   }
 
-  if(sortedpacketsptr == sortedpackets.end()){
+  if(!newsecond){
     log_msg(LOG_NOTICE, "Sent decoded data up to end (Unix time stamp "
       "%lu) for USB %d\n", unix_time, myusb);
     return false;
   }
 
-  unix_time = sortedpacketsptr->timeunix;
+  unix_time = vec.back().timeunix;
 
   log_msg(LOG_NOTICE, "Sent decoded data up to Unix time stamp %lu for "
     "USB %d\n", unix_time, myusb);
 
-  sortedpacketsptr++; // Point at the next packet after the Unix timestamp
-
   return true;
 }
 
+// Appends all decoded data to 'vec' from before the latest Unix time stamp
+// seen in the data so far.  This is for following files as they are
+// written.  Packets from the current second are held back because more of
+// them may still be on their way from the DAQ and need to be sorted in.
+void USBstream::GetDecodedDataUpToLatestUnixTimeStamp(
+  std::vector<decoded_packet> & vec)
+{
+  const uint32_t latest = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
+
+  // Everything is decoded again when the first Unix time stamp is found,
+  // which can be half way through, with only its high bits seen so far
+  if(!unix_time) return;
+
+  // Packets from before the first time stamp have a time of zero, but
+  // unix_time must not go back to zero, or the next time stamp would look
+  // like the first, and everything would be decoded again
+  while(pending() && pending_front().timeunix < latest) {
+    if(pending_front().timeunix) unix_time = pending_front().timeunix;
+    pending_take(vec);
+  }
+}
+
+void USBstream::GetAllDecodedData(std::vector<decoded_packet> & vec)
+{
+  while(pending()){
+    if(pending_front().timeunix) unix_time = pending_front().timeunix;
+    pending_take(vec);
+  }
+  raw16bitdata.clear();
+  word = 0;
+  expcounter = 0;
+}
+
+void USBstream::RekeyUntimed(std::vector<decoded_packet> & packets)
+{
+  for(unsigned int n = 0; n < packets.size() && !packets[n].timeunix; n++){
+    packets[n].key = timekey(packets[n]);
+    for(unsigned int i = n; i > 0 && LessThan(packets[i], packets[i-1], 0); i--)
+      packets[i].swap(packets[i-1]);
+  }
+}
+
+void USBstream::SaveState(CheckpointWriter & out) const
+{
+  out.put(myusb);
+
+  // The same as putting a vector of all pending packets
+  out.put((uint32_t)(spool->size() + sortedpackets.size() - nextpacket));
+  spool->save(out);
+  std::vector<char> raw;
+  for(unsigned int i = nextpacket; i < sortedpackets.size(); i++)
+    EncodePacket(sortedpackets[i], raw);
+  if(!raw.empty()) out.put_raw(&raw[0], raw.size());
+  out.put((uint32_t)raw16bitdata.size());
+  for(unsigned int i = 0; i < raw16bitdata.size(); i++)
+    out.put(raw16bitdata[i]);
+  out.put(unix_time);
+  out.put(unix_time_hi);
+  out.put(unix_time_lo);
+  out.put(have_phase);
+  out.put(phase);
+  out.put(__atomic_load_n(firstcount, __ATOMIC_ACQUIRE));
+  out.put(baseline);
+}
+
+bool USBstream::LoadState(CheckpointReader & in)
+{
+  int usb;
+  in.get(usb);
+  if(usb != myusb){
+    log_msg(LOG_ERR, "Checkpoint has USB %d where USB %d should be\n",
+            usb, myusb);
+    return false;
+  }
+
+  in.get(sortedpackets);
+  nextpacket = 0;
+  spool->clear();
+  rambytes = 0;
+  for(unsigned int i = 0; i < sortedpackets.size(); i++)
+    rambytes += packet_bytes(sortedpackets[i]);
+
+  uint32_t nraw;
+  in.get(nraw);
+  raw16bitdata.clear();
+  for(uint32_t i = 0; i < nraw && in.good(); i++){
+    uint16_t w;
+    in.get(w);
+    raw16bitdata.push_back(w);
+  }
+
+  in.get(unix_time);
+  in.get(unix_time_hi);
+  in.get(unix_time_lo);
+  in.get(have_phase);
+  in.get(phase);
+  int64_t first;
+  in.get(first);
+  __atomic_store_n(firstcount, first, __ATOMIC_RELEASE);
+  in.get(baseline);
+  choose_decoder();
+  return in.good();
+}
+
 int USBstream::LoadFile(const std::string & nextfile)
 {
   std::ostringstream smyfilename;
   smyfilename << nextfile << "_" << GetUSB();
   myfilename = smyfilename.str();
 
+  // Set up for decoding from the top of the file
+  bytesdecoded = 0;
+  word = 0;
+  expcounter = 0;
+  got_unix_time_hi = false;
+
+  // If allowed, and the DAQ is still writing this file, follow it under
+  // its temporary name until it is renamed.
   struct stat myfileinfo;
+  following = follow && stat(myfilename.c_str(), &myfileinfo) != 0 &&
+              stat((myfilename + ".wr").c_str(), &myfileinfo) == 0;
+
   if(myFile == NULL || !myFile->is_open()) {
-    myFile = new std::fstream(myfilename.c_str(),
+    const std::string openname = following? myfilename + ".wr": myfilename;
+    myFile = new std::fstream(openname.c_str(),
                               std::fstream::in | std::fstream::binary);
     if(myFile == NULL || myFile->is_open()) {
+      if(following) return 1; // Empty is fine if it has only just started
       if(stat(myfilename.c_str(), &myfileinfo) == 0 &&
-         myfileinfo.st_size)
-        return 1;
+         myfileinfo.st_size){
+        if(start_unpacker()) return 1;
+        close_file();
+        return -1;
+      }
       myFile->close();
       delete myFile;
+      myFile = NULL;
       log_msg(LOG_ERR, "USB %d has died. Exiting.\n", myusb);
       return -1;
     }
     else {
-      log_msg(LOG_ERR, "Could not open %s\n", myfilename.c_str());
+      log_msg(LOG_ERR, "Could not open %s\n", openname.c_str());
       delete myFile;
+      myFile = NULL;
       return -1;
     }
   }
@@ -148,90 +434,464 @@ int USBstream::LoadFile(const std::string & nextfile)
   return 0;
 }
 
-void USBstream::decodefile()
+// Returns the size of the file we are reading, or as much of it as has
+// been written so far if we are following it.  Notices if the DAQ has
+// finished writing and renamed it.
+unsigned int USBstream::filesize()
 {
-  top: // we return here if triggered by restart leading from finding
-       // the first Unix timestamp packet, which means we have to go
-       // back and assign the time to each hit that came before that packet.
+  struct stat fileinfo;
+
+  if(following){
+    if(stat((myfilename + ".wr").c_str(), &fileinfo) == 0)
+      return fileinfo.st_size;
+
+    // Renamed to its final name, so now we can get the final size.  We
+    // still hold it open, so nothing else changes.
+    following = false;
+    log_msg(LOG_INFO, "%s finished, following it under its final name\n",
+            myfilename.c_str());
+  }
+
+  if(stat(myfilename.c_str(), &fileinfo) == -1)
+    log_msg(LOG_CRIT, "File %s stopped being readable!\n", myfilename.c_str());
 
+  return fileinfo.st_size;
+}
+
+// Decodes the file opened by LoadFile().  Normally reads all of it, closes
+// it and returns false.  But if we are following a file that the DAQ is
+// still writing, decodes what is there so far and returns true, in which
+// case call this again later to get more.
+bool USBstream::decodefile()
+{
   const unsigned int BUFSIZE = 0x10000;
 
   char filedata[BUFSIZE];//data buffer
 
   if(!myFile->is_open()) log_msg(LOG_CRIT, "File not open! Exiting.\n");
 
-  // Throw out what has already been passed on up
-  if(sortedpacketsptr <= sortedpackets.end())
-    sortedpackets.assign(sortedpacketsptr, sortedpackets.end());
+  forget_sent();
 
-  got_unix_time_hi = false;
+  if(unpacker){
+    decode_compressed();
+    return false;
+  }
 
-  struct stat fileinfo;
-  if(stat(myfilename.c_str(), &fileinfo) == -1)
-    log_msg(LOG_CRIT, "File %s stopped being readable!\n", myfilename.c_str());
+  top: // we return here if triggered by restart leading from finding
+       // the first Unix timestamp packet, which means we have to go
+       // back and assign the time to each hit that came before that packet.
 
-  unsigned int bytesleft = fileinfo.st_size;
-  unsigned int bytestoread = 0;
+  const unsigned int size = filesize();
+  myFile->clear(); // in case we previously read up to the end of a growing file
 
-  uint32_t word = 0; // holds 24-bit word being built, must be unsigned
-  char expcounter = 0; // expecting this counter next
+  if(pool != NULL && !following && bytesdecoded == 0 &&
+     size >= 2*piecebytes)
+    decode_in_pieces(size);
 
-  do{
-    bytestoread = std::min(BUFSIZE, bytesleft);
-    bytesleft -= bytestoread;
+  while(bytesdecoded < size){
+    const unsigned int bytestoread = std::min(BUFSIZE, size - bytesdecoded);
 
     myFile->read(filedata, bytestoread);
+    bytesdecoded += bytestoread;
+
+    // Add data to sortedpackets, but if we need to rewind to the
+    // beginning of the file, throw it all away again.
+    if(decodebytes(filedata, bytestoread)){
+      sortedpackets.clear();
+      spool->clear();
+      rambytes = 0;
+      raw16bitdata.clear();
+      myFile->seekg(std::ios::beg);
+      bytesdecoded = 0;
+      word = 0;
+      expcounter = 0;
+      got_unix_time_hi = false;
+      goto top;
+    }
+  }
 
-    /*
-      Undocumented input file format is revealed by inspection to be
-      constructed like this:
-
-      0                   1                   2                   3
-      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-     |0 0|     A     |0 1|      B    |1 0|     C     |1 1|     D     |
-     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-
-     Where the bits of A, B, C, and D concatenated make the 24-bit words
-     described in Matt Toups' thesis.
-   */
-
-    for(unsigned int bytedex = 0; bytedex < bytestoread; bytedex++){
-      const char counter = (filedata[bytedex] >> 6) & 3;
-      const char payload = filedata[bytedex] & 0x3f;
-      if(counter == 0){
-        expcounter = 1;
-        word = payload;
-      }
-      else if(counter == expcounter){
-        word = (word << 6) | payload;
-        if(++expcounter == 4){
-          expcounter = 0;
-
-          // Add data to sortedpackets, but if we need to rewind to the
-          // beginning of the file, throw it all away again.
-          if(raw24bit_to_raw16bit(word)) { //24-bit word stored, process it
-            sortedpackets.clear();
-            sortedpacketsptr = sortedpackets.begin();
-            raw16bitdata.clear();
-            myFile->seekg(std::ios::beg);
-            goto top;
+  if(following) return true;
+
+  close_file();
+  return false;
+}
+
+void USBstream::close_file()
+{
+  if(myFile->is_open()) myFile->close();
+  delete myFile;
+  myFile = NULL;
+}
+
+// If the file just opened starts with the magic number of gzip or zstd,
+// starts decompressing it, as another process, so that it is decompressed
+// while we decode.  Returns false if it should have been but couldn't.
+bool USBstream::start_unpacker()
+{
+  static const unsigned char gzip[] = { 0x1f, 0x8b };
+  static const unsigned char zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+  unsigned char magic[4] = { 0 };
+  myFile->read((char *)magic, sizeof magic);
+  myFile->clear();
+  myFile->seekg(std::ios::beg);
+
+  const char * program;
+  if(!memcmp(magic, gzip, sizeof gzip)) program = "gzip";
+  else if(!memcmp(magic, zstd, sizeof zstd)) program = "zstd";
+  else return true;
+
+  int fds[2];
+  if(pipe2(fds, O_CLOEXEC) < 0){
+    log_msg(LOG_ERR, "Could not make pipe to decompress %s: %s\n",
+            myfilename.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Let it get well ahead of us
+  fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+  const char * const argv[] = { program, "-dcq", "--", myfilename.c_str(),
+                                NULL };
+  pid_t pid;
+  const int err = posix_spawnp(&pid, program, &actions, NULL,
+                               (char * const *)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if(err){
+    log_msg(LOG_ERR, "Could not run %s to decompress %s: %s\n", program,
+            myfilename.c_str(), strerror(err));
+    close(fds[0]);
+    return false;
+  }
+
+  unpacker = pid;
+  unpackfd = fds[0];
+  return true;
+}
+
+// Stops the decompressor, if there is one.  Returns false if it didn't
+// finish successfully.
+bool USBstream::stop_unpacker()
+{
+  if(!unpacker) return true;
+
+  // If it isn't finished, this stops it, with SIGPIPE
+  close(unpackfd);
+  unpackfd = -1;
+
+  int status;
+  while(waitpid(unpacker, &status, 0) < 0 && errno == EINTR)
+    ;
+  unpacker = 0;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// decodefile() for a compressed file, decoding what the decompressor gives
+// us until it is finished
+void USBstream::decode_compressed()
+{
+  const unsigned int BUFSIZE = 0x10000;
+  char data[BUFSIZE];
+
+  while(true){
+    const ssize_t n = read(unpackfd, data, BUFSIZE);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) break;
+    bytesdecoded += n;
+
+    // As in decodefile(), but start decompressing again from the top
+    if(decodebytes(data, n)){
+      sortedpackets.clear();
+      spool->clear();
+      rambytes = 0;
+      raw16bitdata.clear();
+      bytesdecoded = 0;
+      word = 0;
+      expcounter = 0;
+      got_unix_time_hi = false;
+      stop_unpacker();
+      if(!start_unpacker() || !unpacker) break;
+    }
+  }
+
+  if(!stop_unpacker())
+    log_msg(LOG_ERR, "Could not decompress all of %s\n", myfilename.c_str());
+  close_file();
+}
+
+void USBstream::DecodeBuffer(const char * const data, const unsigned int n)
+{
+  forget_sent();
+
+  if(unix_time){
+    decodebytes(data, n);
+    return;
+  }
+
+  // Packets get no Unix time until the first time stamp, so go through
+  // everything again once it is found, as decodefile() does with the file.
+  // Only then do we have to keep a copy.
+  untimed.insert(untimed.end(), data, data + n);
+  if(!decodebytes(data, n)) return;
+
+  sortedpackets.clear();
+  spool->clear();
+  rambytes = 0;
+  raw16bitdata.clear();
+  word = 0;
+  expcounter = 0;
+  got_unix_time_hi = false;
+  decodebytes(&untimed[0], untimed.size());
+  std::vector<char>().swap(untimed);
+}
+
+// Throws out the packets that have already been passed on up
+void USBstream::forget_sent()
+{
+  for(unsigned int i = 0; i < nextpacket; i++)
+    rambytes -= packet_bytes(sortedpackets[i]);
+  ErasePackets(sortedpackets, 0, nextpacket);
+  nextpacket = 0;
+}
+
+// A piece of a file for decode_in_pieces(), and the 24-bit words in it
+// that raw24bit_to_raw16bit() doesn't ignore
+struct USBstream::piece {
+  const USBstream * stream;
+  const char * data;
+  unsigned int n;
+  uint32_t word;   // 'word' and 'expcounter' at the start, then at the end
+  char expcounter;
+  std::vector<uint32_t> words;
+};
+
+// Where a module packet is in the words of a file, as raw16bit_to_packets()
+// would have found it, and the Unix time it would have been given
+struct USBstream::framed_packet {
+  uint32_t start;
+  uint32_t len;
+  uint32_t timeunix;
+};
+
+// Module packets for decode_in_pieces() to make in one job
+struct USBstream::packet_job {
+  const USBstream * stream;
+  const uint16_t * words;
+  const framed_packet * framed;
+  unsigned int n;
+  std::vector<decoded_packet> packets;
+};
+
+// Turns the bytes of a piece into 24-bit words.  A job for the WorkPool.
+bool USBstream::decode_piece(void * arg)
+{
+  piece & p = *(piece *)arg;
+  p.words.reserve(p.n/4);
+  for(unsigned int i = 0; i < p.n; i++)
+    if(p.stream->add_byte(p.data[i], p.word, p.expcounter) &&
+       ((p.word >> 22) & 3) == 3)
+      p.words.push_back(p.word);
+  return false;
+}
+
+// Makes a packet_job's packets.  A job for the WorkPool.
+bool USBstream::make_packets(void * arg)
+{
+  packet_job & job = *(packet_job *)arg;
+  const USBstream & s = *job.stream;
+  job.packets.resize(job.n);
+  for(unsigned int i = 0; i < job.n; i++){
+    job.packets[i].timeunix = job.framed[i].timeunix;
+    (s.*s.packetmaker)(job.words + job.framed[i].start, job.framed[i].len,
+                       job.packets[i]);
+  }
+  return false;
+}
+
+// Does what raw24bit_to_raw16bit() and raw16bit_to_packets() would do with
+// the words of 'pieces', following the Unix time stamps and appending the
+// 16-bit words to 'words', but only finds where each module packet is,
+// in 'framed'.  Returns true if we need to rewind to the beginning of the
+// file.
+bool USBstream::frame_packets(const std::vector<piece> & pieces,
+                              std::vector<uint16_t> & words,
+                              std::vector<framed_packet> & framed)
+{
+  // Anything left from the last file is the start of a packet
+  size_t head = 0;
+
+  for(unsigned int p = 0; p < pieces.size(); p++){
+    for(unsigned int i = 0; i < pieces[p].words.size(); i++){
+      if(handle_unix_time_words(pieces[p].words[i])) return true;
+      words.push_back(pieces[p].words[i] & 0xffff);
+
+      while(head < words.size()){
+        if(words[head] == 0xffff){
+          if(words.size() - head < 2) break;
+          const unsigned int len = words[head + ADC_WIDX_MODLEN] & 0xff;
+          if(len > 0 && words.size() - head < len + 1) break;
+          if(len > 0){
+            framed_packet f;
+            f.start = head;
+            f.len = len;
+            f.timeunix = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
+            framed.push_back(f);
+            head += len + 1;
+            continue;
           }
         }
+        head++;
       }
-      else{
-        log_msg(LOG_WARNING, "Found corrupted data in file %s: "
-          "expected %d, got %d\n", myfilename.c_str(), expcounter, counter);
-        expcounter = 0;
+    }
+  }
+
+  raw16bitdata.assign(words.begin() + head, words.end());
+  return false;
+}
+
+// The loop of decodefile() for the whole of a file that isn't being
+// followed, with the work done at once by the WorkPool:
+//
+// The file is cut into pieces at bytes with a counter of 0, where
+// decodebytes() would start a new word whatever came before, and each is
+// turned into 24-bit words separately.  Then the words are gone through in
+// order to follow the Unix time stamps and find where each module packet
+// is, which is quick.  The packets are made from their words separately,
+// and then given time keys and sorted in, in order.  This gives just what
+// decodebytes() would have, rewinding included.
+void USBstream::decode_in_pieces(const unsigned int size)
+{
+  std::vector<char> data(size);
+  myFile->read(&data[0], size);
+  bytesdecoded = size;
+
+  std::vector<piece> pieces;
+  for(unsigned int begin = 0; begin < size; ){
+    unsigned int end = std::min(size, begin + piecebytes);
+    while(end < size && ((data[end] >> 6) & 3) != 0) end++;
+
+    piece p;
+    p.stream = this;
+    p.data = &data[begin];
+    p.n = end - begin;
+    p.word = pieces.empty()? word: 0;
+    p.expcounter = pieces.empty()? expcounter: 0;
+    pieces.push_back(p);
+    begin = end;
+  }
+
+  int pending = 0;
+  for(unsigned int p = 1; p < pieces.size(); p++)
+    pool->submit(poolclient, decode_piece, &pieces[p], &pending);
+  decode_piece(&pieces[0]);
+  pool->wait(poolclient, &pending);
+
+  std::vector<uint16_t> words(raw16bitdata.begin(), raw16bitdata.end());
+  std::vector<framed_packet> framed;
+  if(frame_packets(pieces, words, framed)){
+    // As decodefile() does, but we already have the words, except that the
+    // first piece started with what was left from the last file
+    if(word != 0 || expcounter != 0){
+      pieces[0].words.clear();
+      pieces[0].word = 0;
+      pieces[0].expcounter = 0;
+      decode_piece(&pieces[0]);
+    }
+    sortedpackets.clear();
+    spool->clear();
+    rambytes = 0;
+    raw16bitdata.clear();
+    got_unix_time_hi = false;
+    words.clear();
+    framed.clear();
+    frame_packets(pieces, words, framed);
+  }
+  word = pieces.back().word;
+  expcounter = pieces.back().expcounter;
+
+  for(size_t first = 0; first < framed.size(); first += PACKETS_AT_ONCE){
+    const size_t n = std::min((size_t)PACKETS_AT_ONCE, framed.size() - first);
+
+    std::vector<packet_job> jobs((n + PACKETS_PER_JOB - 1)/PACKETS_PER_JOB);
+    for(unsigned int j = 0; j < jobs.size(); j++){
+      jobs[j].stream = this;
+      jobs[j].words = &words[0];
+      jobs[j].framed = &framed[first + j*PACKETS_PER_JOB];
+      jobs[j].n = std::min((size_t)PACKETS_PER_JOB, n - j*PACKETS_PER_JOB);
+      if(j > 0) pool->submit(poolclient, make_packets, &jobs[j], &pending);
+    }
+    make_packets(&jobs[0]);
+    pool->wait(poolclient, &pending);
+
+    for(unsigned int j = 0; j < jobs.size(); j++){
+      for(unsigned int i = 0; i < jobs[j].n; i++){
+        decoded_packet & packet = jobs[j].packets[i];
+        if(setkey(packet, jobs[j].framed[i].len) && packet.tags)
+          insertsorted(packet);
       }
     }
-  }while(bytestoread != bytesleft);
+  }
+}
 
-  if(myFile->is_open()) myFile->close();
-  delete myFile;
-  myFile = NULL;
+/*
+  Undocumented input file format is revealed by inspection to be
+  constructed like this:
+
+    0                   1                   2                   3
+    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   |0 0|     A     |0 1|      B    |1 0|     C     |1 1|     D     |
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+  Where the bits of A, B, C, and D concatenated make the 24-bit words
+  described in Matt Toups' thesis.
+
+  Adds 'byte' to the word being built in 'w', whose next byte should have
+  the counter 'expected', and returns true if that finishes the word.  A
+  byte with a counter of 0 always starts a new word, whatever came before,
+  which is what lets decode_in_pieces() start anywhere there is one.
+*/
+bool USBstream::add_byte(const char byte, uint32_t & w, char & expected) const
+{
+  const char counter = (byte >> 6) & 3;
+  const char payload = byte & 0x3f;
+  if(counter == 0){
+    expected = 1;
+    w = payload;
+  }
+  else if(counter == expected){
+    w = (w << 6) | payload;
+    if(++expected == 4){
+      expected = 0;
+      return true;
+    }
+  }
+  else{
+    log_msg(LOG_WARNING, "Found corrupted data in file %s: "
+      "expected %d, got %d\n", myfilename.c_str(), expected, counter);
+    expected = 0;
+  }
+  return false;
+}
 
-  sortedpacketsptr = sortedpackets.begin();
+// Decodes 'n' bytes of the input file.  Returns true if we need to rewind
+// to the beginning of the file, in which case the rest of the bytes have
+// not been looked at.
+//
+// 'word' and 'expcounter' carry over from one call to the next, since the
+// 24-bit words don't need to be aligned with our reads.
+bool USBstream::decodebytes(const char * const data, const unsigned int n)
+{
+  for(unsigned int bytedex = 0; bytedex < n; bytedex++)
+    if(add_byte(data[bytedex], word, expcounter) &&
+       raw24bit_to_raw16bit(word)) //24-bit word stored, process it
+      return true;
+  return false;
 }
 
 /* This would be better named "process_word()". Returns true if we need
@@ -251,45 +911,247 @@ bool USBstream::raw24bit_to_raw16bit(uint32_t in24bitword)
   return false;
 }
 
-// Return true if the hits in this module packet satisfy the cuts
-bool USBstream::ThresholdCut(const bool * const allhits,
-                             const bool * const threshits)
+// Return true if the hits in this module packet satisfy the cuts.  Looks at
+// every strip rather than stopping at the first that passes, which is
+// quicker than branching on each of them.
+template<bool Both> bool USBstream::ThresholdCut(const bool * const allhits,
+                                                 const bool * const threshits)
+  const
 {
+  bool pass = false;
   for(int i = 0; i < 32; i++) {
+    const bool adjthresh = threshits[adj1[i]] | threshits[adj2[i]];
+
     // If this strip and an overlapping strip are over threshold
-    if(BothLayerThresh &&
-       threshits[i] && (threshits[adj1[i]] || threshits[adj2[i]]))
-      return true;
+    if(Both)
+      pass |= threshits[i] & adjthresh;
 
     // If this strip is hit and an overlapping strip is over threshold
     // or an overlapping strip is over threshold and this channel is hit
-    if(!BothLayerThresh &&
-       ((allhits  [i] && (threshits[adj1[i]] || threshits[adj2[i]])) ||
-        (threshits[i] && (allhits  [adj1[i]] || allhits  [adj2[i]]))))
-      return true;
+    else
+      pass |= (allhits[i] & adjthresh) |
+              (threshits[i] & (allhits[adj1[i]] | allhits[adj2[i]]));
+  }
+  return pass;
+}
+
+// EBBench times these on their own
+template bool USBstream::ThresholdCut<false>(const bool * const,
+                                             const bool * const) const;
+template bool USBstream::ThresholdCut<true>(const bool * const,
+                                            const bool * const) const;
+
+// Slot this packet into place in time order, searching from the end.
+// Leaves 'packet' empty.
+void USBstream::insertsorted(decoded_packet & packet)
+{
+  unsigned int i = sortedpackets.size();
+  while(i > 0 && LessThan(packet, sortedpackets[i-1], 0))
+    i--;
+
+  // If it goes before packets we've spilled, we need them back.  This
+  // should hardly ever happen, since we keep the newest in memory.
+  if(i == 0 && !spool->empty() && LessThan(packet, spool->back(), 0)){
+    unspill();
+    insertsorted(packet);
+    return;
+  }
+
+  rambytes += packet_bytes(packet);
+  MovePacket(sortedpackets, packet);
+  for(unsigned int j = sortedpackets.size() - 1; j > i; j--)
+    sortedpackets[j].swap(sortedpackets[j-1]);
+
+  if(membudget && rambytes > membudget) spill();
+}
+
+/*
+  Returns a key for putting this packet in time order: the number of 16ns
+  ticks since some fixed time.
+
+  The clock counter only tells us the time since the last sync pulse, and
+  the Unix time stamp is only good to a second or so, but the sync pulses
+  are more than 8s apart, so together they tell us which sync pulse it was.
+  This needs to know when the sync pulses come relative to Unix time,
+  which we guess from the first packet that has a Unix time.  The guess is
+  only as good as the Unix time stamp, but it only needs to be good to a
+  few seconds.  The sync period isn't exactly 2^29 ticks of a clock of
+  exactly CLK_HZ, so the guess would drift over a long run until keys
+  jumped by a whole period; instead, each packet moves it a sixteenth of
+  the way to where that packet puts it.  That follows any steady drift,
+  while one packet with a bad time stamp hardly moves it.
+
+  Every stream finds the same sync pulse for the same time, so keys can be
+  compared between streams.
+
+  Packets from before the first Unix time stamp go before everything else.
+  We can't tell which sync period they are in, but they all come from the
+  first moments of the run, so they are put in order around the first such
+  clock count seen by any stream, taking a smaller count to be from the
+  next sync period if that makes them closer together.
+*/
+int64_t USBstream::timekey(const decoded_packet & packet)
+{
+  const int64_t period = (int64_t)1 << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2;
+
+  // Can be a little negative once the offset is taken off
+  const int64_t count = (int32_t)packet.time16ns;
+
+  if(packet.timeunix == 0){
+    int64_t first = __atomic_load_n(firstcount, __ATOMIC_ACQUIRE);
+    if(first == NO_COUNT &&
+       __atomic_compare_exchange_n(firstcount, &first, count, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      first = count;
+
+    // Difference from the first count, between -period/2 and period/2
+    const int64_t diff = ((count - first + period/2) % period + period) % period
+                         - period/2;
+    return first + diff;
+  }
+
+  const int64_t unixticks = (int64_t)packet.timeunix * CLK_HZ;
+  if(!have_phase){
+    phase = ((unixticks - count) % period + period) % period;
+    have_phase = true;
+  }
+
+  // Nearest whole number of sync periods
+  const int64_t pulses = (unixticks - count - phase + period/2) / period;
+  phase += (unixticks - count - pulses*period - phase)/16;
+  return pulses*period + count;
+}
+
+// Sets the key of a packet of 'len' words.  The high half of the clock
+// count alone is still good to a millisecond.  One too short to have any
+// of it is put in its Unix second as best we can, at the key that the sync
+// phase gives the time stamp itself.  Returns false if it has no time
+// stamp, or there is no phase yet, so that there is nothing to place it
+// by, and it should be dropped.
+bool USBstream::setkey(decoded_packet & packet, const unsigned int len)
+{
+  if(len > ADC_WIDX_CLKHI){
+    packet.key = timekey(packet);
+    return true;
+  }
+
+  if(!packet.timeunix || !have_phase){
+    log_msg(LOG_WARNING, "Dropped a packet without a clock count from USB "
+            "%d\n", myusb);
+    return false;
+  }
+  packet.key = (int64_t)packet.timeunix*CLK_HZ - phase;
+  return true;
+}
+
+void USBstream::choose_decoder()
+{
+  alltags = singlecut = doublecut = 0;
+  for(unsigned int o = 0; o < numoutputs; o++){
+    alltags |= 1 << o;
+    if(threshmode[o] == kSingleLayer) singlecut |= 1 << o;
+    if(threshmode[o] == kDoubleLayer) doublecut |= 1 << o;
+  }
+
+  bool adjust = false;
+  for(int i = 0; i < 64; i++){
+    if(offset[i]) adjust = true;
+    for(int j = 0; j < 64; j++)
+      if(baseline[i][j]) adjust = true;
+  }
+
+  typedef void (USBstream::*PacketMaker)(const uint16_t * const,
+                                         const unsigned int,
+                                         decoded_packet &) const;
+  static const PacketMaker makers[2][2][2] = {
+    { { &USBstream::make_packet<false, false, false>,
+        &USBstream::make_packet<false, false, true > },
+      { &USBstream::make_packet<false, true,  false>,
+        &USBstream::make_packet<false, true,  true > } },
+    { { &USBstream::make_packet<true,  false, false>,
+        &USBstream::make_packet<true,  false, true > },
+      { &USBstream::make_packet<true,  true,  false>,
+        &USBstream::make_packet<true,  true,  true > } }
+  };
+  packetmaker = makers[singlecut != 0][doublecut != 0][adjust];
+}
+
+/* With neither SingleCut nor DoubleCut, as for -T 0, every packet goes to
+ * every output, so which channels are hit and over threshold isn't even
+ * worked out.  Without Adjust, all the baselines and offsets are zero. */
+template<bool SingleCut, bool DoubleCut, bool Adjust>
+void USBstream::make_packet(const uint16_t * const words,
+                            const unsigned int len,
+                            decoded_packet & packet) const
+{
+  const bool cut = SingleCut || DoubleCut;
+
+  packet.module = (words[ADC_WIDX_MODLEN] >> 8) & 0x7f;
+  if(packet.module > 63)
+    log_msg(LOG_ERR, "Invalid module number %u\n", packet.module);
+  packet.isadc = words[ADC_WIDX_MODLEN] >> 15;
+
+  unsigned int parity = 0;
+  for(unsigned int wordi = ADC_WIDX_MODLEN; wordi < len; wordi++)
+    parity ^= words[wordi];
+
+  if(len > ADC_WIDX_CLKHI)
+    packet.time16ns |= (words[ADC_WIDX_CLKHI] << 16);
+  if(len > ADC_WIDX_CLKLO) {
+    packet.time16ns |= words[ADC_WIDX_CLKLO];
+    if(Adjust && packet.module < 64)
+      packet.time16ns -= offset[packet.module];
+  }
+
+  bool allhits  [64]; // which channels were hit
+  bool threshits[MAX_OUTPUTS][64]; // and over each output's threshold
+  if(cut) {
+    memset(allhits, 0, sizeof allhits);
+    memset(threshits, 0, numoutputs*sizeof threshits[0]);
+  }
+
+  // hits start on even numbered words
+  if(packet.isadc && packet.module < 64) {
+    for(unsigned int wordi = ADC_WIDX_HIT; wordi < len; wordi += 2) {
+      const unsigned int channel = words[wordi+1];
+      if(channel >= 64) continue;
+
+      decoded_hit hit;
+      hit.channel = channel;
+      hit.charge  = Adjust?
+        words[wordi] - baseline[packet.module][channel]:
+        words[wordi];
+      packet.hits.push_back(hit);
+
+      if(cut) {
+        allhits[channel] = true;
+        for(unsigned int o = 0; o < numoutputs; o++)
+          threshits[o][channel] |= hit.charge > mythresh[o];
+      }
+    }
+  }
+
+  if(parity != words[len])
+    log_msg(LOG_WARNING, "Parity error in USB stream %d\n", myusb);
+
+  packet.tags = alltags;
+  if(cut && packet.isadc) {
+    for(unsigned int o = 0; o < numoutputs; o++) {
+      const uint8_t tag = 1 << o;
+      if(SingleCut && (singlecut & tag) &&
+         !ThresholdCut<false>(allhits, threshits[o]))
+        packet.tags &= ~tag;
+      if(DoubleCut && (doublecut & tag) &&
+         !ThresholdCut<true>(allhits, threshits[o]))
+        packet.tags &= ~tag;
+    }
   }
-  return false;
 }
 
 /* This function was called "check_data", but it is clearly not just
  * checking.  It is decoding. */
 void USBstream::raw16bit_to_packets()
 {
-  // ADC packet word indices.  As per Toups thesis:
-  //
-  // 0xffff                         | Header word
-  // 1, mod#[7 bits], wdcnt[8 bits] | Data type, module #, word count
-  // time                           | High 16 bits of 62.5 MHz clock counter
-  // time                           | Low  16 bits of 62.5 MHz clock counter
-  // adc                            | ADC ...
-  // channel                        | ... and channel number, repeated N times
-  // parity                         | Parity
-  enum ADC_WINX { ADC_WIDX_HEAD   = 0,
-                  ADC_WIDX_MODLEN = 1,
-                  ADC_WIDX_CLKHI  = 2,
-                  ADC_WIDX_CLKLO  = 3,
-                  ADC_WIDX_HIT    = 4 };
-
   // Try to decode the data in 'data'. Stop trying if 'data' is empty, or
   // if it starts out right with 0xffff but has nothing else, or if it is
   // shorter than the length it claims to have.  But otherwise, drop the
@@ -299,65 +1161,30 @@ void USBstream::raw16bit_to_packets()
 
     if(raw16bitdata.empty()) break;
 
-    // First word of all packets other than unix timestamp packets is 0xffff
+    // First word of all packets other than unix timestamp packets is
+    // 0xffff.  A length of zero can't be right, so that is dropped too.
     if(raw16bitdata[0] == 0xffff) {
       if(raw16bitdata.size() < 2) break;
 
-      unsigned int len = raw16bitdata[ADC_WIDX_MODLEN] & 0xff;
-      if(len == 0) continue;
+      const unsigned int len = raw16bitdata[ADC_WIDX_MODLEN] & 0xff;
 
       // we don't have all the data in this packet yet
-      if(raw16bitdata.size() < len + 1) break;
-
-      got_packet = true;
+      if(len > 0 && raw16bitdata.size() < len + 1) break;
 
-      unsigned int parity = 0;
-      decoded_packet packet;
-      packet.timeunix = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
-      packet.module = (raw16bitdata[ADC_WIDX_MODLEN] >> 8) & 0x7f;
-      if(packet.module > 63)
-        log_msg(LOG_ERR, "Invalid module number %u\n", packet.module);
-      packet.isadc = raw16bitdata[ADC_WIDX_MODLEN] >> 15;
-      bool allhits  [64] = {0}; // which channels were hit
-      bool threshits[64] = {0}; // which channels were hit over threshold
+      if(len > 0) {
+        got_packet = true;
 
-      for(unsigned int wordi = ADC_WIDX_MODLEN; wordi < len; wordi++){
-        parity ^= raw16bitdata[wordi];
+        uint16_t words[0x100];
+        std::copy(raw16bitdata.begin(), raw16bitdata.begin()+len+1, words);
 
-        if(wordi == ADC_WIDX_CLKHI) {
-          packet.time16ns |= (raw16bitdata[wordi] << 16);
-        }
-        else if(wordi == ADC_WIDX_CLKLO) {
-          packet.time16ns |= raw16bitdata[wordi];
-          packet.time16ns -= offset[packet.module];
-        }
-        else if(packet.isadc) { // we are in the words that give the hit info
-          // hits start on even numbered words
-          if(wordi%2 == 0 && raw16bitdata[wordi+1] < 64 && packet.module < 64) {
-            decoded_hit hit;
-            hit.channel = raw16bitdata[wordi+1];
-            hit.charge  = raw16bitdata[wordi] - baseline[packet.module][hit.channel];
-            packet.hits.push_back(hit);
-
-            allhits[hit.channel] = true;
-            if(hit.charge > mythresh) threshits[hit.channel] = true;
-          }
-        }
-      }
-
-      if(parity != raw16bitdata[len])
-        log_msg(LOG_WARNING, "Parity error in USB stream %d\n", myusb);
+        decoded_packet packet;
+        packet.timeunix = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
+        (this->*packetmaker)(words, len, packet);
+        if(setkey(packet, len) && packet.tags) insertsorted(packet);
 
-      if(!UseThresh || !packet.isadc || ThresholdCut(allhits, threshits)){
-        // Slot this packet into place in time order, searching from the end
-        std::vector<decoded_packet>::iterator i = sortedpackets.end();
-        while(i != sortedpackets.begin() && LessThan(packet, *(i-1), 0))
-          i--;
-        sortedpackets.insert(i, packet);
+        //delete the data that we've decoded into 'packet'
+        raw16bitdata.erase(raw16bitdata.begin(), raw16bitdata.begin()+len+1);
       }
-
-      //delete the data that we've decoded into 'packet'
-      raw16bitdata.erase(raw16bitdata.begin(), raw16bitdata.begin()+len+1);
     }
 
     if(!got_packet) raw16bitdata.pop_front();
@@ -2,54 +2,497 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h> // For htons, htonl
 
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <deque>
 #include <vector>
 
 #include "USBstreamUtils.h"
+#include "USBstream.h"
+#include "SPSCQueue.h"
 
-void log_msg(const int priority, const char * const format, ...)
+//------------------------------------------------------------------------------
+// Logging
+//
+// Once start_log() has been called, messages are formatted on the calling
+// thread and put on a lock-free queue belonging to that thread.  A
+// background thread takes them off all the queues and does the slow part,
+// printing them and sending them to syslog.  So a thread that logs a lot,
+// like a decoder chewing through corrupted data, never waits for syslog.
+//
+// Each place in the code that logs (told apart by its format string) may log
+// LOG_RATE_LIMIT messages per second.  After that, its messages are counted
+// instead of logged, and the count is logged once a second.
+//
+// Fatal messages are not queued.  Everything queued before them is logged
+// first, then they are logged and we exit.
+
+// Most messages per second from one place in the code
+static const unsigned int LOG_RATE_LIMIT = 10;
+
+// Longest message, including the trailing null.  Longer ones are cut short.
+static const unsigned int LOG_MAX_LEN = 512;
+
+// How many places in the code we can rate limit, and how many threads can
+// have queues at once.  Past these, messages are not rate limited or not
+// queued, respectively.
+static const unsigned int LOG_SITES = 256;
+static const unsigned int LOG_QUEUES = 64;
+
+// How long the background thread sleeps when there is nothing to log,
+// in microseconds
+static const int LOG_POLL_US = 10000;
+
+struct LogRecord {
+  uint64_t seq; // For putting messages from different threads in order
+  int priority;
+  char text[LOG_MAX_LEN];
+};
+
+static bool operator<(const LogRecord & a, const LogRecord & b)
 {
-  va_list ap;
-  va_start(ap, format);
-  vprintf(format, ap);
-  va_end(ap);
+  return a.seq < b.seq;
+}
+
+struct LogQueue {
+  int in_use;    // Whether a thread owns this queue.  __atomic only.
+  uint64_t lost; // Messages dropped because the queue was full.  __atomic only.
+  SPSCQueue<LogRecord, 64> records;
+};
+
+// A place in the code that logs, and how much it has logged lately.  All
+// members are only touched with __atomic builtins.
+struct LogSite {
+  const char * format;
+  int64_t second;      // The second 'count' refers to
+  uint32_t count;      // Messages in that second
+  uint32_t suppressed; // Messages not logged since the last summary
+};
+
+static LogSite log_sites[LOG_SITES];
+static LogQueue log_queues[LOG_QUEUES];
+static uint64_t log_seq = 0; // __atomic only
+
+static __thread LogQueue * thread_log_queue = NULL;
+
+// Put in front of this thread's messages, if not NULL.  See set_log_name().
+static __thread const char * log_name = NULL;
+static pthread_key_t log_queue_key;
+
+static pthread_t log_thread;
+static bool log_running = false;  // Whether log_thread is going.  __atomic only.
+static bool log_stopping = false; // Tells log_thread to finish up.  __atomic only.
+static pthread_mutex_t log_stop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_log(const int priority, const char * const text)
+{
+  fputs(text, stdout);
 
   // Always send the message to syslog, regardless of level. Syslog
   // policy set by the machine administrator determines which priority
   // levels actually get written to the log.  See
   // https://www.gnu.org/software/libc/manual/html_node/Syslog.html
-  va_start(ap, format);
-  vsyslog(LOG_MAKEPRI(LOG_DAEMON, priority), format, ap);
-  va_end(ap);
+  syslog(LOG_MAKEPRI(LOG_DAEMON, priority), "%s", text);
+}
+
+// Returns this format string's entry in log_sites, or NULL if there's no room
+static LogSite * find_log_site(const char * const format)
+{
+  const unsigned int start = ((uintptr_t)format >> 3) % LOG_SITES;
+  for(unsigned int i = 0; i < LOG_SITES; i++){
+    LogSite * const site = &log_sites[(start + i) % LOG_SITES];
+    const char * f = __atomic_load_n(&site->format, __ATOMIC_ACQUIRE);
+    if(f == format) return site;
+    if(f == NULL &&
+       (__atomic_compare_exchange_n(&site->format, &f, format, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+        || f == format))
+      return site;
+  }
+  return NULL;
+}
+
+// Returns false if this message is over the rate limit for its site
+static bool log_allowed(const char * const format)
+{
+  LogSite * const site = find_log_site(format);
+  if(site == NULL) return true;
+
+  const int64_t now = time(NULL);
+  int64_t then = __atomic_load_n(&site->second, __ATOMIC_ACQUIRE);
+  if(then != now &&
+     __atomic_compare_exchange_n(&site->second, &then, now, false,
+                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELEASE);
+
+  if(__atomic_add_fetch(&site->count, 1, __ATOMIC_ACQ_REL) <= LOG_RATE_LIMIT)
+    return true;
+
+  __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+// Gives a thread's queue back when the thread exits
+static void release_log_queue(void * q)
+{
+  __atomic_store_n(&((LogQueue *)q)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Returns this thread's queue, or NULL if there aren't any left.  A queue
+// given back by a thread that has exited may still have messages in it,
+// but since that thread is gone, there is still only one producer.
+static LogQueue * get_log_queue()
+{
+  if(thread_log_queue) return thread_log_queue;
+
+  for(unsigned int i = 0; i < LOG_QUEUES; i++){
+    int free = 0;
+    if(__atomic_compare_exchange_n(&log_queues[i].in_use, &free, 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+      thread_log_queue = &log_queues[i];
+      pthread_setspecific(log_queue_key, thread_log_queue);
+      return thread_log_queue;
+    }
+  }
+  return NULL;
+}
+
+// For drain_log_queues().  Not a static in the function, since that would
+// be destroyed at exit before stop_log() has stopped the thread using it.
+static std::vector<LogRecord> log_batch;
+
+// Logs everything waiting in the queues, in order.  Returns the number
+// of messages logged.
+static unsigned int drain_log_queues()
+{
+  std::vector<LogRecord> & batch = log_batch;
+  batch.clear();
+
+  for(unsigned int i = 0; i < LOG_QUEUES; i++){
+    LogRecord r;
+    while(log_queues[i].records.pop(r)) batch.push_back(r);
+
+    const uint64_t lost = __atomic_exchange_n(&log_queues[i].lost, 0,
+                                              __ATOMIC_RELAXED);
+    if(lost){
+      char text[LOG_MAX_LEN];
+      snprintf(text, sizeof text, "Log queue full: lost %lu messages\n",
+               (unsigned long)lost);
+      write_log(LOG_WARNING, text);
+    }
+  }
+
+  std::sort(batch.begin(), batch.end());
+  for(unsigned int i = 0; i < batch.size(); i++)
+    write_log(batch[i].priority, batch[i].text);
+
+  return batch.size();
+}
+
+// Logs how many messages were suppressed at each site since last time
+static void log_suppressed()
+{
+  for(unsigned int i = 0; i < LOG_SITES; i++){
+    const char * const format =
+      __atomic_load_n(&log_sites[i].format, __ATOMIC_ACQUIRE);
+    if(format == NULL) continue;
+
+    const uint32_t n = __atomic_exchange_n(&log_sites[i].suppressed, 0,
+                                           __ATOMIC_RELAXED);
+    if(n == 0) continue;
+
+    // Show the format string itself, without its newline, since we don't
+    // have the arguments
+    const unsigned int len = strcspn(format, "\n");
+    char text[LOG_MAX_LEN];
+    snprintf(text, sizeof text, "%u more messages like \"%.*s\" suppressed\n",
+             n, std::min(len, LOG_MAX_LEN - 64), format);
+    write_log(LOG_NOTICE, text);
+  }
+}
+
+static void * log_thread_loop(void *)
+{
+  time_t last_summary = time(NULL);
+  while(true){
+    const bool stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+
+    const unsigned int n = drain_log_queues();
+
+    if(stopping || time(NULL) != last_summary){
+      log_suppressed();
+      last_summary = time(NULL);
+    }
+
+    // Having seen the flag before draining, everything queued before it
+    // was set is now out.
+    if(stopping) break;
+
+    if(n == 0) usleep(LOG_POLL_US);
+  }
+  fflush(stdout);
+  return NULL;
+}
 
+// Logs everything still queued and goes back to logging synchronously.
+// Called at exit.
+static void stop_log()
+{
+  pthread_mutex_lock(&log_stop_lock);
+  if(__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+    __atomic_store_n(&log_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&log_stop_lock);
+}
+
+void log_msg(const int priority, const char * const format, ...)
+{
   // On Linux, more severe levels are lower numbers, but nothing I've
   // read suggests that this is standardized, so check individually.
-  if(priority == LOG_CRIT || priority == LOG_ALERT || priority == LOG_EMERG)
-    exit(1);
+  const bool fatal =
+    priority == LOG_CRIT || priority == LOG_ALERT || priority == LOG_EMERG;
+
+  if(!fatal && !log_allowed(format)) return;
+
+  LogRecord r;
+  unsigned int n = 0;
+  if(log_name != NULL)
+    n = std::min((unsigned int)snprintf(r.text, sizeof r.text, "[%s] ", log_name),
+                 (unsigned int)sizeof r.text - 1);
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(r.text + n, sizeof r.text - n, format, ap);
+  va_end(ap);
+
+  if(!fatal && __atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+    LogQueue * const q = get_log_queue();
+    if(q){
+      r.seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+      r.priority = priority;
+      if(!q->records.push(r))
+        __atomic_add_fetch(&q->lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  // Get out everything that came before this first
+  if(fatal) stop_log();
+
+  write_log(priority, r.text);
+
+  if(fatal) exit(1);
+}
+
+void set_log_name(const char * const name)
+{
+  log_name = name;
 }
 
 void start_log()
 {
   openlog("OV EBuilder", LOG_NDELAY, LOG_USER);
+
+  pthread_key_create(&log_queue_key, release_log_queue);
+  if(pthread_create(&log_thread, NULL, log_thread_loop, NULL) == 0){
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    atexit(stop_log);
+  }
+
   log_msg(LOG_NOTICE, "OV Event Builder Started\n");
 }
 
-/* Returns true if the packet 'lhs' is earlier in time than 'rhs' */
-bool LessThan(const decoded_packet & lhs,
-              const decoded_packet & rhs, const int ClockSlew)
+// Appends the bytes of 'x' to 'buf'
+template<typename T> static void put_bytes(std::vector<char> & buf, const T & x)
+{
+  buf.insert(buf.end(), (const char *)&x, (const char *)&x + sizeof x);
+}
+
+// Reads the bytes of 'x' from 'p' and moves 'p' along
+template<typename T> static void get_bytes(const char * & p, T & x)
+{
+  memcpy(&x, p, sizeof x);
+  p += sizeof x;
+}
+
+// Size of an encoded packet without its hits, and of each hit
+static const unsigned int ENCODED_PACKET_SIZE = 22;
+static const unsigned int ENCODED_HIT_SIZE = 3;
+
+void EncodePacket(const decoded_packet & packet, std::vector<char> & buf)
+{
+  put_bytes(buf, (uint8_t)packet.isadc);
+  put_bytes(buf, packet.module);
+  put_bytes(buf, packet.timeunix);
+  put_bytes(buf, packet.time16ns);
+  put_bytes(buf, packet.key);
+  put_bytes(buf, packet.tags);
+  put_bytes(buf, (uint16_t)packet.hits.size());
+  for(unsigned int h = 0; h < packet.hits.size(); h++){
+    put_bytes(buf, packet.hits[h].channel);
+    put_bytes(buf, packet.hits[h].charge);
+  }
+}
+
+unsigned int DecodePacket(const char * const p, const unsigned int len,
+                          decoded_packet & packet)
 {
-  const int64_t dt_unix = (int64_t)lhs.timeunix - rhs.timeunix;
+  if(len < ENCODED_PACKET_SIZE) return 0;
+
+  uint16_t nhits;
+  memcpy(&nhits, p + ENCODED_PACKET_SIZE - sizeof nhits, sizeof nhits);
+  const unsigned int size = ENCODED_PACKET_SIZE + nhits*ENCODED_HIT_SIZE;
+  if(len < size) return 0;
+
+  const char * q = p;
+  uint8_t isadc;
+  get_bytes(q, isadc);
+  packet.isadc = isadc;
+  get_bytes(q, packet.module);
+  get_bytes(q, packet.timeunix);
+  get_bytes(q, packet.time16ns);
+  get_bytes(q, packet.key);
+  get_bytes(q, packet.tags);
+  get_bytes(q, nhits);
+  packet.hits.resize(nhits);
+  for(unsigned int h = 0; h < nhits; h++){
+    get_bytes(q, packet.hits[h].channel);
+    get_bytes(q, packet.hits[h].charge);
+  }
+  return size;
+}
+
+// Makes sure 'vec' has room for 'n' packets without copying any
+static void reserve_packets(std::vector<decoded_packet> & vec, const size_t n)
+{
+  if(vec.capacity() >= n) return;
+  std::vector<decoded_packet> bigger;
+  bigger.reserve(std::max(n, 2*vec.size()));
+  bigger.resize(vec.size());
+  for(unsigned int i = 0; i < vec.size(); i++) bigger[i].swap(vec[i]);
+  vec.swap(bigger);
+}
+
+void GrowPackets(std::vector<decoded_packet> & vec)
+{
+  reserve_packets(vec, std::max((size_t)16, vec.size() + 1));
+}
+
+void MovePackets(std::vector<decoded_packet> & to,
+                 std::vector<decoded_packet> & from)
+{
+  if(to.empty()){
+    to.swap(from);
+  }
+  else{
+    reserve_packets(to, to.size() + from.size());
+    for(unsigned int i = 0; i < from.size(); i++) MovePacket(to, from[i]);
+  }
+  from.clear();
+}
+
+void ErasePackets(std::vector<decoded_packet> & vec, const unsigned int first,
+                  const unsigned int last)
+{
+  if(first == last) return;
+  unsigned int to = first;
+  for(unsigned int from = last; from < vec.size(); from++, to++)
+    vec[to].swap(vec[from]);
+  vec.resize(to);
+}
+
+void SerializeEvent(const decoded_packet * const packets,
+                    const unsigned int npackets,
+                    const uint16_t * const modules, std::vector<char> & buf,
+                    const uint8_t mask)
+{
+  unsigned int first = 0, nwanted = 0;
+  for(unsigned int packeti = npackets; packeti-- > 0; )
+    if(packets[packeti].tags & mask){
+      first = packeti;
+      nwanted++;
+    }
+
+  OVEventHeader evheader;
+  evheader.time_sec = packets[first].timeunix;
+  evheader.n_ov_data_packets = nwanted;
+  evheader.serialize(buf);
+
+  for(unsigned int packeti = first; packeti < npackets; packeti++){
+    const decoded_packet & packet = packets[packeti];
+    if(!(packet.tags & mask)) continue;
+
+    // Not supported, and there's already been a complaint about it
+    if(!packet.isadc) continue;
+
+    OVDataPacketHeader moduleheader;
+    moduleheader.nHits = packet.hits.size();
+    moduleheader.module = modules[packeti];
+    moduleheader.time16ns = packet.time16ns;
+    moduleheader.serialize(buf);
+
+    for(int m = 0; m < moduleheader.nHits; m++) {
+      OVHitData hit;
+      hit.channel = packet.hits[m].channel;
+      hit.charge  = packet.hits[m].charge;
+      hit.serialize(buf);
+    }
+  }
+}
+
+// Modules per USB stream and channels per module, as in
+// USBstream::SetBaseline()
+static const int maxModules = 64;
+static const int numChannels = 64;
+
+bool CalculatePedestal(int baseptr[maxModules][numChannels],
+                       const std::vector<decoded_packet> & BaselineData)
+{
+  double baseline[maxModules][numChannels] = {};
+  int counter[maxModules][numChannels] = {};
+
+  for(std::vector<decoded_packet>::const_iterator I = BaselineData.begin();
+      I != BaselineData.end();
+      I++) {
+
+    const int module = I->module;
+
+    if(!I->isadc) continue;
 
-  if(labs(dt_unix) > 1) return dt_unix < 0; // Timestamps are not adjacent
+    if(module >= maxModules){
+      log_msg(LOG_ERR, "Module number requested (%d) out of range (0-%d) "
+        "in calculate pedestal\n", module, maxModules-1);
+      return false;
+    }
 
-  const int64_t dt_16ns = (int64_t)lhs.time16ns - rhs.time16ns;
+    for(unsigned int i = 0; i < I->hits.size(); i++) {
+      const int charge = I->hits[i].charge;
+      const int channel = I->hits[i].channel;
+      if(channel >= numChannels){
+        log_msg(LOG_ERR, "Channel number requested (%d) out of range "
+          "(0-%d) in calculate pedestal\n", channel, numChannels-1);
+        return false;
+      }
 
-  // Found comment "Was sync pulse 2sec (sqrd)"
-  // I do not understand what that means.  Is this supposed to be 0x2000 such
-  // that this indicates a clock overflow after missing a sync pulse?  That
-  // produces different results.
-  if(labs(dt_16ns) > 2000 * (1 << 16)) return dt_16ns > 0;
+      // Should these be modified to better handle large numbers of baseline
+      // triggers?
+      baseline[module][channel] = (baseline[module][channel]*
+        counter[module][channel] + charge)/(counter[module][channel]+1);
+      counter[module][channel]++;
+    }
+  }
 
-  return dt_16ns < -ClockSlew;
+  for(int i = 0; i < maxModules; i++)
+    for(int j = 0; j < numChannels; j++)
+      baseptr[i][j] = (int)baseline[i][j];
+  return true;
 }
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "WorkPool.h"
+
+// For take(): a job of any client, or counting towards anything
+static const unsigned int ANY_CLIENT = ~0u;
+
+// Now, in microseconds on the monotonic clock
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+WorkPool::WorkPool()
+{
+  nextclient = 0;
+  pthread_mutex_init(&lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&changed, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+bool WorkPool::start(const unsigned int nthreads)
+{
+  for(unsigned int i = 0; i < nthreads; i++){
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, run, this)){
+      log_msg(LOG_ERR, "Could not start worker thread %u\n", i);
+      return false;
+    }
+    threads.push_back(thread);
+  }
+  return true;
+}
+
+unsigned int WorkPool::add_client()
+{
+  pthread_mutex_lock(&lock);
+  queues.resize(queues.size() + 1);
+  const unsigned int client = queues.size() - 1;
+  pthread_mutex_unlock(&lock);
+  return client;
+}
+
+void WorkPool::submit(const unsigned int client, Job job, void * arg,
+                      int * pending, const unsigned int again_us)
+{
+  entry e;
+  e.client = client;
+  e.job = job;
+  e.arg = arg;
+  e.pending = pending;
+  e.again_us = again_us;
+  e.not_before = 0;
+
+  __atomic_add_fetch(pending, 1, __ATOMIC_ACQ_REL);
+
+  pthread_mutex_lock(&lock);
+  queues[client].push_back(e);
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+// With the lock held, takes the first job that is ready to run from
+// 'client', or from whichever client is next in turn if ANY_CLIENT, that
+// counts towards 'pending', or anything if NULL.  Returns false if there
+// isn't one, in which case 'wake' is when the next will be ready, or 0 if
+// none are waiting to be run again.
+bool WorkPool::take(const unsigned int client, const int * const pending,
+                    entry & e, uint64_t & wake)
+{
+  const uint64_t now = now_us();
+  wake = 0;
+
+  const unsigned int nclients = queues.size();
+  for(unsigned int n = 0; n < nclients; n++){
+    const unsigned int c =
+      client == ANY_CLIENT? (nextclient + n)%nclients: client;
+    std::deque<entry> & q = queues[c];
+
+    for(unsigned int i = 0; i < q.size(); i++){
+      if(pending != NULL && q[i].pending != pending) continue;
+      if(q[i].not_before > now){
+        if(wake == 0 || q[i].not_before < wake) wake = q[i].not_before;
+        continue;
+      }
+      e = q[i];
+      q.erase(q.begin() + i);
+      if(client == ANY_CLIENT) nextclient = (c + 1)%nclients;
+      return true;
+    }
+
+    if(client != ANY_CLIENT) break;
+  }
+  return false;
+}
+
+// With the lock held, puts 'e' back in the queue if it is to be run again,
+// or counts it as finished
+void WorkPool::finish(entry & e, const bool again)
+{
+  if(again){
+    e.not_before = now_us() + e.again_us;
+    queues[e.client].push_back(e);
+  }
+  else{
+    __atomic_sub_fetch(e.pending, 1, __ATOMIC_RELEASE);
+  }
+  pthread_cond_broadcast(&changed);
+}
+
+// With the lock held, waits for something to change, or until 'wake'
+void WorkPool::sleep(const uint64_t wake)
+{
+  if(wake == 0){
+    pthread_cond_wait(&changed, &lock);
+    return;
+  }
+
+  struct timespec ts;
+  ts.tv_sec = wake/1000000;
+  ts.tv_nsec = (wake%1000000)*1000;
+  pthread_cond_timedwait(&changed, &lock, &ts);
+}
+
+void * WorkPool::run(void * pool)
+{
+  WorkPool & p = *(WorkPool *)pool;
+
+  pthread_mutex_lock(&p.lock);
+  while(true){
+    entry e;
+    uint64_t wake;
+    if(!p.take(ANY_CLIENT, NULL, e, wake)){
+      p.sleep(wake);
+      continue;
+    }
+
+    pthread_mutex_unlock(&p.lock);
+    const bool again = e.job(e.arg);
+    pthread_mutex_lock(&p.lock);
+
+    p.finish(e, again);
+  }
+  return NULL;
+}
+
+void WorkPool::wait(const unsigned int client, int * pending)
+{
+  pthread_mutex_lock(&lock);
+  while(__atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0){
+    entry e;
+    uint64_t wake;
+    if(!take(client, pending, e, wake)){
+      sleep(wake);
+      continue;
+    }
+
+    pthread_mutex_unlock(&lock);
+    const bool again = e.job(e.arg);
+    pthread_mutex_lock(&lock);
+
+    finish(e, again);
+  }
+  pthread_mutex_unlock(&lock);
+}